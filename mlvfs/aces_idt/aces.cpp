@@ -3,6 +3,7 @@
 #include <libraw/libraw.h>
 #include <OpenEXR/half.h>
 #include "resource_manager.h"
+#include "bufpool.h"
 #include "aces_idt/dng_idt.h"
 #include <algorithm>
 
@@ -161,7 +162,7 @@ extern "C" void process_aces(struct frame_headers * frame_headers, struct image_
     }
 
     free(out_buffer);
-    free(image_buffer->header);
+    bufpool_free(image_buffer->header);
     image_buffer->header = NULL;
     image_buffer->header_size = 0;
 
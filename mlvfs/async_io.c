@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "async_io.h"
+#include "bufpool.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/*
+ * Reads the payloads of compressed (LJ92/LZMA) frames ahead of time. A compressed frame can only
+ * be decoded once its whole VIDF payload is in memory, so when the prefetcher knows which frames
+ * come next, their payloads are all requested at once and get_image_data() only has to wait for
+ * the one it is about to decode. On high latency storage (network shares) that keeps many
+ * requests in flight instead of one at a time.
+ *
+ * With liburing the reads go through an io_uring, otherwise a small thread pool does them.
+ */
+
+enum async_read_state
+{
+    ASYNC_READ_QUEUED,
+    ASYNC_READ_IN_FLIGHT,
+    ASYNC_READ_DONE,
+    ASYNC_READ_FAILED
+};
+
+struct async_read
+{
+    struct async_read * next;
+    struct mlv_chunks * chunks;     /* holds a reference until the read is freed */
+    uint32_t chunk;
+    uint64_t offset;
+    size_t size;
+    size_t done;                    /* bytes read so far */
+    uint8_t * buffer;
+    int state;
+    int taken;                      /* get_image_data() is waiting for it */
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct async_read * async_reads = NULL;  /* oldest first */
+static int async_read_count = 0;
+static size_t async_read_bytes = 0;
+static int async_running = 0;
+static int halt_async = 0;
+
+static pthread_t async_workers[ASYNC_IO_THREADS];
+static int async_worker_count = 0;
+
+#ifdef HAVE_LIBURING
+static struct io_uring async_ring;
+static int async_ring_ready = 0;
+static int async_ring_in_flight = 0;
+static pthread_t async_reaper;
+#endif
+
+static void free_async_read(struct async_read * read)
+{
+    if(read == async_reads)
+    {
+        async_reads = read->next;
+    }
+    else
+    {
+        for(struct async_read * current = async_reads; current != NULL; current = current->next)
+        {
+            if(current->next == read)
+            {
+                current->next = read->next;
+                break;
+            }
+        }
+    }
+    async_read_count--;
+    async_read_bytes -= read->size;
+    mlvfs_release_chunks(read->chunks);
+    bufpool_free(read->buffer);
+    free(read);
+}
+
+static struct async_read * find_async_read(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, size_t size)
+{
+    for(struct async_read * current = async_reads; current != NULL; current = current->next)
+    {
+        if(!current->taken && current->chunk == chunk && current->offset == offset && current->size == size &&
+           (current->chunks == chunks || !strcmp(current->chunks->path, chunks->path)))
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+//drops the oldest finished reads nobody picked up (the reader went elsewhere) until size fits
+static int make_room(size_t size)
+{
+    while(async_read_count >= MAX_ASYNC_READS || async_read_bytes + size > MAX_ASYNC_READ_BYTES)
+    {
+        struct async_read * oldest = NULL;
+        for(struct async_read * current = async_reads; current != NULL; current = current->next)
+        {
+            if(!current->taken && (current->state == ASYNC_READ_DONE || current->state == ASYNC_READ_FAILED))
+            {
+                oldest = current;
+                break;
+            }
+        }
+        if(!oldest) return 0;
+        free_async_read(oldest);
+    }
+    return 1;
+}
+
+static void finish_async_read(struct async_read * read, int state)
+{
+    read->state = state;
+    pthread_cond_broadcast(&async_done_cond);
+}
+
+#ifdef HAVE_LIBURING
+
+static int async_ring_submit(struct async_read * read)
+{
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&async_ring);
+    if(!sqe) return 0;
+
+    io_uring_prep_read(sqe, read->chunks->fds[read->chunk], read->buffer + read->done, (unsigned)(read->size - read->done), read->offset + read->done);
+    io_uring_sqe_set_data(sqe, read);
+    if(io_uring_submit(&async_ring) < 0) return 0;
+
+    read->state = ASYNC_READ_IN_FLIGHT;
+    async_ring_in_flight++;
+    return 1;
+}
+
+//collects the completions, until async_io_stop() sends a NOP and all reads are back
+static void * async_reap(void * arg)
+{
+    int stopping = 0;
+    while(1)
+    {
+        struct io_uring_cqe * cqe = NULL;
+        int ret = io_uring_wait_cqe(&async_ring, &cqe);
+        if(ret == -EINTR) continue;
+        if(ret < 0)
+        {
+            err_printf("io_uring_wait_cqe error: %s\n", strerror(-ret));
+            break;
+        }
+
+        struct async_read * read = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&async_ring, cqe);
+
+        pthread_mutex_lock(&async_mutex);
+        if(read)
+        {
+            async_ring_in_flight--;
+            if(res > 0) read->done += res;
+
+            if(read->done == read->size)
+            {
+                finish_async_read(read, ASYNC_READ_DONE);
+            }
+            else if(halt_async || (res <= 0 && res != -EINTR && res != -EAGAIN) || !async_ring_submit(read))
+            {
+                //a read error or the end of the file, get_image_data() reads it again and reports it
+                finish_async_read(read, ASYNC_READ_FAILED);
+            }
+        }
+        else
+        {
+            stopping = 1;
+        }
+        int finished = stopping && !async_ring_in_flight;
+        pthread_mutex_unlock(&async_mutex);
+
+        if(finished) break;
+    }
+    return NULL;
+}
+
+#endif
+
+static void * async_run(void * arg)
+{
+    pthread_mutex_lock(&async_mutex);
+    while(1)
+    {
+        struct async_read * read = NULL;
+        while(!halt_async)
+        {
+            for(read = async_reads; read != NULL && read->state != ASYNC_READ_QUEUED; read = read->next);
+            if(read) break;
+            pthread_cond_wait(&async_queue_cond, &async_mutex);
+        }
+        if(halt_async) break;
+
+        read->state = ASYNC_READ_IN_FLIGHT;
+        pthread_mutex_unlock(&async_mutex);
+
+        size_t bytes_read = mlvfs_read_chunk(read->chunks, read->chunk, read->buffer, read->size, read->offset);
+
+        pthread_mutex_lock(&async_mutex);
+        read->done = bytes_read;
+        finish_async_read(read, bytes_read == read->size ? ASYNC_READ_DONE : ASYNC_READ_FAILED);
+    }
+    pthread_mutex_unlock(&async_mutex);
+    return NULL;
+}
+
+void async_read_payloads(const char * mlv_path, const int * frames, int count)
+{
+    if(!async_running || count <= 0) return;
+
+    struct mlv_chunks * chunks = mlvfs_open_chunks(mlv_path);
+    if(!chunks) return;
+
+    for(int i = 0; i < count; i++)
+    {
+        struct frame_headers frame_headers;
+        if(!mlv_get_frame_headers(mlv_path, frames[i], &frame_headers)) break;
+
+        //uncompressed frames are read in pieces as they are requested, see get_image_data()
+        if(!(frame_headers.file_hdr.videoClass & (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92))) break;
+        if(frame_headers.fileNumber >= chunks->chunk_count) break;
+
+        size_t size = frame_headers.vidf_hdr.blockSize - (frame_headers.vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
+        uint64_t offset = frame_headers.position + frame_headers.vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t);
+
+        pthread_mutex_lock(&async_mutex);
+        if(async_running && !find_async_read(chunks, frame_headers.fileNumber, offset, size) && make_room(size))
+        {
+            struct async_read * read = calloc(1, sizeof(struct async_read));
+            uint8_t * buffer = bufpool_alloc(size);
+            if(read && buffer)
+            {
+                mlvfs_retain_chunks(chunks);
+                read->chunks = chunks;
+                read->chunk = frame_headers.fileNumber;
+                read->offset = offset;
+                read->size = size;
+                read->buffer = buffer;
+                read->state = ASYNC_READ_QUEUED;
+
+                struct async_read * tail = async_reads;
+                while(tail && tail->next) tail = tail->next;
+                if(tail) tail->next = read;
+                else async_reads = read;
+                async_read_count++;
+                async_read_bytes += size;
+
+#ifdef HAVE_LIBURING
+                if(async_ring_ready)
+                {
+                    if(!async_ring_submit(read)) finish_async_read(read, ASYNC_READ_FAILED);
+                }
+                else
+#endif
+                {
+                    pthread_cond_signal(&async_queue_cond);
+                }
+            }
+            else
+            {
+                free(read);
+                bufpool_free(buffer);
+            }
+        }
+        pthread_mutex_unlock(&async_mutex);
+    }
+
+    mlvfs_release_chunks(chunks);
+}
+
+uint8_t * async_take_payload(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, size_t size)
+{
+    uint8_t * buffer = NULL;
+
+    pthread_mutex_lock(&async_mutex);
+    struct async_read * read = async_running ? find_async_read(chunks, chunk, offset, size) : NULL;
+    if(read)
+    {
+        read->taken = 1;
+        while(read->state == ASYNC_READ_QUEUED || read->state == ASYNC_READ_IN_FLIGHT)
+        {
+            pthread_cond_wait(&async_done_cond, &async_mutex);
+        }
+        if(read->state == ASYNC_READ_DONE)
+        {
+            buffer = read->buffer;
+            read->buffer = NULL;
+        }
+        free_async_read(read);
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    return buffer;
+}
+
+void async_io_start(void)
+{
+    if(async_running) return;
+    halt_async = 0;
+
+#ifdef HAVE_LIBURING
+    //room for every read plus the NOP that stops the reaper
+    int ret = io_uring_queue_init(MAX_ASYNC_READS * 2, &async_ring, 0);
+    if(!ret)
+    {
+        if(!pthread_create(&async_reaper, NULL, async_reap, NULL))
+        {
+            async_ring_ready = 1;
+            async_running = 1;
+            return;
+        }
+        io_uring_queue_exit(&async_ring);
+    }
+    else
+    {
+        dbg_printf("io_uring is not available (%s), reading with threads\n", strerror(-ret));
+    }
+#endif
+
+    for(async_worker_count = 0; async_worker_count < ASYNC_IO_THREADS; async_worker_count++)
+    {
+        if(pthread_create(&async_workers[async_worker_count], NULL, async_run, NULL)) break;
+    }
+    async_running = async_worker_count > 0;
+}
+
+void async_io_stop(void)
+{
+    if(!async_running) return;
+
+    pthread_mutex_lock(&async_mutex);
+    halt_async = 1;
+    async_running = 0;
+    //nobody is going to start these anymore
+    for(struct async_read * current = async_reads; current != NULL; current = current->next)
+    {
+        if(current->state == ASYNC_READ_QUEUED) finish_async_read(current, ASYNC_READ_FAILED);
+    }
+    pthread_cond_broadcast(&async_queue_cond);
+
+#ifdef HAVE_LIBURING
+    if(async_ring_ready)
+    {
+        struct io_uring_sqe * sqe = io_uring_get_sqe(&async_ring);
+        if(sqe)
+        {
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, NULL);
+            io_uring_submit(&async_ring);
+        }
+    }
+#endif
+    pthread_mutex_unlock(&async_mutex);
+
+    //reads that are in flight finish first
+#ifdef HAVE_LIBURING
+    if(async_ring_ready)
+    {
+        pthread_join(async_reaper, NULL);
+        io_uring_queue_exit(&async_ring);
+        async_ring_ready = 0;
+    }
+#endif
+    for(int i = 0; i < async_worker_count; i++)
+    {
+        pthread_join(async_workers[i], NULL);
+    }
+    async_worker_count = 0;
+
+    pthread_mutex_lock(&async_mutex);
+    struct async_read * next = NULL;
+    for(struct async_read * current = async_reads; current != NULL; current = next)
+    {
+        next = current->next;
+        //a taken one is freed by whoever is waiting for it
+        if(!current->taken) free_async_read(current);
+    }
+    pthread_mutex_unlock(&async_mutex);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_async_io_h
+#define mlvfs_async_io_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct mlv_chunks;
+
+//payloads in flight or waiting to be picked up
+#define MAX_ASYNC_READS 16
+#define MAX_ASYNC_READ_BYTES (256 * 1024 * 1024)
+//size of the thread pool used when io_uring is not available
+#define ASYNC_IO_THREADS 4
+
+void async_io_start(void);
+void async_io_stop(void);
+
+//starts reading the compressed payloads of these frames, all at once
+void async_read_payloads(const char * mlv_path, const int * frames, int count);
+
+//the payload if it was read ahead (waits for it if it is still in flight), NULL otherwise; bufpool_free() it after use
+uint8_t * async_take_payload(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, size_t size);
+
+#endif
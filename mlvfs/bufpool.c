@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* MADV_HUGEPAGE */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "bufpool.h"
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+ * Every frame that is rendered needs the same handful of large buffers: the image itself, the
+ * compressed payload, and the scratch planes of the post processing. The sizes only depend on
+ * the resolution of the clip, so instead of handing them back to the system after each frame
+ * (and faulting fresh pages in for the next one), freed buffers are kept and given out again.
+ * Sizes are rounded up to a size class (1/8 steps between powers of two), buffers of the same
+ * class are interchangeable. When idle buffers would take more than --buffer-pool=%d MB, the
+ * ones of the size classes that weren't used for the longest time are released first, e.g. those
+ * of the previous clip.
+ */
+
+//sizes below this many pages are classes of their own
+#define BUFPOOL_EXACT_PAGES 16
+
+//in the page in front of every buffer
+struct bufpool_block
+{
+    struct bufpool_block * next;
+    struct bufpool_class * size_class;
+};
+
+struct bufpool_class
+{
+    struct bufpool_class * next;
+    size_t size;
+    struct bufpool_block * idle;
+    uint64_t last_used;
+};
+
+static pthread_mutex_t bufpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_class * bufpool_classes = NULL;
+static size_t bufpool_max_idle_size = (size_t)DEFAULT_BUFFER_POOL_SIZE * 1024 * 1024;
+static size_t bufpool_idle_size = 0;
+static int bufpool_huge_pages = 0;
+static uint64_t bufpool_clock = 0;
+static uint64_t bufpool_hits = 0;
+static uint64_t bufpool_misses = 0;
+
+static size_t get_class_size(size_t size)
+{
+    if(size > SIZE_MAX / 4) return 0;
+
+    size_t pages = MAX(1, (size + BUFPOOL_PAGE_SIZE - 1) / BUFPOOL_PAGE_SIZE);
+    if(pages >= BUFPOOL_EXACT_PAGES)
+    {
+        //keep the top 3 bits, so at most 12.5% is wasted
+        int shift = 0;
+        while((pages >> shift) >= 16) shift++;
+        size_t step = (size_t)1 << shift;
+        pages = (pages + step - 1) & ~(step - 1);
+    }
+    return pages * BUFPOOL_PAGE_SIZE;
+}
+
+static struct bufpool_class * get_class(size_t size)
+{
+    for(struct bufpool_class * current = bufpool_classes; current != NULL; current = current->next)
+    {
+        if(current->size == size) return current;
+    }
+
+    struct bufpool_class * size_class = calloc(1, sizeof(struct bufpool_class));
+    if(!size_class) return NULL;
+    size_class->size = size;
+    size_class->next = bufpool_classes;
+    bufpool_classes = size_class;
+    return size_class;
+}
+
+static void * system_alloc(size_t size, size_t alignment)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    void * memory = NULL;
+    return posix_memalign(&memory, alignment, size) ? NULL : memory;
+#endif
+}
+
+static void system_free(void * memory)
+{
+#if defined(_WIN32)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+static struct bufpool_block * new_block(struct bufpool_class * size_class)
+{
+    size_t size = BUFPOOL_PAGE_SIZE + size_class->size;
+    size_t alignment = BUFPOOL_PAGE_SIZE;
+    int huge = bufpool_huge_pages && size >= BUFPOOL_HUGE_PAGE_SIZE;
+    if(huge)
+    {
+        //only whole, aligned huge pages can be used for it
+        alignment = BUFPOOL_HUGE_PAGE_SIZE;
+        size = (size + BUFPOOL_HUGE_PAGE_SIZE - 1) & ~(size_t)(BUFPOOL_HUGE_PAGE_SIZE - 1);
+    }
+
+    struct bufpool_block * block = system_alloc(size, alignment);
+    if(!block)
+    {
+        //the idle buffers of other sizes may be what's in the way
+        bufpool_release_all();
+        block = system_alloc(size, alignment);
+        if(!block) return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    //just a hint, the kernel falls back to normal pages if it has no huge pages available
+    if(huge) madvise(block, size, MADV_HUGEPAGE);
+#endif
+    block->next = NULL;
+    block->size_class = size_class;
+    return block;
+}
+
+static void free_blocks(struct bufpool_block * blocks)
+{
+    struct bufpool_block * next = NULL;
+    for(struct bufpool_block * current = blocks; current != NULL; current = next)
+    {
+        next = current->next;
+        system_free(current);
+    }
+}
+
+/**
+ * Takes idle buffers out of the pool until it has room for another size bytes, least recently
+ * used size classes first; they are added to *released, for free_blocks() outside of the lock
+ */
+static void make_room(size_t size, struct bufpool_block ** released)
+{
+    while(bufpool_idle_size > 0 && bufpool_idle_size + size > bufpool_max_idle_size)
+    {
+        struct bufpool_class * oldest = NULL;
+        for(struct bufpool_class * current = bufpool_classes; current != NULL; current = current->next)
+        {
+            if(current->idle && (!oldest || current->last_used < oldest->last_used)) oldest = current;
+        }
+        if(!oldest) break;
+
+        struct bufpool_block * block = oldest->idle;
+        oldest->idle = block->next;
+        bufpool_idle_size -= oldest->size;
+        block->next = *released;
+        *released = block;
+    }
+}
+
+void bufpool_configure(size_t max_idle_size, int huge_pages)
+{
+    struct bufpool_block * released = NULL;
+    pthread_mutex_lock(&bufpool_mutex);
+    bufpool_max_idle_size = max_idle_size;
+    bufpool_huge_pages = huge_pages;
+    make_room(0, &released);
+    pthread_mutex_unlock(&bufpool_mutex);
+    free_blocks(released);
+}
+
+void * bufpool_alloc(size_t size)
+{
+    size_t class_size = get_class_size(size);
+    if(!class_size) return NULL;
+
+    pthread_mutex_lock(&bufpool_mutex);
+    struct bufpool_class * size_class = get_class(class_size);
+    struct bufpool_block * block = NULL;
+    if(size_class)
+    {
+        size_class->last_used = ++bufpool_clock;
+        block = size_class->idle;
+        if(block)
+        {
+            size_class->idle = block->next;
+            bufpool_idle_size -= class_size;
+            bufpool_hits++;
+        }
+        else
+        {
+            bufpool_misses++;
+        }
+    }
+    pthread_mutex_unlock(&bufpool_mutex);
+
+    if(!size_class) return NULL;
+    if(!block) block = new_block(size_class);
+    if(!block) return NULL;
+    block->next = NULL;
+    return (uint8_t *)block + BUFPOOL_PAGE_SIZE;
+}
+
+void * bufpool_calloc(size_t count, size_t size)
+{
+    if(size && count > SIZE_MAX / size) return NULL;
+    void * buffer = bufpool_alloc(count * size);
+    if(buffer) memset(buffer, 0, count * size);
+    return buffer;
+}
+
+void bufpool_free(void * buffer)
+{
+    if(!buffer) return;
+
+    struct bufpool_block * block = (struct bufpool_block *)((uint8_t *)buffer - BUFPOOL_PAGE_SIZE);
+    struct bufpool_class * size_class = block->size_class;
+    struct bufpool_block * released = NULL;
+
+    pthread_mutex_lock(&bufpool_mutex);
+    size_class->last_used = ++bufpool_clock;
+    if(size_class->size <= bufpool_max_idle_size)
+    {
+        make_room(size_class->size, &released);
+        block->next = size_class->idle;
+        size_class->idle = block;
+        bufpool_idle_size += size_class->size;
+    }
+    else
+    {
+        block->next = NULL;
+        released = block;
+    }
+    pthread_mutex_unlock(&bufpool_mutex);
+
+    free_blocks(released);
+}
+
+void bufpool_get_stats(uint64_t * hits, uint64_t * misses, uint64_t * idle_size)
+{
+    pthread_mutex_lock(&bufpool_mutex);
+    if(hits) *hits = bufpool_hits;
+    if(misses) *misses = bufpool_misses;
+    if(idle_size) *idle_size = bufpool_idle_size;
+    pthread_mutex_unlock(&bufpool_mutex);
+}
+
+void bufpool_release_all(void)
+{
+    struct bufpool_block * released = NULL;
+    pthread_mutex_lock(&bufpool_mutex);
+    for(struct bufpool_class * current = bufpool_classes; current != NULL; current = current->next)
+    {
+        struct bufpool_block * next = NULL;
+        for(struct bufpool_block * block = current->idle; block != NULL; block = next)
+        {
+            next = block->next;
+            block->next = released;
+            released = block;
+        }
+        current->idle = NULL;
+    }
+    bufpool_idle_size = 0;
+    pthread_mutex_unlock(&bufpool_mutex);
+    free_blocks(released);
+}
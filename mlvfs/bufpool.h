@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_bufpool_h
+#define mlvfs_bufpool_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//default for --buffer-pool=%d, how much memory idle buffers may hold on to (MB)
+#define DEFAULT_BUFFER_POOL_SIZE 128
+//buffers are aligned to this, and allocated in multiples of it
+#define BUFPOOL_PAGE_SIZE 4096
+//with --huge-pages, buffers at least this large are aligned to it and backed by huge pages
+#define BUFPOOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Sets up the pool, call before the first allocation
+ * @param max_idle_size The memory idle buffers may keep (bytes), 0 hands every buffer back to the system
+ * @param huge_pages Whether large buffers should be backed by huge pages (Linux only)
+ */
+void bufpool_configure(size_t max_idle_size, int huge_pages);
+
+//a page aligned buffer of at least size bytes, recycled from an earlier one of the same size class if possible
+void * bufpool_alloc(size_t size);
+//same as bufpool_alloc(), zeroed
+void * bufpool_calloc(size_t count, size_t size);
+//for buffers from bufpool_alloc() / bufpool_calloc() only, NULL is ignored
+void bufpool_free(void * buffer);
+
+void bufpool_get_stats(uint64_t * hits, uint64_t * misses, uint64_t * idle_size);
+//hands all idle buffers back to the system
+void bufpool_release_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
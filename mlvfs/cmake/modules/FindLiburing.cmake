@@ -0,0 +1,29 @@
+# - Find liburing
+# Find the io_uring userspace library <https://github.com/axboe/liburing>
+# This module defines
+#  LIBURING_FOUND, if liburing was found
+#  Liburing_INCLUDE_DIR, where to find liburing.h
+#  Liburing_LIBRARIES, the libraries needed to use liburing
+
+FIND_PACKAGE(PkgConfig)
+
+IF(PKG_CONFIG_FOUND)
+   PKG_CHECK_MODULES(PC_LIBURING QUIET liburing)
+ENDIF()
+
+FIND_PATH(Liburing_INCLUDE_DIR liburing.h
+          HINTS
+          ${PC_LIBURING_INCLUDEDIR}
+          ${PC_LIBURING_INCLUDE_DIRS}
+         )
+
+FIND_LIBRARY(Liburing_LIBRARIES NAMES uring
+             HINTS
+             ${PC_LIBURING_LIBDIR}
+             ${PC_LIBURING_LIBRARY_DIRS}
+            )
+
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(Liburing DEFAULT_MSG Liburing_LIBRARIES Liburing_INCLUDE_DIR)
+
+MARK_AS_ADVANCED(Liburing_INCLUDE_DIR Liburing_LIBRARIES)
@@ -20,6 +20,7 @@
 
 #include "gif.h"
 #include "index.h"
+#include "resource_manager.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -85,10 +86,8 @@ size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, si
     if(mlv_get_frame_headers(path, 0, &frame_headers))
     {
         int frame_count = mlv_get_frame_count(path);
-        FILE **chunk_files = NULL;
-        uint32_t chunk_count = 0;
-        chunk_files = load_chunks(path, &chunk_count);
-        if(!chunk_files || !chunk_count)
+        struct mlv_chunks * chunks = mlvfs_open_chunks(path);
+        if(!chunks)
         {
             return 0;
         }
@@ -146,6 +145,7 @@ size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, si
             if (!image_data)
             {
                 free(gif_buffer);
+                mlvfs_release_chunks(chunks);
                 return 0;
             }
 
@@ -161,7 +161,7 @@ size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, si
                     err_printf("GIF Error: could not get MLV frame headers\n");
                     continue;
                 }
-                get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_data, 0, image_data_size);
+                get_image_data(&frame_headers, chunks, (uint8_t*) image_data, 0, image_data_size);
                 
                 //image headers
                 memwrite(gif_buffer, gif_animation_graphics_block, position, sizeof(gif_animation_graphics_block));
@@ -207,12 +207,12 @@ size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, si
             memcpy(output_buffer, gif_buffer + offset, MIN(max_size, gif_size - offset));
             free(gif_buffer);
             free(image_data);
-            close_chunks(chunk_files, chunk_count);
+            mlvfs_release_chunks(chunks);
             return max_size;
         }
         else
         {
-            close_chunks(chunk_files, chunk_count);
+            mlvfs_release_chunks(chunks);
             err_printf("malloc error (requested size: %zu)\n", image_data_size);
         }
     }
@@ -23,10 +23,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 #include "raw.h"
 #include "mlv.h"
 #include "mlvfs.h"
+#include "index.h"
+#include "resource_manager.h"
 
 /* helper macros */
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -59,6 +69,93 @@ typedef struct
     uint16_t    frameType;
 } frame_xref_t;
 
+/*
+ * The CHNK block follows the XREF block. It records which recording and which state of
+ * its chunk files the index was made from, so the IDX can be validated without a rescan.
+ */
+typedef struct
+{
+    uint8_t     blockType[4];   /* "CHNK" */
+    uint32_t    blockSize;
+    uint64_t    timestamp;      /* unused */
+    uint64_t    fileGuid;       /* fileGuid of the recording */
+    uint32_t    chunkCount;     /* number of chunk_info_t entries that follow */
+    uint32_t    reserved;
+ /* chunk_info_t chunks[chunkCount]; */
+} chunk_info_hdr_t;
+
+typedef struct
+{
+    uint64_t    size;           /* file size when indexed */
+    uint64_t    scanned;        /* end of the last complete block, indexing of appended data resumes here */
+    int64_t     mtime;
+} chunk_info_t;
+
+/* result of check_index() */
+#define INDEX_OUTDATED  0
+#define INDEX_CURRENT   1
+#define INDEX_APPENDED  2
+
+/*
+ * IDX files have an FTBL block after the XREF and CHNK blocks. It holds the resolved frame
+ * table: the deduplicated metadata snapshots, one entry per VIDF and one per AUDF, so a
+ * clip can be opened with a single read of the IDX. Older readers just skip the block.
+ * A block of another FRAME_TABLE_VERSION is ignored and replaced.
+ * Version 2 was the first one, version 3 added xrefCount to find out if the table is outdated.
+ */
+#define FRAME_TABLE_VERSION 3
+
+#pragma pack(push,1)
+
+typedef struct
+{
+    uint8_t     blockType[4];   /* "FTBL" */
+    uint32_t    blockSize;
+    uint64_t    timestamp;      /* unused */
+    uint32_t    version;        /* FRAME_TABLE_VERSION */
+    uint32_t    frameCount;     /* number of VIDF entries that follow */
+    uint32_t    headerCount;    /* number of metadata snapshots that follow */
+    uint32_t    audioCount;     /* number of AUDF entries that follow */
+    uint64_t    audioSize;      /* total size of all AUDF payloads */
+    uint32_t    xrefCount;      /* number of XREF entries the table was built from */
+    uint32_t    reserved;
+    mlv_wavi_hdr_t wavi_hdr;    /* zeroed if there is no audio */
+ /* frame_table_headers_t headers[headerCount]; */
+ /* frame_table_frame_t frames[frameCount]; */
+ /* frame_table_audio_t audio[audioCount]; */
+} frame_table_hdr_t;
+
+typedef struct
+{
+    mlv_file_hdr_t file_hdr;
+    mlv_rtci_hdr_t rtci_hdr;
+    mlv_idnt_hdr_t idnt_hdr;
+    mlv_rawi_hdr_t rawi_hdr;
+    mlv_expo_hdr_t expo_hdr;
+    mlv_lens_hdr_t lens_hdr;
+    mlv_wbal_hdr_t wbal_hdr;
+} frame_table_headers_t;
+
+typedef struct
+{
+    uint16_t    fileNumber;
+    uint16_t    reserved;
+    uint32_t    headers;        /* index of the metadata snapshot */
+    uint64_t    frameOffset;
+    mlv_vidf_hdr_t vidf_hdr;
+} frame_table_frame_t;
+
+typedef struct
+{
+    uint16_t    fileNumber;
+    uint16_t    reserved;
+    uint32_t    length;         /* payload size */
+    uint64_t    frameOffset;    /* file offset of the payload itself */
+    uint64_t    audioOffset;    /* offset of the payload within the audio stream */
+} frame_table_audio_t;
+
+#pragma pack(pop)
+
 void xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
 {
     /* make sure there is no crappy pointer before using */
@@ -97,23 +194,37 @@ void xref_sort(frame_xref_t *table, uint32_t entries)
     } while (n > 1);
 }
 
-mlv_xref_hdr_t *load_index(const char *base_filename)
+/**
+ * Make sure you free() the result!!!
+ */
+static char *index_filename(const char *base_filename)
 {
     size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
     char * filename = (char*)malloc(filename_size);
-    
+
     if(!filename)
     {
         err_printf("malloc error (requested size %zu)\n", filename_size);
         return NULL;
     }
     strncpy(filename, base_filename, filename_size);
+    strcpy(&filename[strlen(filename) - 3], "IDX");
+
+    return filename;
+}
+
+mlv_xref_hdr_t *load_index(const char *base_filename)
+{
+    char * filename = index_filename(base_filename);
+    
+    if(!filename)
+    {
+        return NULL;
+    }
     
     mlv_xref_hdr_t *block_hdr = NULL;
     FILE *in_file = NULL;
 
-    strcpy(&filename[strlen(filename) - 3], "IDX");
-
     in_file = fopen(filename, "rb");
     
     free(filename);
@@ -172,28 +283,84 @@ mlv_xref_hdr_t *load_index(const char *base_filename)
     return block_hdr;
 }
 
-void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index)
+CREATE_MUTEX(index_file_mutex)
+static uint32_t index_file_count = 0;
+
+/**
+ * Opens a new IDX file for writing. It is written to a temporary file that commit_index_file()
+ * renames over the old one, so a reader (e.g. load_frame_table() in another thread) never
+ * sees a half written file. Every writer gets a temporary file of its own (by process id and a
+ * counter), two threads writing the IDX of the same clip at once just replace it one after the other
+ * @return NULL on failure, else pass the result and *temp_filename to commit_index_file()
+ */
+static FILE *create_index_file(const char *filename, char **temp_filename)
 {
-    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
-    char * filename = (char*)malloc(filename_size);
+    *temp_filename = NULL;
+#ifndef _WIN32
+    uint32_t count = 0;
+    RELOCK(index_file_mutex)
+    {
+        count = index_file_count++;
+    }
+    UNLOCK(index_file_mutex)
+
+    size_t temp_filename_size = strlen(filename) + 32;
+    *temp_filename = (char*)malloc(temp_filename_size);
+    if(!*temp_filename)
+    {
+        return NULL;
+    }
+    /* keep the .IDX extension, so it is hidden from directory listings like the IDX itself */
+    snprintf(*temp_filename, temp_filename_size, "%.*s.%ld.%u.tmp.IDX", (int)(strlen(filename) - 4), filename, (long)getpid(), count);
+    FILE *out_file = fopen(*temp_filename, "wb+");
+    if(!out_file)
+    {
+        free(*temp_filename);
+        *temp_filename = NULL;
+    }
+    return out_file;
+#else
+    return fopen(filename, "wb+");
+#endif
+}
+
+/**
+ * Closes a file from create_index_file() and puts it in place of the old IDX file, unless ok is 0
+ */
+static void commit_index_file(FILE *out_file, const char *filename, char *temp_filename, int ok)
+{
+    if(fclose(out_file)) ok = 0;
+
+    if(temp_filename)
+    {
+        if(!ok || rename(temp_filename, filename))
+        {
+            if(ok)
+            {
+                int err = errno;
+                err_printf("rename('%s') error: %s\n", temp_filename, strerror(err));
+            }
+            remove(temp_filename);
+        }
+        free(temp_filename);
+    }
+}
+
+void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index, chunk_info_t *chunk_info)
+{
+    char * filename = index_filename(base_filename);
     
     if(!filename)
     {
-        err_printf("malloc error (requested size %zu)\n", filename_size);
         return;
     }
-    strncpy(filename, base_filename, filename_size);
-    
-    FILE *out_file = NULL;
-
-    strcpy(&filename[strlen(filename) - 3], "IDX");
-
-    out_file = fopen(filename, "wb+");
     
-    free(filename);
+    char * temp_filename = NULL;
+    FILE *out_file = create_index_file(filename, &temp_filename);
 
     if (!out_file)
     {
+        free(filename);
         return;
     }
 
@@ -206,267 +373,896 @@ void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fil
     file_hdr.audioFrameCount = 0;
     file_hdr.fileNum = fileCount + 1;
 
-    fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file);
+    int ok = fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file) == 1;
+
+    ok = ok && fwrite(index, index->blockSize, 1, out_file) == 1;
 
-    fwrite(index, index->blockSize, 1, out_file);
+    /* then the state of the chunks that were indexed */
+    if(chunk_info)
+    {
+        chunk_info_hdr_t chunk_info_hdr;
+        memset(&chunk_info_hdr, 0, sizeof(chunk_info_hdr_t));
+        memcpy(chunk_info_hdr.blockType, "CHNK", 4);
+        chunk_info_hdr.blockSize = (uint32_t)(sizeof(chunk_info_hdr_t) + fileCount * sizeof(chunk_info_t));
+        chunk_info_hdr.fileGuid = ref_file_hdr->fileGuid;
+        chunk_info_hdr.chunkCount = fileCount;
+
+        ok = ok && fwrite(&chunk_info_hdr, sizeof(chunk_info_hdr_t), 1, out_file) == 1;
+        ok = ok && (!fileCount || fwrite(chunk_info, sizeof(chunk_info_t), fileCount, out_file) == (size_t)fileCount);
+    }
 
-    fclose(out_file);
+    commit_index_file(out_file, filename, temp_filename, ok);
+    free(filename);
 }
 
-mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count)
+/* at most this many chunks are scanned at the same time */
+#define MAX_INDEX_THREADS 8
+
+/* block headers are parsed from windows of this size, payload beyond the end of a window is never read */
+#define INDEX_WINDOW_SIZE (16 * 1024 * 1024)
+/* used instead when blocks are so large that a full window would be mostly payload */
+#define INDEX_SMALL_WINDOW_SIZE (64 * 1024)
+#define INDEX_WINDOW_ALIGNMENT 4096
+
+/* throughput of the index scans, see get_index_scan_stats() */
+CREATE_MUTEX(index_stats_mutex)
+static uint64_t index_stats_bytes = 0;
+static double index_stats_seconds = 0;
+
+void get_index_scan_stats(uint64_t *bytes, double *seconds)
 {
-    mlv_xref_hdr_t *index = NULL;
-    frame_xref_t *frame_xref_table = NULL;
-    uint32_t frame_xref_entries = 0;
-    uint32_t frame_xref_allocated = 0;
-    mlv_file_hdr_t main_header;
-    memset(&main_header, 0, sizeof(mlv_file_hdr_t));
+    RELOCK(index_stats_mutex)
+    {
+        *bytes = index_stats_bytes;
+        *seconds = index_stats_seconds;
+    }
+    UNLOCK(index_stats_mutex)
+}
 
-    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+/* reads at an absolute position without touching a shared file position */
+static size_t file_read_at(FILE *stream, void *buffer, size_t size, uint64_t offset)
+{
+#if defined(_WIN32)
+    /* every worker has its own chunk, so seeking is safe here */
+    if(_fseeki64(stream, offset, SEEK_SET)) return 0;
+    return fread(buffer, 1, size, stream);
+#else
+    ssize_t result = pread(fileno(stream), buffer, size, (off_t)offset);
+    return result < 0 ? 0 : (size_t)result;
+#endif
+}
+
+/* the blocks of a single chunk, as found by index_chunk() */
+struct chunk_index
+{
+    FILE *file;
+    uint32_t chunk;
+    frame_xref_t *entries;
+    uint32_t entry_count;
+    uint32_t allocated;
+    mlv_file_hdr_t file_hdr;    /* the MLVI header of this chunk */
+    uint32_t file_hdr_entry;    /* how many entries were indexed before the MLVI header */
+    int has_file_hdr;
+    uint64_t start;             /* where to start scanning */
+    uint64_t end;               /* end of the last complete block */
+    uint64_t size;
+    int64_t mtime;
+};
+
+struct index_job
+{
+    LOCK_T mutex;
+    struct chunk_index *chunks;
+    uint32_t chunk_count;
+    uint32_t next_chunk;
+};
+
+static void index_chunk(struct chunk_index *chunk_index)
+{
+    uint64_t position = chunk_index->start;
+    FILE *in_file = chunk_index->file;
+
+#if defined(_WIN32)
+    struct _stat64 file_stat;
+    if(!_fstat64(_fileno(in_file), &file_stat))
+#else
+    struct stat file_stat;
+    if(!fstat(fileno(in_file), &file_stat))
+#endif
     {
-        int64_t position = 0;
+        chunk_index->size = file_stat.st_size;
+        chunk_index->mtime = file_stat.st_mtime;
+    }
 
-        file_set_pos(chunk_files[chunk], 0, SEEK_SET);
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(in_file), (off_t)position, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(_WIN32)
+    int fd = _fileno(in_file);
+#else
+    int fd = fileno(in_file);
+#endif
 
-        while(1)
+    size_t window_size = INDEX_WINDOW_SIZE;
+    uint8_t *window = (uint8_t *)malloc(window_size);
+    if(!window)
+    {
+        window_size = INDEX_SMALL_WINDOW_SIZE;
+        window = (uint8_t *)malloc(window_size);
+        if(!window)
         {
-            mlv_hdr_t buf;
-            uint64_t timestamp = 0;
-            size_t read;
+            err_printf("malloc error (requested size %zu)\n", window_size);
+            chunk_index->end = position;
+            return;
+        }
+    }
+    uint64_t window_start = 0;
+    uint64_t window_length = 0;
+    uint32_t block_count = 0;
+
+    while(1)
+    {
+        mlv_hdr_t buf;
+        uint64_t timestamp = 0;
 
-            if((read = fread(&buf, sizeof(mlv_hdr_t), 1, chunk_files[chunk])) != 1)
+        /* refill the window if the block header is not (completely) in it */
+        if(position < window_start || position + sizeof(mlv_hdr_t) > window_start + window_length)
+        {
+            if(position + sizeof(mlv_hdr_t) > chunk_index->size)
             {
-                if(ferror(chunk_files[chunk]))
-                {
-                    int err = errno;
-                    err_printf("File #%d, %zu bytes read, fread error: %s\n", chunk, read, strerror(err));
-                }
                 break;
             }
 
-            /* unexpected block header size? */
-            if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
+            /* with large blocks, skip the payload by only reading a little at each header */
+            uint64_t average_block_size = block_count ? (position - chunk_index->start) / block_count : 0;
+            size_t read_size = average_block_size > window_size / 4 ? MIN(INDEX_SMALL_WINDOW_SIZE, window_size) : window_size;
+
+            /* --drop-behind: a multi-TB ingest should not push everything else out of the page cache */
+            uint64_t next_window_start = position & ~(uint64_t)(INDEX_WINDOW_ALIGNMENT - 1);
+            if(next_window_start > window_start)
+            {
+                mlvfs_advise_fd(fd, window_start, MIN(window_length, next_window_start - window_start), MLVFS_IO_DONTNEED);
+            }
+
+            window_start = next_window_start;
+            window_length = file_read_at(in_file, window, (size_t)MIN(read_size, chunk_index->size - window_start), window_start);
+
+            /* --readahead: the next full window is read while this one is parsed */
+            if(read_size == window_size)
+            {
+                mlvfs_advise_fd(fd, window_start + window_length, window_size, MLVFS_IO_WILLNEED);
+            }
+
+            if(position + sizeof(mlv_hdr_t) > window_start + window_length)
             {
-                err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, position);
+                int err = errno;
+                err_printf("File #%d, read error at 0x%08llX: %s\n", chunk_index->chunk, (unsigned long long)position, strerror(err));
                 break;
             }
+        }
+
+        memcpy(&buf, &window[position - window_start], sizeof(mlv_hdr_t));
+
+        /* unexpected block header size? */
+        if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
+        {
+            err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, (unsigned long long)position);
+            break;
+        }
+
+        /* block not completely written yet (e.g. the file is still being copied), it is picked up once the file grew */
+        if(position + buf.blockSize > chunk_index->size)
+        {
+            break;
+        }
 
-            /* file header */
-            if(!memcmp(buf.blockType, "MLVI", 4))
+        /* file header */
+        if(!memcmp(buf.blockType, "MLVI", 4))
+        {
+            if(!chunk_index->has_file_hdr)
             {
-                mlv_file_hdr_t file_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
 
-                file_set_pos(chunk_files[chunk], position, SEEK_SET);
-
                 /* read the whole header block, but limit size to either our local type size or the written block size */
-                if(fread(&file_hdr, hdr_size, 1, chunk_files[chunk]) != 1)
-                {
-                    //bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
-                    break;
-                }
-
-                /* is this the first file? */
-                if(file_hdr.fileNum == 0)
+                memset(&chunk_index->file_hdr, 0, sizeof(mlv_file_hdr_t));
+                if(position + hdr_size <= window_start + window_length)
                 {
-                    memcpy(&main_header, &file_hdr, sizeof(mlv_file_hdr_t));
+                    memcpy(&chunk_index->file_hdr, &window[position - window_start], hdr_size);
                 }
-                else
+                else if(file_read_at(in_file, &chunk_index->file_hdr, hdr_size, position) != hdr_size)
                 {
-                    /* no, its another chunk */
-                    if(main_header.fileGuid != file_hdr.fileGuid)
-                    {
-                        //bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
-                        break;
-                    }
+                    break;
                 }
-
-                /* emulate timestamp zero (will overwrite version string) */
-                timestamp = 0;
-            }
-            else
-            {
-                /* all other blocks have a timestamp */
-                timestamp = buf.timestamp;
+                chunk_index->has_file_hdr = 1;
+                chunk_index->file_hdr_entry = chunk_index->entry_count;
             }
 
-            /* dont index NULL blocks */
-            if(memcmp(buf.blockType, "NULL", 4))
+            /* emulate timestamp zero (will overwrite version string) */
+            timestamp = 0;
+        }
+        else
+        {
+            /* all other blocks have a timestamp */
+            timestamp = buf.timestamp;
+        }
+
+        /* dont index NULL blocks */
+        if(memcmp(buf.blockType, "NULL", 4))
+        {
+            xref_resize(&chunk_index->entries, chunk_index->entry_count + 1, &chunk_index->allocated);
+            if(!chunk_index->entries)
             {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = chunk;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
+                err_printf("malloc error\n");
+                chunk_index->entry_count = 0;
+                break;
             }
 
-            position += buf.blockSize;
-            file_set_pos(chunk_files[chunk], position, SEEK_SET);
+            /* add xref data */
+            frame_xref_t *entry = &chunk_index->entries[chunk_index->entry_count];
+            entry->frameTime = timestamp;
+            entry->frameOffset = position;
+            entry->fileNumber = chunk_index->chunk;
+            entry->frameType =
+                !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
+                !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
+                MLV_FRAME_UNSPECIFIED;
+
+            chunk_index->entry_count++;
         }
-    }
-
-    xref_sort(frame_xref_table, frame_xref_entries);
-
-    size_t size = sizeof(mlv_xref_hdr_t) + frame_xref_entries * sizeof(mlv_xref_t);
-    index = (mlv_xref_hdr_t *)malloc(size);
-    if (!index)
-    {
-        free(frame_xref_table);
-        return NULL;
-    }
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
 
-    memset(index, 0, size);
-    memcpy(index->blockType, "XREF", 4);
-    index->blockSize = (uint32_t)size;
-    index->entryCount = frame_xref_entries;
-
-    for(uint32_t entry = 0; entry < frame_xref_entries; entry++)
-    {
-        xrefs[entry].frameOffset = frame_xref_table[entry].frameOffset;
-        xrefs[entry].fileNumber = frame_xref_table[entry].fileNumber;
-        xrefs[entry].frameType = frame_xref_table[entry].frameType;
+        position += buf.blockSize;
+        block_count++;
     }
 
-    free(frame_xref_table);
+    free(window);
+    mlvfs_advise_fd(fd, window_start, window_length, MLVFS_IO_DONTNEED);
+    chunk_index->end = position;
 
-    return index;
+    /* blocks within a chunk are almost in order already, so this is cheap */
+    xref_sort(chunk_index->entries, chunk_index->entry_count);
 }
 
-void build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_count)
+static void *index_worker(void *arg)
 {
-    // read the MLVI header from the first file
-    // TODO: add some error checking
-    mlv_file_hdr_t main_header;
-    file_set_pos(chunk_files[0], 0, SEEK_SET);
-    if(!fread(&main_header, sizeof(mlv_file_hdr_t), 1, chunk_files[0]))
+    struct index_job *job = (struct index_job *)arg;
+
+    while(1)
     {
-        if(ferror(chunk_files[0]))
-        {
-            int err = errno;
-            err_printf("fread error: %s\n", strerror(err));
-        }
-        else
+        uint32_t chunk = 0;
+        RELOCK(job->mutex)
         {
-            err_printf("could not read main header\n");
+            chunk = job->next_chunk++;
         }
-    }
+        UNLOCK(job->mutex)
 
-    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count);
-    save_index(base_filename, &main_header, chunk_count, index);
+        if(chunk >= job->chunk_count) break;
 
-    free(index);
+        index_chunk(&job->chunks[chunk]);
+    }
+    return NULL;
 }
 
-FILE **load_chunks(const char *base_filename, uint32_t *entries)
+/**
+ * Scans all chunks in parallel (each one on its own thread, up to MAX_INDEX_THREADS), then merges
+ * the per chunk tables by timestamp. Equal timestamps keep the chunk order, like a serial scan would.
+ * If chunk_info is given, each chunk is scanned from its 'scanned' offset on and chunk_info is updated
+ * to the state that was indexed. file_guid is the GUID chunks are checked against if the first file
+ * is not part of the scan, it is updated with the GUID of the first file otherwise.
+ */
+static mlv_xref_hdr_t *scan_chunks(FILE **chunk_files, uint32_t chunk_count, chunk_info_t *chunk_info, uint64_t *file_guid)
 {
-    uint32_t seq_number = 0;
-    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
-    char * filename = (char*)malloc(filename_size);
+    mlv_xref_hdr_t *index = NULL;
+    struct index_job job;
 
-    if(!filename)
+    memset(&job, 0, sizeof(struct index_job));
+    job.chunk_count = chunk_count;
+    job.chunks = (struct chunk_index *)calloc(chunk_count, sizeof(struct chunk_index));
+    if(!job.chunks)
     {
-        err_printf("malloc error (requested size %zu)\n", filename_size);
         return NULL;
     }
-    *entries = 0;
-
-    strncpy(filename, base_filename, filename_size);
-    FILE **files = (FILE **)malloc(sizeof(FILE*));
 
-    files[0] = fopen(filename, "rb");
-    if (!files[0])
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
     {
-        int err = errno;
-        err_printf("fopen('%s') error: %s\n", filename, strerror(err));
-        return NULL;
+        job.chunks[chunk].file = chunk_files[chunk];
+        job.chunks[chunk].chunk = chunk;
+        job.chunks[chunk].start = chunk_info ? chunk_info[chunk].scanned : 0;
     }
 
-    (*entries)++;
-    while(seq_number < 99)
+    INIT_LOCK(job.mutex);
+
+    double scan_start = mlvfs_time();
+    THREAD_T threads[MAX_INDEX_THREADS];
+    uint32_t thread_count = 0;
+    for(uint32_t i = 0; i < MIN(chunk_count, MAX_INDEX_THREADS) - 1; i++)
     {
-        files = (FILE **)realloc(files, (*entries + 1) * sizeof(FILE*));
+        if(pthread_create(&threads[thread_count], NULL, index_worker, &job)) break;
+        thread_count++;
+    }
 
-        /* check for the next file M00, M01 etc */
-        char seq_name[3];
+    /* this thread takes part as well, so the scan also works if no thread could be created */
+    index_worker(&job);
 
-        #if defined(_WIN32)
-        _snprintf(seq_name, 3, "%02d", seq_number);
-        #else
-        snprintf(seq_name, 3, "%02d", seq_number);
-        #endif
-        seq_number++;
+    for(uint32_t i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    DESTROY_LOCK(job.mutex);
 
-        strcpy(&filename[strlen(filename) - 2], seq_name);
+    uint64_t scanned_bytes = 0;
+    double scan_seconds = mlvfs_time() - scan_start;
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        scanned_bytes += job.chunks[chunk].end - job.chunks[chunk].start;
+    }
+    RELOCK(index_stats_mutex)
+    {
+        index_stats_bytes += scanned_bytes;
+        index_stats_seconds += scan_seconds;
+    }
+    UNLOCK(index_stats_mutex)
+    dbg_printf("indexed %.1f MB in %.3f s (%.1f MB/s)\n", scanned_bytes / 1048576.0, scan_seconds, scan_seconds > 0 ? scanned_bytes / 1048576.0 / scan_seconds : 0);
 
-        files[*entries] = fopen(filename, "rb");
+    /* chunks that belong to another recording (GUID mismatch) are dropped from their MLVI header on */
+    mlv_file_hdr_t *main_header = NULL;
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        struct chunk_index *chunk_index = &job.chunks[chunk];
+        if(!chunk_index->has_file_hdr) continue;
 
-        /* when succeeded, check for next chunk, else abort */
-        if (files[*entries])
+        /* is this the first file? */
+        if(chunk_index->file_hdr.fileNum == 0)
         {
-            (*entries)++;
+            if(!main_header) main_header = &chunk_index->file_hdr;
         }
-        else
+        else if((main_header ? main_header->fileGuid : (file_guid ? *file_guid : 0)) != chunk_index->file_hdr.fileGuid)
         {
-            break;
+            err_printf("Error: GUID within the file chunks mismatch (chunk #%d)\n", chunk);
+            chunk_index->entry_count = chunk_index->file_hdr_entry;
         }
     }
-    free(filename);
-    return files;
-}
 
-void close_chunks(FILE **chunk_files, uint32_t chunk_count)
-{
-    if(!chunk_files || !chunk_count || chunk_count > 100)
+    if(main_header && file_guid)
     {
-        err_printf("faulty parameters\n");
-        return;
+        *file_guid = main_header->fileGuid;
     }
 
-    for(uint32_t pos = 0; pos < chunk_count; pos++)
+    if(chunk_info)
     {
-        fclose(chunk_files[pos]);
+        for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            chunk_info[chunk].size = job.chunks[chunk].size;
+            chunk_info[chunk].scanned = job.chunks[chunk].end;
+            chunk_info[chunk].mtime = job.chunks[chunk].mtime;
+        }
     }
 
-    free(chunk_files);
-}
-
-mlv_xref_hdr_t *force_index(const char *base_filename)
-{
-    FILE **chunk_files = NULL;
+    uint32_t frame_xref_entries = 0;
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        frame_xref_entries += job.chunks[chunk].entry_count;
+    }
+
+    size_t size = sizeof(mlv_xref_hdr_t) + frame_xref_entries * sizeof(mlv_xref_t);
+    index = (mlv_xref_hdr_t *)malloc(size);
+    if (index)
+    {
+        mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
+        uint32_t *heads = (uint32_t *)calloc(chunk_count, sizeof(uint32_t));
+
+        memset(index, 0, size);
+        memcpy(index->blockType, "XREF", 4);
+        index->blockSize = (uint32_t)size;
+        index->entryCount = frame_xref_entries;
+
+        /* k-way merge, there are at most 100 chunks so a linear scan over the heads is fine */
+        for(uint32_t entry = 0; heads && entry < frame_xref_entries; entry++)
+        {
+            frame_xref_t *next = NULL;
+            uint32_t next_chunk = 0;
+
+            for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+            {
+                struct chunk_index *chunk_index = &job.chunks[chunk];
+                if(heads[chunk] < chunk_index->entry_count &&
+                   (!next || chunk_index->entries[heads[chunk]].frameTime < next->frameTime))
+                {
+                    next = &chunk_index->entries[heads[chunk]];
+                    next_chunk = chunk;
+                }
+            }
+            heads[next_chunk]++;
+
+            xrefs[entry].frameOffset = next->frameOffset;
+            xrefs[entry].fileNumber = next->fileNumber;
+            xrefs[entry].frameType = next->frameType;
+        }
+
+        if(!heads)
+        {
+            free(index);
+            index = NULL;
+        }
+        free(heads);
+    }
+
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        free(job.chunks[chunk].entries);
+    }
+    free(job.chunks);
+
+    return index;
+}
+
+mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count)
+{
+    return scan_chunks(chunk_files, chunk_count, NULL, NULL);
+}
+
+static void read_main_header(FILE *in_file, mlv_file_hdr_t *main_header)
+{
+    // TODO: add some error checking
+    memset(main_header, 0, sizeof(mlv_file_hdr_t));
+    file_set_pos(in_file, 0, SEEK_SET);
+    if(!fread(main_header, sizeof(mlv_file_hdr_t), 1, in_file))
+    {
+        if(ferror(in_file))
+        {
+            int err = errno;
+            err_printf("fread error: %s\n", strerror(err));
+        }
+        else
+        {
+            err_printf("could not read main header\n");
+        }
+    }
+}
+
+void build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_count)
+{
+    // read the MLVI header from the first file
+    mlv_file_hdr_t main_header;
+    read_main_header(chunk_files[0], &main_header);
+
+    chunk_info_t *chunk_info = (chunk_info_t *)calloc(chunk_count, sizeof(chunk_info_t));
+    if(!chunk_info)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+
+    uint64_t file_guid = main_header.fileGuid;
+    mlv_xref_hdr_t *index = scan_chunks(chunk_files, chunk_count, chunk_info, &file_guid);
+    if(index)
+    {
+        save_index(base_filename, &main_header, chunk_count, index, chunk_info);
+    }
+
+    free(index);
+    free(chunk_info);
+}
+
+/**
+ * Indexes only what was appended to the chunks since the IDX was written (and chunks that
+ * did not exist back then), and adds it to the end of the existing index
+ */
+static int update_index(const char *base_filename, chunk_info_hdr_t *chunk_info_hdr)
+{
+    FILE **chunk_files = NULL;
     uint32_t chunk_count = 0;
+    int result = 0;
+
+    mlv_xref_hdr_t *old_index = load_index(base_filename);
+    if(!old_index) return 0;
 
     chunk_files = load_chunks(base_filename, &chunk_count);
     if(!chunk_files || !chunk_count)
     {
+        free(old_index);
+        return 0;
+    }
+
+    chunk_info_t *chunk_info = (chunk_info_t *)calloc(chunk_count, sizeof(chunk_info_t));
+    if(chunk_info)
+    {
+        chunk_info_t *old_chunk_info = (chunk_info_t *)&(((uint8_t*)chunk_info_hdr)[sizeof(chunk_info_hdr_t)]);
+        memcpy(chunk_info, old_chunk_info, MIN(chunk_count, chunk_info_hdr->chunkCount) * sizeof(chunk_info_t));
+
+        uint64_t file_guid = chunk_info_hdr->fileGuid;
+        mlv_xref_hdr_t *tail = scan_chunks(chunk_files, chunk_count, chunk_info, &file_guid);
+        if(tail)
+        {
+            size_t old_size = old_index->entryCount * sizeof(mlv_xref_t);
+            size_t tail_size = tail->entryCount * sizeof(mlv_xref_t);
+            size_t size = sizeof(mlv_xref_hdr_t) + old_size + tail_size;
+            mlv_xref_hdr_t *index = (mlv_xref_hdr_t *)malloc(size);
+            if(index)
+            {
+                memcpy(index, old_index, sizeof(mlv_xref_hdr_t) + old_size);
+                memcpy(&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t) + old_size]), &(((uint8_t*)tail)[sizeof(mlv_xref_hdr_t)]), tail_size);
+                index->blockSize = (uint32_t)size;
+                index->entryCount = old_index->entryCount + tail->entryCount;
+
+                mlv_file_hdr_t main_header;
+                read_main_header(chunk_files[0], &main_header);
+                save_index(base_filename, &main_header, chunk_count, index, chunk_info);
+
+                free(index);
+                result = 1;
+            }
+            free(tail);
+        }
+        free(chunk_info);
+    }
+
+    free(old_index);
+    close_chunks(chunk_files, chunk_count);
+    return result;
+}
+
+FILE **load_chunks(const char *base_filename, uint32_t *entries)
+{
+    uint32_t seq_number = 0;
+    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
+    char * filename = (char*)malloc(filename_size);
+
+    if(!filename)
+    {
+        err_printf("malloc error (requested size %zu)\n", filename_size);
+        return NULL;
+    }
+    *entries = 0;
+
+    strncpy(filename, base_filename, filename_size);
+    FILE **files = (FILE **)malloc(sizeof(FILE*));
+
+    files[0] = fopen(filename, "rb");
+    if (!files[0])
+    {
+        int err = errno;
+        err_printf("fopen('%s') error: %s\n", filename, strerror(err));
         return NULL;
     }
 
+    (*entries)++;
+    while(seq_number < 99)
+    {
+        files = (FILE **)realloc(files, (*entries + 1) * sizeof(FILE*));
+
+        /* check for the next file M00, M01 etc */
+        char seq_name[3];
+
+        #if defined(_WIN32)
+        _snprintf(seq_name, 3, "%02d", seq_number);
+        #else
+        snprintf(seq_name, 3, "%02d", seq_number);
+        #endif
+        seq_number++;
+
+        strcpy(&filename[strlen(filename) - 2], seq_name);
+
+        files[*entries] = fopen(filename, "rb");
+
+        /* when succeeded, check for next chunk, else abort */
+        if (files[*entries])
+        {
+            (*entries)++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    free(filename);
+    return files;
+}
+
+void close_chunks(FILE **chunk_files, uint32_t chunk_count)
+{
+    if(!chunk_files || !chunk_count || chunk_count > 100)
+    {
+        err_printf("faulty parameters\n");
+        return;
+    }
+
+    for(uint32_t pos = 0; pos < chunk_count; pos++)
+    {
+        fclose(chunk_files[pos]);
+    }
+
+    free(chunk_files);
+}
+
+static int rebuild_index(const char *base_filename)
+{
+    FILE **chunk_files = NULL;
+    uint32_t chunk_count = 0;
+
+    chunk_files = load_chunks(base_filename, &chunk_count);
+    if(!chunk_files || !chunk_count)
+    {
+        return 0;
+    }
+
     build_index(base_filename, chunk_files, chunk_count);
     close_chunks(chunk_files, chunk_count);
 
-    return load_index(base_filename);
+    return 1;
 }
 
-mlv_xref_hdr_t *get_index(const char *base_filename)
+/**
+ * Makes up the CHNK block for an IDX file that has none: it is only trusted if it belongs to the
+ * recording (fileGuid of the MLVI header), none of the chunks it indexed is missing, and the last
+ * block it indexed in each chunk is still there, completely. Indexing resumes after that block.
+ * Make sure you free() the result!!!
+ * @return NULL if the IDX file has to be rebuilt
+ */
+static chunk_info_hdr_t *legacy_chunk_info(const char *base_filename, mlv_file_hdr_t *idx_file_hdr)
+{
+    /* save_index() always stored the number of chunks + 1 there */
+    uint32_t chunk_count = idx_file_hdr->fileNum ? idx_file_hdr->fileNum - 1 : 0;
+    if(!chunk_count || chunk_count > 100) return NULL;
+
+    mlv_file_hdr_t file_hdr;
+    FILE *mlv_file = fopen(base_filename, "rb");
+    int same_recording = mlv_file && fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, mlv_file) == 1 && file_hdr.fileGuid == idx_file_hdr->fileGuid;
+    if(mlv_file) fclose(mlv_file);
+    if(!same_recording) return NULL;
+
+    mlv_xref_hdr_t *index = load_index(base_filename);
+    if(!index) return NULL;
+
+    size_t size = sizeof(chunk_info_hdr_t) + chunk_count * sizeof(chunk_info_t);
+    chunk_info_hdr_t *chunks = (chunk_info_hdr_t *)calloc(1, size);
+    size_t filename_size = strlen(base_filename) + 1;
+    char *filename = (char*)malloc(filename_size);
+    if(!chunks || !filename)
+    {
+        free(chunks);
+        free(filename);
+        free(index);
+        return NULL;
+    }
+    memcpy(chunks->blockType, "CHNK", 4);
+    chunks->blockSize = (uint32_t)size;
+    chunks->fileGuid = idx_file_hdr->fileGuid;
+    chunks->chunkCount = chunk_count;
+    strcpy(filename, base_filename);
+
+    /* the last block indexed in each chunk */
+    chunk_info_t *chunk_info = (chunk_info_t *)&(((uint8_t*)chunks)[sizeof(chunk_info_hdr_t)]);
+    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
+    int valid = index->blockSize >= sizeof(mlv_xref_hdr_t) + (uint64_t)index->entryCount * sizeof(mlv_xref_t);
+    for(uint32_t entry = 0; valid && entry < index->entryCount; entry++)
+    {
+        if(xrefs[entry].fileNumber >= chunk_count)
+        {
+            valid = 0;
+        }
+        else if(xrefs[entry].frameOffset >= chunk_info[xrefs[entry].fileNumber].scanned)
+        {
+            /* only the offset for now, the block size is added below */
+            chunk_info[xrefs[entry].fileNumber].scanned = xrefs[entry].frameOffset + 1;
+        }
+    }
+    free(index);
+
+    for(uint32_t chunk = 0; valid && chunk < chunk_count; chunk++)
+    {
+        /* MLV, M00, M01 etc, like load_chunks() */
+        if(chunk > 0)
+        {
+            char seq_name[3];
+            #if defined(_WIN32)
+            _snprintf(seq_name, 3, "%02d", chunk - 1);
+            #else
+            snprintf(seq_name, 3, "%02d", chunk - 1);
+            #endif
+            strcpy(&filename[filename_size - 3], seq_name);
+        }
+
+        struct stat chunk_stat;
+        FILE *chunk_file = fopen(filename, "rb");
+        if(!chunk_file || stat(filename, &chunk_stat))
+        {
+            valid = 0;
+        }
+        else if(chunk_info[chunk].scanned)
+        {
+            mlv_hdr_t mlv_hdr;
+            uint64_t offset = chunk_info[chunk].scanned - 1;
+            if(file_read_at(chunk_file, &mlv_hdr, sizeof(mlv_hdr_t), offset) != sizeof(mlv_hdr_t) ||
+               mlv_hdr.blockSize < sizeof(mlv_hdr_t) || offset + mlv_hdr.blockSize > (uint64_t)chunk_stat.st_size)
+            {
+                valid = 0;
+            }
+            else
+            {
+                chunk_info[chunk].scanned = offset + mlv_hdr.blockSize;
+            }
+        }
+        if(chunk_file) fclose(chunk_file);
+
+        /* whatever follows the last indexed block counts as appended */
+        chunk_info[chunk].size = chunk_info[chunk].scanned;
+        chunk_info[chunk].mtime = valid ? (int64_t)chunk_stat.st_mtime : 0;
+    }
+    free(filename);
+
+    if(!valid)
+    {
+        free(chunks);
+        return NULL;
+    }
+    return chunks;
+}
+
+/**
+ * Checks the IDX file against the recording without reading any of the chunk data: the GUID
+ * of the recording, the number of chunks and each chunk's size and mtime have to match.
+ * Chunks that only grew (or were added) can be indexed incrementally (INDEX_APPENDED), in that case
+ * *chunk_info_hdr receives the CHNK block of the IDX file (see legacy_chunk_info() for IDX files without
+ * one). Make sure you free() it!!!
+ */
+static int check_index(const char *base_filename, chunk_info_hdr_t **chunk_info_hdr)
+{
+    *chunk_info_hdr = NULL;
+
+    char * filename = index_filename(base_filename);
+    if(!filename) return INDEX_OUTDATED;
+
+    FILE *in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file) return INDEX_OUTDATED;
+
+    chunk_info_hdr_t *chunks = NULL;
+    int found_xref = 0;
+    int found_file_hdr = 0;
+    mlv_file_hdr_t idx_file_hdr;
+    uint64_t position = 0;
+    mlv_hdr_t mlv_hdr;
+
+    while(!chunks && file_set_pos(in_file, position, SEEK_SET) == 0 && fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file) == 1)
+    {
+        if(mlv_hdr.blockSize < sizeof(mlv_hdr_t)) break;
+
+        if(!memcmp(mlv_hdr.blockType, "XREF", 4))
+        {
+            found_xref = 1;
+        }
+        else if(!memcmp(mlv_hdr.blockType, "MLVI", 4) && mlv_hdr.blockSize >= sizeof(mlv_file_hdr_t) && !found_file_hdr)
+        {
+            file_set_pos(in_file, position, SEEK_SET);
+            found_file_hdr = fread(&idx_file_hdr, sizeof(mlv_file_hdr_t), 1, in_file) == 1;
+        }
+        else if(!memcmp(mlv_hdr.blockType, "CHNK", 4) && mlv_hdr.blockSize >= sizeof(chunk_info_hdr_t))
+        {
+            chunks = (chunk_info_hdr_t *)malloc(mlv_hdr.blockSize);
+            file_set_pos(in_file, position, SEEK_SET);
+            if(chunks && (fread(chunks, mlv_hdr.blockSize, 1, in_file) != 1 ||
+                          sizeof(chunk_info_hdr_t) + (uint64_t)chunks->chunkCount * sizeof(chunk_info_t) > mlv_hdr.blockSize))
+            {
+                free(chunks);
+                chunks = NULL;
+                break;
+            }
+        }
+        position += mlv_hdr.blockSize;
+    }
+    fclose(in_file);
+
+    if(!found_xref)
+    {
+        free(chunks);
+        return INDEX_OUTDATED;
+    }
+
+    /* an IDX file written before the CHNK block existed only gets the block added (by update_index()) */
+    if(!chunks)
+    {
+        *chunk_info_hdr = found_file_hdr ? legacy_chunk_info(base_filename, &idx_file_hdr) : NULL;
+        return *chunk_info_hdr ? INDEX_APPENDED : INDEX_OUTDATED;
+    }
+
+    int result = INDEX_CURRENT;
+    mlv_file_hdr_t file_hdr;
+    FILE *mlv_file = fopen(base_filename, "rb");
+    if(!mlv_file || fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, mlv_file) != 1 || file_hdr.fileGuid != chunks->fileGuid)
+    {
+        result = INDEX_OUTDATED;
+    }
+    if(mlv_file) fclose(mlv_file);
+
+    size_t filename_size = strlen(base_filename) + 1;
+    filename = (char*)malloc(filename_size);
+    if(!filename)
+    {
+        free(chunks);
+        return INDEX_OUTDATED;
+    }
+    strcpy(filename, base_filename);
+
+    chunk_info_t *chunk_info = (chunk_info_t *)&(((uint8_t*)chunks)[sizeof(chunk_info_hdr_t)]);
+    for(uint32_t chunk = 0; chunk < 100 && result != INDEX_OUTDATED; chunk++)
+    {
+        struct stat chunk_stat;
+
+        /* MLV, M00, M01 etc, like load_chunks() */
+        if(chunk > 0)
+        {
+            char seq_name[3];
+            #if defined(_WIN32)
+            _snprintf(seq_name, 3, "%02d", chunk - 1);
+            #else
+            snprintf(seq_name, 3, "%02d", chunk - 1);
+            #endif
+            strcpy(&filename[filename_size - 3], seq_name);
+        }
+
+        if(stat(filename, &chunk_stat))
+        {
+            /* a chunk is missing */
+            if(chunk < chunks->chunkCount) result = INDEX_OUTDATED;
+            break;
+        }
+
+        if(chunk >= chunks->chunkCount)
+        {
+            /* a new chunk */
+            result = INDEX_APPENDED;
+        }
+        else if((uint64_t)chunk_stat.st_size < chunk_info[chunk].size ||
+                ((uint64_t)chunk_stat.st_size == chunk_info[chunk].size && (int64_t)chunk_stat.st_mtime != chunk_info[chunk].mtime))
+        {
+            /* truncated or rewritten */
+            result = INDEX_OUTDATED;
+        }
+        else if((uint64_t)chunk_stat.st_size > chunk_info[chunk].size)
+        {
+            /* data was appended (e.g. still being copied) */
+            result = INDEX_APPENDED;
+        }
+    }
+    free(filename);
+
+    if(result == INDEX_APPENDED)
+    {
+        *chunk_info_hdr = chunks;
+    }
+    else
+    {
+        free(chunks);
+    }
+    return result;
+}
+
+/**
+ * Makes sure the IDX file is up to date with the recording, returns the state it was found in
+ */
+static int refresh_index(const char *base_filename)
 {
-    mlv_xref_hdr_t *table = NULL;
+    chunk_info_hdr_t *chunk_info_hdr = NULL;
+    int state = check_index(base_filename, &chunk_info_hdr);
 
-    table = load_index(base_filename);
+    if(state == INDEX_APPENDED && !update_index(base_filename, chunk_info_hdr))
+    {
+        state = INDEX_OUTDATED;
+    }
+    free(chunk_info_hdr);
 
-    if(!table)
+    if(state == INDEX_OUTDATED)
     {
-        table = force_index(base_filename);
+        rebuild_index(base_filename);
     }
 
-    return table;
+    return state;
+}
+
+mlv_xref_hdr_t *get_index(const char *base_filename)
+{
+    refresh_index(base_filename);
+    return load_index(base_filename);
 }
 
 mlv_xref_hdr_t *get_new_index(const char *base_filename)
@@ -486,42 +1282,517 @@ mlv_xref_hdr_t *get_new_index(const char *base_filename)
     return index;
 }
 
-int mlv_get_frame_count(const char *real_path)
+static uint32_t count_xref_entries(mlv_xref_hdr_t *block_xref, uint8_t frameType, uint32_t start)
 {
-    uint32_t videoFrameCount = 0;
-    
-    mlv_xref_hdr_t *block_xref = get_index(real_path);
-    if(block_xref == NULL) return 0;
-    
+    uint32_t count = 0;
     mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-    
-    for(uint32_t block_xref_pos = 0; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+
+    for(uint32_t block_xref_pos = start; block_xref_pos < block_xref->entryCount; block_xref_pos++)
     {
-        if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF)
+        if(xrefs[block_xref_pos].frameType == frameType)
         {
-            videoFrameCount++;
+            count++;
         }
     }
-    
-    // If there are no VIDF frames at all, the IDX file is probably an old format, and needs to be re-built
-    // TODO: clean up the following repetition of code
-    if(videoFrameCount == 0)
+    return count;
+}
+
+/* reads a metadata block into the snapshot, returns 1 if the snapshot was modified */
+static int read_frame_table_block(FILE *in_file, int64_t position, struct frame_headers *current, struct frame_table *frame_table)
+{
+    mlv_hdr_t mlv_hdr;
+    void *dest = NULL;
+    size_t dest_size = 0;
+
+    file_set_pos(in_file, position, SEEK_SET);
+    if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file) != 1)
+    {
+        return 0;
+    }
+
+    if(!memcmp(mlv_hdr.blockType, "MLVI", 4))      { dest = &current->file_hdr; dest_size = sizeof(mlv_file_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "RTCI", 4)) { dest = &current->rtci_hdr; dest_size = sizeof(mlv_rtci_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "IDNT", 4)) { dest = &current->idnt_hdr; dest_size = sizeof(mlv_idnt_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "RAWI", 4)) { dest = &current->rawi_hdr; dest_size = sizeof(mlv_rawi_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "EXPO", 4)) { dest = &current->expo_hdr; dest_size = sizeof(mlv_expo_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "LENS", 4)) { dest = &current->lens_hdr; dest_size = sizeof(mlv_lens_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "WBAL", 4)) { dest = &current->wbal_hdr; dest_size = sizeof(mlv_wbal_hdr_t); }
+    else if(!memcmp(mlv_hdr.blockType, "WAVI", 4) && memcmp(frame_table->wavi_hdr.blockType, "WAVI", 4))
     {
+        /* only the first WAVI block is used for the WAV file */
+        file_set_pos(in_file, position, SEEK_SET);
+        fread(&frame_table->wavi_hdr, MIN(sizeof(mlv_wavi_hdr_t), mlv_hdr.blockSize), 1, in_file);
+        return 0;
+    }
+
+    if(!dest)
+    {
+        return 0;
+    }
+
+    file_set_pos(in_file, position, SEEK_SET);
+    return fread(dest, MIN(dest_size, mlv_hdr.blockSize), 1, in_file) == 1;
+}
+
+/**
+ * Walks the index once and records, for every VIDF in sequence, where it is stored
+ * and a reference to the metadata blocks in effect at that point. Metadata snapshots
+ * are only stored when something actually changed. AUDF payloads are recorded with
+ * their offset in the resulting audio stream.
+ * If a frame table is given, it is extended with the index entries it does not cover yet.
+ */
+static struct frame_table *build_frame_table(const char *base_filename, struct frame_table *frame_table)
+{
+    mlv_xref_hdr_t *block_xref = load_index(base_filename);
+    if(!block_xref)
+    {
+        free_frame_table(frame_table);
+        return NULL;
+    }
+
+    /* the index was rebuilt in a different order, start over */
+    if(frame_table && frame_table->xref_count > block_xref->entryCount)
+    {
+        free_frame_table(frame_table);
+        frame_table = NULL;
+    }
+
+    uint32_t start = frame_table ? frame_table->xref_count : 0;
+    uint32_t videoFrameCount = (frame_table ? frame_table->frame_count : 0) + count_xref_entries(block_xref, MLV_FRAME_VIDF, start);
+    uint32_t audioFrameCount = (frame_table ? frame_table->audio_count : 0) + count_xref_entries(block_xref, MLV_FRAME_AUDF, start);
+
+    FILE **chunk_files = NULL;
+    uint32_t chunk_count = 0;
+
+    chunk_files = load_chunks(base_filename, &chunk_count);
+    if(!chunk_files || !chunk_count)
+    {
+        free_frame_table(frame_table);
         free(block_xref);
-        block_xref = force_index(real_path);
-		if (block_xref == NULL) return 0;
-        xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-        
-        for(uint32_t block_xref_pos = 0; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+        return NULL;
+    }
+
+    if(!frame_table)
+    {
+        frame_table = calloc(1, sizeof(struct frame_table));
+    }
+    if(frame_table)
+    {
+        struct frame_table_entry *frames = realloc(frame_table->frames, (videoFrameCount + 1) * sizeof(struct frame_table_entry));
+        if(frames) frame_table->frames = frames;
+        struct audio_table_entry *audio = realloc(frame_table->audio, (audioFrameCount + 1) * sizeof(struct audio_table_entry));
+        if(audio) frame_table->audio = audio;
+        if(!frames || !audio)
+        {
+            free_frame_table(frame_table);
+            frame_table = NULL;
+        }
+    }
+    if(!frame_table)
+    {
+        err_printf("%s: malloc error\n", base_filename);
+        free(block_xref);
+        close_chunks(chunk_files, chunk_count);
+        return NULL;
+    }
+
+    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
+    struct frame_headers current;
+    uint32_t headers_allocated = frame_table->header_count;
+    uint32_t first_pos = 0;
+    int dirty = 1;
+
+    memset(&current, 0, sizeof(struct frame_headers));
+
+    if(frame_table->header_count)
+    {
+        /* continue with the metadata in effect at the last frame, plus whatever was recorded after it */
+        current = frame_table->headers[frame_table->header_count - 1];
+        dirty = 0;
+        first_pos = start;
+        while(first_pos > 0 && xrefs[first_pos - 1].frameType != MLV_FRAME_VIDF)
+        {
+            first_pos--;
+        }
+    }
+
+    for(uint32_t block_xref_pos = first_pos; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+    {
+        /* get the file and position of the next block */
+        uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
+        int64_t position = xrefs[block_xref_pos].frameOffset;
+
+        if(in_file_num >= chunk_count)
         {
-            if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF)
+            err_printf("%s: index refers to missing chunk %d\n", base_filename, in_file_num);
+            continue;
+        }
+
+        /* select file */
+        FILE *in_file = chunk_files[in_file_num];
+
+        if(block_xref_pos < start)
+        {
+            /* already in the table, only the metadata matters */
+            if(xrefs[block_xref_pos].frameType == MLV_FRAME_UNSPECIFIED)
+            {
+                dirty |= read_frame_table_block(in_file, position, &current, frame_table);
+            }
+            continue;
+        }
+
+        if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF && frame_table->frame_count < videoFrameCount)
+        {
+            struct frame_table_entry *frame = &frame_table->frames[frame_table->frame_count];
+            mlv_hdr_t mlv_hdr;
+
+            if(dirty)
+            {
+                /* metadata blocks were seen since the last frame, keep a new snapshot if anything changed */
+                if(!frame_table->header_count || memcmp(&frame_table->headers[frame_table->header_count - 1], &current, sizeof(struct frame_headers)))
+                {
+                    if(frame_table->header_count >= headers_allocated)
+                    {
+                        headers_allocated = headers_allocated ? headers_allocated * 2 : 4;
+                        struct frame_headers *headers = realloc(frame_table->headers, headers_allocated * sizeof(struct frame_headers));
+                        if(!headers)
+                        {
+                            err_printf("%s: malloc error\n", base_filename);
+                            break;
+                        }
+                        frame_table->headers = headers;
+                    }
+                    frame_table->headers[frame_table->header_count++] = current;
+                }
+                dirty = 0;
+            }
+
+            memset(frame, 0, sizeof(struct frame_table_entry));
+            frame->fileNumber = in_file_num;
+            frame->position = position;
+            frame->headers = frame_table->header_count - 1;
+
+            file_set_pos(in_file, position, SEEK_SET);
+            if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file) == 1)
+            {
+                file_set_pos(in_file, position, SEEK_SET);
+                fread(&frame->vidf_hdr, MIN(sizeof(mlv_vidf_hdr_t), mlv_hdr.blockSize), 1, in_file);
+            }
+
+            //Matches to number in sequence rather than frameNumber in header for consistency with readdir
+            frame_table->frame_count++;
+        }
+        else if(xrefs[block_xref_pos].frameType == MLV_FRAME_AUDF && frame_table->audio_count < audioFrameCount)
+        {
+            mlv_audf_hdr_t audf_hdr;
+
+            file_set_pos(in_file, position, SEEK_SET);
+            if(fread(&audf_hdr, sizeof(mlv_audf_hdr_t), 1, in_file) == 1 && !memcmp(audf_hdr.blockType, "AUDF", 4))
             {
-                videoFrameCount++;
+                struct audio_table_entry *audio = &frame_table->audio[frame_table->audio_count++];
+                audio->fileNumber = in_file_num;
+                audio->position = position + sizeof(mlv_audf_hdr_t) + audf_hdr.frameSpace;
+                audio->length = (uint32_t)(audf_hdr.blockSize - sizeof(mlv_audf_hdr_t) - audf_hdr.frameSpace);
+                audio->audio_offset = frame_table->audio_size;
+                frame_table->audio_size += audio->length;
             }
         }
+        else if(xrefs[block_xref_pos].frameType == MLV_FRAME_UNSPECIFIED)
+        {
+            dirty |= read_frame_table_block(in_file, position, &current, frame_table);
+        }
+
+        if(ferror(in_file))
+        {
+            int err = errno;
+            err_printf("%s: fread error: %s\n", base_filename, strerror(err));
+        }
     }
-    
+
+    frame_table->xref_count = block_xref->entryCount;
+
     free(block_xref);
-    
-    return videoFrameCount;
+    close_chunks(chunk_files, chunk_count);
+
+    return frame_table;
+}
+
+/**
+ * Reads the frame table stored in the IDX file, if it has one of FRAME_TABLE_VERSION
+ * The whole IDX file is read at once, it is only a few bytes per frame
+ */
+static struct frame_table *load_frame_table(const char *base_filename)
+{
+    char * filename = index_filename(base_filename);
+    if(!filename) return NULL;
+
+    FILE *in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file) return NULL;
+
+    file_set_pos(in_file, 0, SEEK_END);
+    uint64_t file_size = file_get_pos(in_file);
+    file_set_pos(in_file, 0, SEEK_SET);
+
+    uint8_t *data = file_size ? malloc((size_t)file_size) : NULL;
+    if(!data || fread(data, (size_t)file_size, 1, in_file) != 1)
+    {
+        free(data);
+        fclose(in_file);
+        return NULL;
+    }
+    fclose(in_file);
+
+    struct frame_table *frame_table = NULL;
+    uint64_t position = 0;
+
+    while(position + sizeof(mlv_hdr_t) <= file_size)
+    {
+        mlv_hdr_t *mlv_hdr = (mlv_hdr_t *)&data[position];
+
+        if(mlv_hdr->blockSize < sizeof(mlv_hdr_t) || position + mlv_hdr->blockSize > file_size)
+        {
+            break;
+        }
+
+        if(!memcmp(mlv_hdr->blockType, "FTBL", 4) && mlv_hdr->blockSize >= sizeof(frame_table_hdr_t))
+        {
+            frame_table_hdr_t *ftbl = (frame_table_hdr_t *)mlv_hdr;
+            uint64_t expected_size = sizeof(frame_table_hdr_t) +
+                                     (uint64_t)ftbl->headerCount * sizeof(frame_table_headers_t) +
+                                     (uint64_t)ftbl->frameCount * sizeof(frame_table_frame_t) +
+                                     (uint64_t)ftbl->audioCount * sizeof(frame_table_audio_t);
+
+            if(ftbl->version != FRAME_TABLE_VERSION || expected_size != ftbl->blockSize || (ftbl->frameCount && !ftbl->headerCount))
+            {
+                /* unknown or broken, it will be rebuilt */
+                break;
+            }
+
+            frame_table = calloc(1, sizeof(struct frame_table));
+            if(!frame_table ||
+               (ftbl->headerCount && !(frame_table->headers = malloc(ftbl->headerCount * sizeof(struct frame_headers)))) ||
+               (ftbl->frameCount && !(frame_table->frames = malloc(ftbl->frameCount * sizeof(struct frame_table_entry)))) ||
+               (ftbl->audioCount && !(frame_table->audio = malloc(ftbl->audioCount * sizeof(struct audio_table_entry)))))
+            {
+                err_printf("%s: malloc error\n", base_filename);
+                free_frame_table(frame_table);
+                frame_table = NULL;
+                break;
+            }
+
+            frame_table->header_count = ftbl->headerCount;
+            frame_table->frame_count = ftbl->frameCount;
+            frame_table->audio_count = ftbl->audioCount;
+            frame_table->audio_size = ftbl->audioSize;
+            frame_table->xref_count = ftbl->xrefCount;
+            frame_table->wavi_hdr = ftbl->wavi_hdr;
+
+            frame_table_headers_t *headers = (frame_table_headers_t *)&data[position + sizeof(frame_table_hdr_t)];
+            for(uint32_t i = 0; i < ftbl->headerCount; i++)
+            {
+                struct frame_headers *dest = &frame_table->headers[i];
+                memset(dest, 0, sizeof(struct frame_headers));
+                dest->file_hdr = headers[i].file_hdr;
+                dest->rtci_hdr = headers[i].rtci_hdr;
+                dest->idnt_hdr = headers[i].idnt_hdr;
+                dest->rawi_hdr = headers[i].rawi_hdr;
+                dest->expo_hdr = headers[i].expo_hdr;
+                dest->lens_hdr = headers[i].lens_hdr;
+                dest->wbal_hdr = headers[i].wbal_hdr;
+            }
+
+            frame_table_frame_t *frames = (frame_table_frame_t *)&headers[ftbl->headerCount];
+            for(uint32_t i = 0; i < ftbl->frameCount; i++)
+            {
+                struct frame_table_entry *dest = &frame_table->frames[i];
+                dest->fileNumber = frames[i].fileNumber;
+                dest->headers = MIN(frames[i].headers, ftbl->headerCount - 1);
+                dest->position = frames[i].frameOffset;
+                dest->vidf_hdr = frames[i].vidf_hdr;
+            }
+
+            frame_table_audio_t *audio = (frame_table_audio_t *)&frames[ftbl->frameCount];
+            for(uint32_t i = 0; i < ftbl->audioCount; i++)
+            {
+                struct audio_table_entry *dest = &frame_table->audio[i];
+                dest->fileNumber = audio[i].fileNumber;
+                dest->length = audio[i].length;
+                dest->position = audio[i].frameOffset;
+                dest->audio_offset = audio[i].audioOffset;
+            }
+            break;
+        }
+
+        position += mlv_hdr->blockSize;
+    }
+
+    free(data);
+    return frame_table;
+}
+
+/**
+ * Stores the frame table in the IDX file, replacing any previous one. This also
+ * upgrades an IDX file of an older format (without the FTBL block).
+ * Like save_index(), the IDX file is replaced as a whole, never written in place
+ */
+static void save_frame_table(const char *base_filename, struct frame_table *frame_table)
+{
+    char * filename = index_filename(base_filename);
+    if(!filename) return;
+
+    FILE *idx_file = fopen(filename, "rb");
+    if(!idx_file)
+    {
+        free(filename);
+        return;
+    }
+
+    file_set_pos(idx_file, 0, SEEK_END);
+    uint64_t file_size = file_get_pos(idx_file);
+    file_set_pos(idx_file, 0, SEEK_SET);
+
+    uint8_t *blocks = file_size ? malloc((size_t)file_size) : NULL;
+    if(!blocks || fread(blocks, (size_t)file_size, 1, idx_file) != 1)
+    {
+        free(blocks);
+        fclose(idx_file);
+        free(filename);
+        return;
+    }
+    fclose(idx_file);
+
+    /* find the end of the blocks we keep (MLVI, XREF and CHNK) */
+    uint64_t end = 0;
+    while(end + sizeof(mlv_hdr_t) <= file_size)
+    {
+        mlv_hdr_t *mlv_hdr = (mlv_hdr_t *)&blocks[end];
+        if(mlv_hdr->blockSize < sizeof(mlv_hdr_t) || end + mlv_hdr->blockSize > file_size || !memcmp(mlv_hdr->blockType, "FTBL", 4))
+        {
+            break;
+        }
+        end += mlv_hdr->blockSize;
+    }
+
+    frame_table_hdr_t ftbl;
+    memset(&ftbl, 0, sizeof(frame_table_hdr_t));
+    memcpy(ftbl.blockType, "FTBL", 4);
+    ftbl.version = FRAME_TABLE_VERSION;
+    ftbl.frameCount = frame_table->frame_count;
+    ftbl.headerCount = frame_table->header_count;
+    ftbl.audioCount = frame_table->audio_count;
+    ftbl.audioSize = frame_table->audio_size;
+    ftbl.xrefCount = frame_table->xref_count;
+    ftbl.wavi_hdr = frame_table->wavi_hdr;
+    ftbl.blockSize = (uint32_t)(sizeof(frame_table_hdr_t) +
+                                frame_table->header_count * sizeof(frame_table_headers_t) +
+                                frame_table->frame_count * sizeof(frame_table_frame_t) +
+                                frame_table->audio_count * sizeof(frame_table_audio_t));
+
+    uint8_t *data = malloc(ftbl.blockSize);
+    if(!data)
+    {
+        err_printf("malloc error (requested size %u)\n", ftbl.blockSize);
+        free(blocks);
+        free(filename);
+        return;
+    }
+    memset(data, 0, ftbl.blockSize);
+    memcpy(data, &ftbl, sizeof(frame_table_hdr_t));
+
+    frame_table_headers_t *headers = (frame_table_headers_t *)&data[sizeof(frame_table_hdr_t)];
+    for(uint32_t i = 0; i < frame_table->header_count; i++)
+    {
+        struct frame_headers *src = &frame_table->headers[i];
+        headers[i].file_hdr = src->file_hdr;
+        headers[i].rtci_hdr = src->rtci_hdr;
+        headers[i].idnt_hdr = src->idnt_hdr;
+        headers[i].rawi_hdr = src->rawi_hdr;
+        headers[i].expo_hdr = src->expo_hdr;
+        headers[i].lens_hdr = src->lens_hdr;
+        headers[i].wbal_hdr = src->wbal_hdr;
+    }
+
+    frame_table_frame_t *frames = (frame_table_frame_t *)&headers[frame_table->header_count];
+    for(uint32_t i = 0; i < frame_table->frame_count; i++)
+    {
+        struct frame_table_entry *src = &frame_table->frames[i];
+        frames[i].fileNumber = (uint16_t)src->fileNumber;
+        frames[i].headers = src->headers;
+        frames[i].frameOffset = src->position;
+        frames[i].vidf_hdr = src->vidf_hdr;
+    }
+
+    frame_table_audio_t *audio = (frame_table_audio_t *)&frames[frame_table->frame_count];
+    for(uint32_t i = 0; i < frame_table->audio_count; i++)
+    {
+        struct audio_table_entry *src = &frame_table->audio[i];
+        audio[i].fileNumber = (uint16_t)src->fileNumber;
+        audio[i].length = src->length;
+        audio[i].frameOffset = src->position;
+        audio[i].audioOffset = src->audio_offset;
+    }
+
+    char * temp_filename = NULL;
+    FILE *out_file = create_index_file(filename, &temp_filename);
+    if(out_file)
+    {
+        int ok = (!end || fwrite(blocks, (size_t)end, 1, out_file) == 1) && fwrite(data, ftbl.blockSize, 1, out_file) == 1;
+        if(!ok)
+        {
+            int err = errno;
+            err_printf("fwrite error: %s\n", strerror(err));
+        }
+        commit_index_file(out_file, filename, temp_filename, ok);
+    }
+    free(blocks);
+    free(data);
+    free(filename);
+}
+
+/**
+ * Retrieves the frame table from the IDX file, building it (and upgrading the IDX file) if necessary
+ * Make sure you free_frame_table() the result!!!
+ */
+struct frame_table *make_frame_table(const char *base_filename)
+{
+    /* read it before the IDX file might get rewritten */
+    struct frame_table *frame_table = load_frame_table(base_filename);
+    int state = refresh_index(base_filename);
+
+    if(state == INDEX_CURRENT && frame_table)
+    {
+        return frame_table;
+    }
+
+    if(state == INDEX_OUTDATED)
+    {
+        free_frame_table(frame_table);
+        frame_table = NULL;
+    }
+
+    frame_table = build_frame_table(base_filename, frame_table);
+    if(frame_table)
+    {
+        save_frame_table(base_filename, frame_table);
+    }
+
+    return frame_table;
+}
+
+void free_frame_table(struct frame_table *frame_table)
+{
+    if(!frame_table) return;
+    free(frame_table->frames);
+    free(frame_table->headers);
+    free(frame_table->audio);
+    free(frame_table);
+}
+
+int mlv_get_frame_count(const char *real_path)
+{
+    struct frame_table *frame_table = mlvfs_get_frame_table(real_path);
+    int frame_count = frame_table ? (int)frame_table->frame_count : 0;
+    mlvfs_release_frame_table(frame_table);
+    return frame_count;
 }
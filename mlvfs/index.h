@@ -26,6 +26,40 @@
 
 #include "raw.h"
 #include "mlv.h"
+#include "mlvfs.h"
+
+//a single VIDF block: where it is stored and which metadata blocks were in effect when it was recorded
+struct frame_table_entry
+{
+    uint32_t fileNumber;
+    uint32_t headers;               /* index into frame_table.headers */
+    uint64_t position;
+    mlv_vidf_hdr_t vidf_hdr;
+};
+
+//a single AUDF payload and where it lands in the audio stream
+struct audio_table_entry
+{
+    uint32_t fileNumber;
+    uint32_t length;
+    uint64_t position;              /* file offset of the payload */
+    uint64_t audio_offset;          /* offset of the payload within the audio stream */
+};
+
+//maps the VIDF sequence number to its location and metadata, so any frame can be looked up without reading the MLV
+//this is what the FTBL block of IDX files stores after the XREF and CHNK blocks
+struct frame_table
+{
+    uint32_t frame_count;
+    uint32_t header_count;
+    struct frame_table_entry * frames;
+    struct frame_headers * headers; /* deduplicated metadata snapshots (fileNumber, position and vidf_hdr are unused) */
+    uint32_t audio_count;
+    uint64_t audio_size;            /* total size of all AUDF payloads */
+    struct audio_table_entry * audio;
+    mlv_wavi_hdr_t wavi_hdr;        /* the first WAVI block, zeroed if there is none */
+    uint32_t xref_count;            /* number of index entries the table was built from */
+};
 
 //Retrieves the index from an IDX file, generating the file if necessary
 mlv_xref_hdr_t *get_index(const char *base_filename);
@@ -36,8 +70,15 @@ mlv_xref_hdr_t *get_new_index(const char *base_filename);
 FILE **load_chunks(const char *base_filename, uint32_t *entries);
 void close_chunks(FILE **chunk_files, uint32_t chunk_count);
 
+//Loads the frame table for an MLV from its IDX file, building it if necessary (see mlvfs_get_frame_table() for the cached version)
+struct frame_table *make_frame_table(const char *base_filename);
+void free_frame_table(struct frame_table *frame_table);
+
 int mlv_get_frame_count(const char *real_path);
 
+//Total amount of recording data covered by index scans so far, and the time it took (for MB/s)
+void get_index_scan_stats(uint64_t *bytes, double *seconds);
+
 /* platform/target specific fseek/ftell functions go here */
 uint64_t file_get_pos(FILE *stream);
 uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence);
@@ -0,0 +1,837 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef _WIN32
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include "mlvfs.h"
+#include "lowlevel.h"
+#include "resource_manager.h"
+
+/*
+ * Alternative to fuse_main() on top of the FUSE low-level API. The kernel talks to us in inode
+ * numbers, which come from the inode callback (for clips they are derived from the clip and the
+ * frame number, so a frame keeps its number across lookups and remounts). The inode table maps
+ * them back to the virtual path for the usual path based operations. Frames and the other files
+ * in a clip don't change while mounted, so the kernel may cache their entries and attributes for
+ * --cache-timeout seconds and keep their contents in the page cache between opens: reading the
+ * same DNG again doesn't reach MLVFS at all. When the processing settings change in the web GUI,
+ * lowlevel_invalidate_cache() tells the kernel to drop all of that.
+ */
+
+#define INODE_BUCKET_COUNT 4096
+
+//the inode callback never sets this bit, numbers for paths that collide with another path have it set
+#define INODE_COLLISION_BIT (1ULL << 62)
+
+struct inode
+{
+    struct inode * next;        /* same inode number bucket */
+    struct inode * alias_next;  /* same path bucket, only for aliases */
+    int alias;                  /* the number isn't the one the inode callback gives for the path */
+    int detached;               /* its path was replaced by a rename, it's only kept for the kernel */
+    fuse_ino_t ino;
+    fuse_ino_t parent;          /* the directory it was last looked up in */
+    char * path;
+    uint64_t nlookup;           /* lookups the kernel did not forget yet */
+    int cacheable;
+};
+
+//the names of a directory, collected in opendir and handed out by readdir in pieces
+struct directory_listing
+{
+    char * path;
+    char ** names;
+    struct stat * stats;
+    size_t count;
+    size_t capacity;
+};
+
+//an inode the kernel should drop from its caches
+struct inode_invalidation
+{
+    fuse_ino_t ino;
+    fuse_ino_t parent;
+    char * name;
+};
+
+static pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct inode * inodes[INODE_BUCKET_COUNT];
+//inodes that can't be found by the number of their path (collisions and renamed inodes), by path
+static struct inode * aliases[INODE_BUCKET_COUNT];
+static fuse_ino_t next_collision_ino = INODE_COLLISION_BIT;
+
+//held while the channel is used outside of a request, so it can't go away in between
+static pthread_rwlock_t chan_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct fuse_chan * mounted_chan = NULL;
+
+static const struct fuse_operations * path_ops = NULL;
+static lowlevel_ino_cbr path_ino_cbr = NULL;
+static double cacheable_timeout = LOWLEVEL_DEFAULT_TIMEOUT;
+
+static struct inode * find_inode(fuse_ino_t ino)
+{
+    for(struct inode * current = inodes[ino % INODE_BUCKET_COUNT]; current != NULL; current = current->next)
+    {
+        if(current->ino == ino) return current;
+    }
+    return NULL;
+}
+
+static struct inode ** alias_bucket(const char * path)
+{
+    return &aliases[fnv1a(path, FNV1A_SEED) % INODE_BUCKET_COUNT];
+}
+
+static struct inode * find_alias(const char * path)
+{
+    for(struct inode * current = *alias_bucket(path); current != NULL; current = current->alias_next)
+    {
+        if(!strcmp(current->path, path)) return current;
+    }
+    return NULL;
+}
+
+static void add_alias(struct inode * inode)
+{
+    struct inode ** bucket = alias_bucket(inode->path);
+    inode->alias = 1;
+    inode->alias_next = *bucket;
+    *bucket = inode;
+}
+
+//call before changing or freeing the path, the bucket depends on it
+static void remove_alias(struct inode * inode)
+{
+    if(!inode->alias) return;
+    for(struct inode ** link = alias_bucket(inode->path); *link != NULL; link = &(*link)->alias_next)
+    {
+        if(*link == inode)
+        {
+            *link = inode->alias_next;
+            break;
+        }
+    }
+    inode->alias = 0;
+    inode->alias_next = NULL;
+}
+
+/**
+ * Adds a lookup of path to the inode table
+ * @return the inode number given to the kernel, 0 if we are out of memory
+ */
+static fuse_ino_t remember_inode(const char * path, fuse_ino_t ino, fuse_ino_t parent, int cacheable)
+{
+    //a path that collided with another one or was renamed to keeps the number it was given first
+    struct inode * inode = find_alias(path);
+    if(!inode)
+    {
+        inode = find_inode(ino);
+        if(inode && (inode->detached || strcmp(inode->path, path)))
+        {
+            inode = NULL;
+            ino = next_collision_ino++;
+        }
+    }
+
+    if(!inode)
+    {
+        inode = malloc(sizeof(struct inode));
+        if(!inode) return 0;
+        inode->path = malloc(strlen(path) + 1);
+        if(!inode->path)
+        {
+            free(inode);
+            return 0;
+        }
+        strcpy(inode->path, path);
+        inode->ino = ino;
+        inode->nlookup = 0;
+        inode->alias = 0;
+        inode->alias_next = NULL;
+        inode->detached = 0;
+        inode->next = inodes[ino % INODE_BUCKET_COUNT];
+        inodes[ino % INODE_BUCKET_COUNT] = inode;
+        if(ino & INODE_COLLISION_BIT) add_alias(inode);
+    }
+
+    inode->parent = parent;
+    inode->cacheable = cacheable;
+    inode->nlookup++;
+    return inode->ino;
+}
+
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup)
+{
+    struct inode * previous = NULL;
+    for(struct inode * current = inodes[ino % INODE_BUCKET_COUNT]; current != NULL; current = current->next)
+    {
+        if(current->ino == ino)
+        {
+            current->nlookup -= MIN(nlookup, current->nlookup);
+            //the root is never looked up, so it is never forgotten either
+            if(current->nlookup == 0 && ino != FUSE_ROOT_ID)
+            {
+                if(previous) previous->next = current->next;
+                else inodes[ino % INODE_BUCKET_COUNT] = current->next;
+                remove_alias(current);
+                free(current->path);
+                free(current);
+            }
+            return;
+        }
+        previous = current;
+    }
+}
+
+static void free_all_inodes()
+{
+    pthread_mutex_lock(&inode_mutex);
+    for(int i = 0; i < INODE_BUCKET_COUNT; i++)
+    {
+        struct inode * next = NULL;
+        for(struct inode * current = inodes[i]; current != NULL; current = next)
+        {
+            next = current->next;
+            free(current->path);
+            free(current);
+        }
+        inodes[i] = NULL;
+        aliases[i] = NULL;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+//a copy of the path of this inode, free() it after use
+static char * inode_path(fuse_ino_t ino, int * cacheable)
+{
+    char * path = NULL;
+    pthread_mutex_lock(&inode_mutex);
+    struct inode * inode = find_inode(ino);
+    if(inode)
+    {
+        path = malloc(strlen(inode->path) + 1);
+        if(path) strcpy(path, inode->path);
+        if(cacheable) *cacheable = inode->cacheable;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+    return path;
+}
+
+static char * child_path(fuse_ino_t parent, const char * name)
+{
+    char * parent_path = inode_path(parent, NULL);
+    if(!parent_path) return NULL;
+
+    size_t length = strlen(parent_path);
+    //the root is "/", don't double the separator
+    if(length && parent_path[length - 1] == '/') length--;
+    char * path = malloc(length + strlen(name) + 2);
+    if(path)
+    {
+        memcpy(path, parent_path, length);
+        path[length] = '/';
+        strcpy(path + length + 1, name);
+    }
+    free(parent_path);
+    return path;
+}
+
+static double entry_timeout(int cacheable)
+{
+    return cacheable ? cacheable_timeout : LOWLEVEL_DEFAULT_TIMEOUT;
+}
+
+//stats path and adds it to the inode table, the reply to a successful lookup, mkdir or create
+static int lookup_entry(const char * path, fuse_ino_t parent, struct fuse_entry_param * entry)
+{
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    int result = path_ops->getattr(path, &entry->attr);
+    if(result) return result;
+
+    int cacheable = 0;
+    fuse_ino_t ino = (fuse_ino_t)path_ino_cbr(path, &cacheable);
+
+    pthread_mutex_lock(&inode_mutex);
+    entry->ino = remember_inode(path, ino, parent, cacheable);
+    pthread_mutex_unlock(&inode_mutex);
+    if(!entry->ino) return -ENOMEM;
+
+    entry->generation = 1;
+    entry->attr.st_ino = entry->ino;
+    entry->attr_timeout = entry_timeout(cacheable);
+    entry->entry_timeout = entry_timeout(cacheable);
+    return 0;
+}
+
+static void lowlevel_lookup(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    char * path = child_path(parent, name);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    int result = lookup_entry(path, parent, &entry);
+    if(result == -ENOENT)
+    {
+        //an inode number of 0 lets the kernel remember that there is no such file (for a short while)
+        memset(&entry, 0, sizeof(struct fuse_entry_param));
+        entry.entry_timeout = LOWLEVEL_DEFAULT_TIMEOUT;
+        fuse_reply_entry(req, &entry);
+    }
+    else if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        fuse_reply_entry(req, &entry);
+    }
+    free(path);
+}
+
+static void lowlevel_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&inode_mutex);
+    forget_inode(ino, nlookup);
+    pthread_mutex_unlock(&inode_mutex);
+    fuse_reply_none(req);
+}
+
+static void lowlevel_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    int cacheable = 0;
+    char * path = inode_path(ino, &cacheable);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct stat attr;
+    int result = path_ops->getattr(path, &attr);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        attr.st_ino = ino;
+        fuse_reply_attr(req, &attr, entry_timeout(cacheable));
+    }
+    free(path);
+}
+
+//only truncating is supported, like with the path based operations
+static void lowlevel_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr, int to_set, struct fuse_file_info * fi)
+{
+    if(to_set & ~FUSE_SET_ATTR_SIZE)
+    {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    int cacheable = 0;
+    char * path = inode_path(ino, &cacheable);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct stat current;
+    int result = (to_set & FUSE_SET_ATTR_SIZE) ? path_ops->truncate(path, attr->st_size) : 0;
+    if(!result) result = path_ops->getattr(path, &current);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        current.st_ino = ino;
+        fuse_reply_attr(req, &current, entry_timeout(cacheable));
+    }
+    free(path);
+}
+
+static void lowlevel_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    int cacheable = 0;
+    char * path = inode_path(ino, &cacheable);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int result = path_ops->open(path, fi);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        //don't let the kernel throw away what it read the last time the file was open
+        if(cacheable) fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+    free(path);
+}
+
+static void lowlevel_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    char * path = inode_path(ino, NULL);
+
+#if FUSE_VERSION >= 29
+    //real files come back as their descriptor, which lets the kernel splice them
+    if(path && path_ops->read_buf)
+    {
+        struct fuse_bufvec * bufvec = NULL;
+        int result = path_ops->read_buf(path, &bufvec, size, off, fi);
+        if(result < 0) fuse_reply_err(req, -result);
+        else fuse_reply_data(req, bufvec, FUSE_BUF_SPLICE_MOVE);
+
+        if(bufvec)
+        {
+            for(size_t i = 0; i < bufvec->count; i++)
+            {
+                free(bufvec->buf[i].mem);
+            }
+            free(bufvec);
+        }
+        free(path);
+        return;
+    }
+#endif
+
+    char * buf = path ? malloc(size) : NULL;
+    if(!buf)
+    {
+        fuse_reply_err(req, path ? ENOMEM : ENOENT);
+        free(path);
+        return;
+    }
+
+    int result = path_ops->read(path, buf, size, off, fi);
+    if(result < 0) fuse_reply_err(req, -result);
+    else fuse_reply_buf(req, buf, (size_t)result);
+
+    free(buf);
+    free(path);
+}
+
+static void lowlevel_write(fuse_req_t req, fuse_ino_t ino, const char * buf, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    char * path = inode_path(ino, NULL);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int result = path_ops->write(path, buf, size, off, fi);
+    if(result < 0) fuse_reply_err(req, -result);
+    else fuse_reply_write(req, (size_t)result);
+    free(path);
+}
+
+static void lowlevel_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    char * path = inode_path(ino, NULL);
+    if(path) path_ops->release(path, fi);
+    fuse_reply_err(req, 0);
+    free(path);
+}
+
+static void lowlevel_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info * fi)
+{
+    char * path = inode_path(ino, NULL);
+    fuse_reply_err(req, path ? -path_ops->fsync(path, datasync, fi) : ENOENT);
+    free(path);
+}
+
+static void free_directory_listing(struct directory_listing * listing)
+{
+    if(!listing) return;
+    for(size_t i = 0; i < listing->count; i++)
+    {
+        free(listing->names[i]);
+    }
+    free(listing->names);
+    free(listing->stats);
+    free(listing->path);
+    free(listing);
+}
+
+//the fuse_fill_dir_t for the path based readdir, collects everything in one go
+static int fill_directory_listing(void * buf, const char * name, const struct stat * stbuf, off_t off)
+{
+    struct directory_listing * listing = buf;
+    if(listing->count == listing->capacity)
+    {
+        size_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+        char ** names = realloc(listing->names, capacity * sizeof(char *));
+        if(!names) return 1;
+        listing->names = names;
+        struct stat * stats = realloc(listing->stats, capacity * sizeof(struct stat));
+        if(!stats) return 1;
+        listing->stats = stats;
+        listing->capacity = capacity;
+    }
+
+    char * entry_name = malloc(strlen(name) + 1);
+    if(!entry_name) return 1;
+    strcpy(entry_name, name);
+
+    struct stat * entry_stat = &listing->stats[listing->count];
+    memset(entry_stat, 0, sizeof(struct stat));
+    if(stbuf) entry_stat->st_mode = stbuf->st_mode;
+
+    //same numbers as lookup gives out, unless they collided
+    size_t length = strlen(listing->path);
+    char * path = malloc(length + strlen(name) + 2);
+    if(path)
+    {
+        int cacheable = 0;
+        sprintf(path, "%s%s%s", listing->path, (length && listing->path[length - 1] == '/') ? "" : "/", name);
+        entry_stat->st_ino = (ino_t)path_ino_cbr(path, &cacheable);
+        free(path);
+    }
+
+    listing->names[listing->count++] = entry_name;
+    return 0;
+}
+
+static void lowlevel_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    struct directory_listing * listing = malloc(sizeof(struct directory_listing));
+    if(!listing)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    memset(listing, 0, sizeof(struct directory_listing));
+
+    listing->path = inode_path(ino, NULL);
+    if(!listing->path)
+    {
+        free_directory_listing(listing);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int result = path_ops->readdir(listing->path, listing, fill_directory_listing, 0, fi);
+    if(result)
+    {
+        free_directory_listing(listing);
+        fuse_reply_err(req, -result);
+        return;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)listing;
+    fuse_reply_open(req, fi);
+}
+
+static void lowlevel_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    struct directory_listing * listing = (struct directory_listing *)(uintptr_t)fi->fh;
+    char * buf = malloc(size);
+    if(!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    //the offset of an entry is the index of the next one
+    size_t used = 0;
+    for(size_t i = (size_t)off; i < listing->count; i++)
+    {
+        size_t entry_size = fuse_add_direntry(req, buf + used, size - used, listing->names[i], &listing->stats[i], (off_t)(i + 1));
+        if(entry_size > size - used) break;
+        used += entry_size;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void lowlevel_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    free_directory_listing((struct directory_listing *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void lowlevel_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode)
+{
+    char * path = child_path(parent, name);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    int result = path_ops->mkdir(path, mode);
+    if(!result) result = lookup_entry(path, parent, &entry);
+    if(result) fuse_reply_err(req, -result);
+    else fuse_reply_entry(req, &entry);
+    free(path);
+}
+
+static void lowlevel_unlink(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    char * path = child_path(parent, name);
+    fuse_reply_err(req, path ? -path_ops->unlink(path) : ENOENT);
+    free(path);
+}
+
+static void lowlevel_rmdir(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    char * path = child_path(parent, name);
+    fuse_reply_err(req, path ? -path_ops->rmdir(path) : ENOENT);
+    free(path);
+}
+
+//the inodes the kernel still knows keep their numbers, but now belong to the new path (and the paths below it)
+static void rename_inodes(const char * from, const char * to, fuse_ino_t newparent)
+{
+    size_t from_length = strlen(from);
+    size_t to_length = strlen(to);
+    if(!strcmp(from, to)) return;
+
+    pthread_mutex_lock(&inode_mutex);
+    for(int i = 0; i < INODE_BUCKET_COUNT; i++)
+    {
+        for(struct inode * current = inodes[i]; current != NULL; current = current->next)
+        {
+            //whatever was at the destination is gone, lookups of its path must not find it anymore
+            if(!strncmp(current->path, to, to_length) && (!current->path[to_length] || current->path[to_length] == '/'))
+            {
+                remove_alias(current);
+                current->detached = 1;
+                continue;
+            }
+
+            if(strncmp(current->path, from, from_length) || (current->path[from_length] && current->path[from_length] != '/')) continue;
+
+            char * path = malloc(to_length + strlen(current->path + from_length) + 1);
+            if(!path) continue;
+            strcpy(path, to);
+            strcpy(path + to_length, current->path + from_length);
+            if(!current->path[from_length]) current->parent = newparent;
+            //the kernel keeps using the number it has, so lookups of the new path have to find it by path
+            remove_alias(current);
+            free(current->path);
+            current->path = path;
+            if(!current->detached) add_alias(current);
+        }
+    }
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+static void lowlevel_rename(fuse_req_t req, fuse_ino_t parent, const char * name, fuse_ino_t newparent, const char * newname)
+{
+    char * from = child_path(parent, name);
+    char * to = child_path(newparent, newname);
+    int result = (from && to) ? path_ops->rename(from, to) : -ENOENT;
+    if(!result) rename_inodes(from, to, newparent);
+    fuse_reply_err(req, -result);
+    free(from);
+    free(to);
+}
+
+static void lowlevel_create(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode, struct fuse_file_info * fi)
+{
+    char * path = child_path(parent, name);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    int result = path_ops->create(path, mode, fi);
+    if(!result)
+    {
+        result = lookup_entry(path, parent, &entry);
+        if(result) path_ops->release(path, fi);
+    }
+    if(result) fuse_reply_err(req, -result);
+    else fuse_reply_create(req, &entry, fi);
+    free(path);
+}
+
+static void lowlevel_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stat;
+    memset(&stat, 0, sizeof(struct statvfs));
+    int result = path_ops->statfs("/", &stat);
+    if(result) fuse_reply_err(req, -result);
+    else fuse_reply_statfs(req, &stat);
+}
+
+#if FUSE_VERSION >= 29
+static void lowlevel_init(void * userdata, struct fuse_conn_info * conn)
+{
+    if(path_ops->init) path_ops->init(conn);
+}
+#endif
+
+static struct fuse_lowlevel_ops lowlevel_operations =
+{
+#if FUSE_VERSION >= 29
+    .init        = lowlevel_init,
+#endif
+    .lookup      = lowlevel_lookup,
+    .forget      = lowlevel_forget,
+    .getattr     = lowlevel_getattr,
+    .setattr     = lowlevel_setattr,
+    .open        = lowlevel_open,
+    .read        = lowlevel_read,
+    .write       = lowlevel_write,
+    .release     = lowlevel_release,
+    .fsync       = lowlevel_fsync,
+    .opendir     = lowlevel_opendir,
+    .readdir     = lowlevel_readdir,
+    .releasedir  = lowlevel_releasedir,
+    .mkdir       = lowlevel_mkdir,
+    .unlink      = lowlevel_unlink,
+    .rmdir       = lowlevel_rmdir,
+    .rename      = lowlevel_rename,
+    .create      = lowlevel_create,
+    .statfs      = lowlevel_statfs
+};
+
+int lowlevel_main(struct fuse_args * args, const struct fuse_operations * ops, lowlevel_ino_cbr ino_cbr, double cache_timeout)
+{
+    char * mountpoint = NULL;
+    int multithreaded = 0;
+    int foreground = 0;
+    int result = 1;
+
+    path_ops = ops;
+    path_ino_cbr = ino_cbr;
+    cacheable_timeout = cache_timeout;
+
+    pthread_mutex_lock(&inode_mutex);
+    int root_ok = remember_inode("/", FUSE_ROOT_ID, 0, 0) == FUSE_ROOT_ID;
+    pthread_mutex_unlock(&inode_mutex);
+
+    if(!root_ok || fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 || !mountpoint)
+    {
+        err_printf("MLVFS: could not set up the low-level FUSE session\n");
+        free(mountpoint);
+        free_all_inodes();
+        return 1;
+    }
+
+    struct fuse_chan * chan = fuse_mount(mountpoint, args);
+    if(chan)
+    {
+        struct fuse_session * session = fuse_lowlevel_new(args, &lowlevel_operations, sizeof(lowlevel_operations), NULL);
+        if(session)
+        {
+            if(fuse_set_signal_handlers(session) != -1)
+            {
+                fuse_session_add_chan(session, chan);
+                pthread_rwlock_wrlock(&chan_lock);
+                mounted_chan = chan;
+                pthread_rwlock_unlock(&chan_lock);
+
+                if(fuse_daemonize(foreground) != -1)
+                {
+                    result = (multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session)) == -1 ? 1 : 0;
+                }
+
+                pthread_rwlock_wrlock(&chan_lock);
+                mounted_chan = NULL;
+                pthread_rwlock_unlock(&chan_lock);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+
+    free(mountpoint);
+    free_all_inodes();
+    return result;
+}
+
+void lowlevel_invalidate_cache(void)
+{
+    //collected first: the kernel may need a request answered (which uses the inode table) before it can drop an entry
+    pthread_mutex_lock(&inode_mutex);
+    size_t count = 0;
+    for(int i = 0; i < INODE_BUCKET_COUNT; i++)
+    {
+        for(struct inode * current = inodes[i]; current != NULL; current = current->next)
+        {
+            if(current->cacheable) count++;
+        }
+    }
+
+    struct inode_invalidation * invalidations = count ? malloc(count * sizeof(struct inode_invalidation)) : NULL;
+    size_t invalidation_count = 0;
+    for(int i = 0; invalidations && i < INODE_BUCKET_COUNT; i++)
+    {
+        for(struct inode * current = inodes[i]; current != NULL; current = current->next)
+        {
+            if(!current->cacheable) continue;
+            const char * name = find_last_separator(current->path);
+            struct inode_invalidation * invalidation = &invalidations[invalidation_count++];
+            invalidation->ino = current->ino;
+            invalidation->parent = current->parent;
+            invalidation->name = malloc(strlen(name ? name + 1 : current->path) + 1);
+            if(invalidation->name) strcpy(invalidation->name, name ? name + 1 : current->path);
+        }
+    }
+    pthread_mutex_unlock(&inode_mutex);
+
+    pthread_rwlock_rdlock(&chan_lock);
+    for(size_t i = 0; i < invalidation_count; i++)
+    {
+        if(mounted_chan)
+        {
+            //attributes and page cache, then the name (file names depend on the settings too)
+            fuse_lowlevel_notify_inval_inode(mounted_chan, invalidations[i].ino, 0, 0);
+            if(invalidations[i].parent && invalidations[i].name)
+            {
+                fuse_lowlevel_notify_inval_entry(mounted_chan, invalidations[i].parent, invalidations[i].name, strlen(invalidations[i].name));
+            }
+        }
+        free(invalidations[i].name);
+    }
+    pthread_rwlock_unlock(&chan_lock);
+    free(invalidations);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef mlvfs_lowlevel_h
+#define mlvfs_lowlevel_h
+
+#include <stdint.h>
+#include <fuse.h>
+
+//attribute and entry timeout (seconds) for files that are not part of a clip
+#define LOWLEVEL_DEFAULT_TIMEOUT 1.0
+//default for --cache-timeout=%d
+#define DEFAULT_CACHE_TIMEOUT 60
+
+//the inode number for this path (never with bit 62 set), *cacheable is set if the kernel may keep its attributes and contents
+typedef uint64_t(*lowlevel_ino_cbr)(const char * path, int * cacheable);
+
+/**
+ * Mounts the filesystem with the FUSE low-level API, the path based operations are called through an inode table
+ * @param cache_timeout How long the kernel may cache entries and attributes of cacheable files (seconds)
+ * @return 0 on success, 1 if mounting failed
+ */
+int lowlevel_main(struct fuse_args * args, const struct fuse_operations * ops, lowlevel_ino_cbr ino_cbr, double cache_timeout);
+
+//drops everything the kernel caches for the files in clips, e.g. after the processing settings changed
+void lowlevel_invalidate_cache(void);
+
+#endif
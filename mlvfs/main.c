@@ -41,6 +41,11 @@
 #include "cs.h"
 #include "hdr.h"
 #include "webgui.h"
+#include "preindex.h"
+#include "prefetch.h"
+#include "async_io.h"
+#include "bufpool.h"
+#include "lowlevel.h"
 #include "resource_manager.h"
 #include "mlvfs.h"
 #include "LZMA/LzmaLib.h"
@@ -53,6 +58,10 @@
 
 static struct mlvfs mlvfs;
 
+/* real files keep their descriptor open from open() to release() in fi->fh, 0 means there is none (virtual files) */
+#define FH_FROM_FD(fd) ((uint64_t)(fd) + 1)
+#define FD_FROM_FH(fh) ((int)((fh) - 1))
+
 #ifdef _WIN32
 
 #include <io.h>
@@ -309,35 +318,13 @@ static char *path_slashfix(char *path)
     return path;
 }
 
-/**
- * Parse the frame number out of a file path and return it as an integer
- * @param path The virtual file path of the DNG
- * @return The frame number for that DNG
- */
-static int get_mlv_frame_number(const char *path)
-{
-    int result = 0;
-    char *temp = copy_string(path);
-    char *dot = strrchr(temp, '.');
-    if(dot > temp + 6)
-    {
-        *dot = '\0';
-        result = atoi(dot - 6);
-    }
-    free(temp);
-    return result;
-}
-
 /**
  * Make sure you free() the result!!!
  */
 static char * mlv_read_debug_log(const char *mlv_filename)
 {
-    FILE **chunk_files = NULL;
-    uint32_t chunk_count = 0;
-    
-    chunk_files = mlvfs_load_chunks(mlv_filename, &chunk_count);
-    if(!chunk_files || !chunk_count)
+    struct mlv_chunks * chunks = mlvfs_open_chunks(mlv_filename);
+    if(!chunks)
     {
         return NULL;
     }
@@ -345,7 +332,7 @@ static char * mlv_read_debug_log(const char *mlv_filename)
     mlv_xref_hdr_t *block_xref = get_index(mlv_filename);
     if (!block_xref)
     {
-        mlvfs_close_chunks(chunk_files, chunk_count);
+        mlvfs_release_chunks(chunks);
         return NULL;
     }
     mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
@@ -361,19 +348,14 @@ static char * mlv_read_debug_log(const char *mlv_filename)
         uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
         int64_t position = xrefs[block_xref_pos].frameOffset;
         
-        /* select file */
-        FILE *in_file = chunk_files[in_file_num];
-        
         if(xrefs[block_xref_pos].frameType == MLV_FRAME_UNSPECIFIED)
         {
-            file_set_pos(in_file, position, SEEK_SET);
-            if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file))
+            if(mlvfs_read_chunk(chunks, in_file_num, &mlv_hdr, sizeof(mlv_hdr_t), position) == sizeof(mlv_hdr_t))
             {
-                file_set_pos(in_file, position, SEEK_SET);
                 if(!memcmp(mlv_hdr.blockType, "DEBG", 4))
                 {
                     hdr_size = MIN(sizeof(mlv_debg_hdr_t), mlv_hdr.blockSize);
-                    if(fread(&debg_hdr, hdr_size, 1, in_file))
+                    if(mlvfs_read_chunk(chunks, in_file_num, &debg_hdr, hdr_size, position) == hdr_size)
                     {
                         char * temp = NULL;
                         if(result)
@@ -389,14 +371,9 @@ static char * mlv_read_debug_log(const char *mlv_filename)
                         }
                         if(result)
                         {
-                            if(fread(temp, debg_hdr.length, 1, in_file))
-                            {
-                                //make sure the string is terminated
-                                if(temp[debg_hdr.length - 1] != 0)
-                                {
-                                    temp[debg_hdr.length] = 0;
-                                }
-                            }
+                            //make sure the string is terminated
+                            size_t length = mlvfs_read_chunk(chunks, in_file_num, temp, debg_hdr.length, position + hdr_size);
+                            temp[length] = 0;
                         }
                         else
                         {
@@ -406,16 +383,11 @@ static char * mlv_read_debug_log(const char *mlv_filename)
                     }
                 }
             }
-            if(ferror(in_file))
-            {
-                int err = errno;
-                err_printf("fread error: %s\n", strerror(err));
-            }
         }
     }
 
     free(block_xref);
-    mlvfs_close_chunks(chunk_files, chunk_count);
+    mlvfs_release_chunks(chunks);
 
     return result;
 }
@@ -429,145 +401,48 @@ static char * mlv_read_debug_log(const char *mlv_filename)
  */
 int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_headers * frame_headers)
 {
-    FILE **chunk_files = NULL;
-    uint32_t chunk_count = 0;
+    memset(frame_headers, 0, sizeof(struct frame_headers));
 
-    chunk_files = mlvfs_load_chunks(mlv_filename, &chunk_count);
-    if(!chunk_files || !chunk_count)
+    struct frame_table * frame_table = mlvfs_get_frame_table(mlv_filename);
+    if(!frame_table)
     {
         return 0;
     }
 
-    memset(frame_headers, 0, sizeof(struct frame_headers));
-
-    mlv_xref_hdr_t *block_xref = get_index(mlv_filename);
-    if (!block_xref)
+    //Matches to number in sequence rather than frameNumber in header for consistency with readdir
+    if(index < 0 || (uint32_t)index >= frame_table->frame_count)
     {
-        mlvfs_close_chunks(chunk_files, chunk_count);
+        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", mlv_filename, index);
+        mlvfs_release_frame_table(frame_table);
         return 0;
     }
 
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-
-    int found = 0;
-    int rawi_found = 0;
-    uint32_t vidf_counter = 0;
-    mlv_hdr_t mlv_hdr;
-    uint32_t hdr_size;
+    struct frame_table_entry * frame = &frame_table->frames[index];
+    memcpy(frame_headers, &frame_table->headers[frame->headers], sizeof(struct frame_headers));
+    frame_headers->fileNumber = frame->fileNumber;
+    frame_headers->position = frame->position;
+    frame_headers->vidf_hdr = frame->vidf_hdr;
+    mlvfs_release_frame_table(frame_table);
 
-    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount) && !found; block_xref_pos++)
-    {
-        /* get the file and position of the next block */
-        uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
-        int64_t position = xrefs[block_xref_pos].frameOffset;
-
-        /* select file */
-        FILE *in_file = chunk_files[in_file_num];
-
-        switch(xrefs[block_xref_pos].frameType)
-        {
-            case MLV_FRAME_VIDF:
-                //Matches to number in sequence rather than frameNumber in header for consistency with readdir
-                if(index == vidf_counter)
-                {
-                    found = 1;
-                    frame_headers->fileNumber = in_file_num;
-                    frame_headers->position = position;
-                    file_set_pos(in_file, position, SEEK_SET);
-                    fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file);
-                    file_set_pos(in_file, position, SEEK_SET);
-                    hdr_size = MIN(sizeof(mlv_vidf_hdr_t), mlv_hdr.blockSize);
-                    fread(&frame_headers->vidf_hdr, hdr_size, 1, in_file);
-                }
-                else
-                {
-                    vidf_counter++;
-                }
-                break;
-
-            case MLV_FRAME_AUDF:
-                break;
-
-            case MLV_FRAME_UNSPECIFIED:
-            default:
-                file_set_pos(in_file, position, SEEK_SET);
-                if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file))
-                {
-                    file_set_pos(in_file, position, SEEK_SET);
-                    if(!memcmp(mlv_hdr.blockType, "MLVI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_file_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->file_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "RTCI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_rtci_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->rtci_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_idnt_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->idnt_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "RAWI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_rawi_hdr_t), mlv_hdr.blockSize);
-                        if(fread(&frame_headers->rawi_hdr, hdr_size, 1, in_file))
-                        {
-                            rawi_found = 1;
-                        }
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "EXPO", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_expo_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->expo_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "LENS", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_lens_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->lens_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "WBAL", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_wbal_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->wbal_hdr, hdr_size, 1, in_file);
-                    }
-                }
-        }
-        
-        if(ferror(in_file))
-        {
-            int err = errno;
-            err_printf("%s: fread error: %s\n", mlv_filename, strerror(err));
-        }
-    }
-    
-    if(found && !rawi_found)
+    if(memcmp(frame_headers->rawi_hdr.blockType, "RAWI", 4))
     {
         err_printf("%s: Error reading frame headers: no rawi block was found\n", mlv_filename);
+        return 0;
     }
-    
-    if(!found)
-    {
-        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", mlv_filename, index);
-    }
-    
-    free(block_xref);
-    mlvfs_close_chunks(chunk_files, chunk_count);
 
-    return found && rawi_found;
+    return 1;
 }
 
 /**
  * Retrieves and unpacks image data for a requested section of a video frame
  * @param frame_headers The MLV blocks associated with the frame
- * @param file The file containing the frame data
+ * @param chunks The open chunk files of the MLV
  * @param output_buffer [out] The buffer to write the result into
  * @param offset The offset into the frame to retrieve
  * @param max_size The amount of frame data to read
  * @return the number of bytes retrieved, or 0 if failure.
  */
-size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t * output_buffer, off_t offset, size_t max_size)
+size_t get_image_data(struct frame_headers * frame_headers, struct mlv_chunks * chunks, uint8_t * output_buffer, off_t offset, size_t max_size)
 {
     int lzma_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
     int lj92_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
@@ -577,21 +452,25 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
 
     if(lzma_compressed || lj92_compressed)
     {
-        file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t), SEEK_SET);
         size_t frame_size = frame_headers->vidf_hdr.blockSize - (frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
+        uint64_t frame_offset = frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t);
 
-        uint8_t * frame_buffer = malloc(frame_size);
+        /* the payload may have been read ahead already, see async_read_payloads() */
+        uint8_t * frame_buffer = async_take_payload(chunks, frame_headers->fileNumber, frame_offset, frame_size);
+        int read_ahead = frame_buffer != NULL;
+        if (!frame_buffer)
+        {
+            frame_buffer = bufpool_alloc(frame_size);
+        }
         if (!frame_buffer)
         {
             err_printf("framebuffer malloc failed!\n");
             return 0;
         }
         
-        fread(frame_buffer, sizeof(uint8_t), frame_size, file);
-        if(ferror(file))
+        if(!read_ahead && mlvfs_read_chunk(chunks, frame_headers->fileNumber, frame_buffer, frame_size, frame_offset) != frame_size)
         {
-            int err = errno;
-            err_printf("fread error: %s\n", strerror(err));
+            err_printf("could not read the frame data\n");
         }
         else
         {
@@ -600,11 +479,11 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                 size_t lzma_out_size = *(uint32_t *)frame_buffer;
                 size_t lzma_in_size = frame_size - LZMA_PROPS_SIZE - 4;
                 size_t lzma_props_size = LZMA_PROPS_SIZE;
-                uint8_t *lzma_out = malloc(lzma_out_size);
+                uint8_t *lzma_out = bufpool_alloc(lzma_out_size);
                 
-                int ret = LzmaUncompress(lzma_out, &lzma_out_size,
-                                         &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
-                                         &frame_buffer[4], lzma_props_size);
+                int ret = lzma_out ? LzmaUncompress(lzma_out, &lzma_out_size,
+                                                    &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
+                                                    &frame_buffer[4], lzma_props_size) : SZ_ERROR_MEM;
                 if(ret == SZ_OK)
                 {
                     result = dng_get_image_data(frame_headers, (uint16_t*)lzma_out, output_buffer, offset, max_size);
@@ -613,6 +492,7 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                 {
                     err_printf("LZMA Failed!\n");
                 }
+                bufpool_free(lzma_out);
             }
             else if(lj92_compressed)
             {
@@ -628,7 +508,11 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                 ret = lj92_open(&lj92_handle, frame_buffer, (int)frame_size , &lj92_width, &lj92_height, &lj92_bitdepth, &lj92_components);
                 size_t out_size = lj92_width * lj92_height * lj92_components;
                 
-                if(ret == LJ92_ERROR_NONE)
+                if(ret == LJ92_ERROR_NONE && out_size * sizeof(uint16_t) > max_size)
+                {
+                    err_printf("LJ92: Frame too large (%dx%d)\n", lj92_width, lj92_height);
+                }
+                else if(ret == LJ92_ERROR_NONE)
                 {
                     ret = lj92_decode(lj92_handle, (uint16_t*)output_buffer, out_size, 0, NULL, 0);
                     
@@ -636,17 +520,21 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                     {
                         err_printf("LJ92: Failed (%d)\n", ret);
                     }
+                    else
+                    {
+                        result = out_size * sizeof(uint16_t);
+                    }
                 }
                 else
                 {
                     err_printf("LJ92: Open failed (%d)\n", ret);
                 }
-                result = ret;
                 lj92_close(lj92_handle);
             }
         }
-        free(frame_buffer);
+        bufpool_free(frame_buffer);
         frame_buffer = NULL;
+        mlvfs_advise_chunk(chunks, frame_headers->fileNumber, frame_offset, frame_size, MLVFS_IO_DONTNEED);
     }
     else
     {
@@ -655,23 +543,36 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
         size_t output_size = max_size - (offset < 0 ? (size_t)(-offset) : 0);
 
         uint64_t pixel_count = output_size / 2;
-        uint64_t packed_size = (pixel_count + 2) * bpp / 16;
-        uint16_t * packed_bits = calloc((size_t)(packed_size * 2), 1);
+        /* up to the word after the one holding the last pixel, the unpacker always reads two words */
+        uint64_t packed_size = (pixel_start_index + pixel_count) * bpp / 16 + 2 - pixel_start_address;
+        uint64_t packed_offset = frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t) + pixel_start_address * 2;
+
+        /* with --mmap, unpack straight from the mapped file (unless the extra words would go beyond its end) */
+        const uint8_t * mapped_bits = mlvfs_map_chunk(chunks, frame_headers->fileNumber, packed_offset, (size_t)packed_size * sizeof(uint16_t));
+        if(mapped_bits && !((uintptr_t)mapped_bits & 1))
+        {
+            return dng_get_image_data(frame_headers, (uint16_t *)mapped_bits, output_buffer, offset, max_size);
+        }
+
+        uint16_t * packed_bits = bufpool_alloc((size_t)packed_size * sizeof(uint16_t));
         
         if(packed_bits)
         {
-            file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t) + pixel_start_address * 2, SEEK_SET);
-            fread(packed_bits, sizeof(uint16_t), (size_t)packed_size, file);
-            if(ferror(file))
+            /* the last frame may end before the extra words, the rest is zeroed */
+            size_t bytes_read = mlvfs_read_chunk(chunks, frame_headers->fileNumber, packed_bits, (size_t)packed_size * sizeof(uint16_t), packed_offset);
+            if(bytes_read < (size_t)packed_size * sizeof(uint16_t))
             {
-                int err = errno;
-                err_printf("fread error: %s\n", strerror(err));
+                memset((uint8_t *)packed_bits + bytes_read, 0, (size_t)packed_size * sizeof(uint16_t) - bytes_read);
             }
-            else
+            result = dng_get_image_data(frame_headers, packed_bits, output_buffer, offset, max_size);
+            if(bytes_read < (size_t)(packed_size - 2) * sizeof(uint16_t))
             {
-                result = dng_get_image_data(frame_headers, packed_bits, output_buffer, offset, max_size);
+                //the frame itself is cut short (e.g. a truncated MLV), the caller decides what to do with the zeros
+                result = 0;
             }
-            free(packed_bits);
+            bufpool_free(packed_bits);
+            //not the extra words, the next piece starts there
+            mlvfs_advise_chunk(chunks, frame_headers->fileNumber, packed_offset, (packed_size - 2) * sizeof(uint16_t), MLVFS_IO_DONTNEED);
         }
     }
     return result;
@@ -692,11 +593,11 @@ static int get_mlv_basename(const char *path, char ** mlv_basename)
     char *dot = strrchr(start, '.');
     if(dot == NULL) { free(temp); return 0; }
     *dot = '\0';
-    struct frame_headers frame_headers;
-    if(mlvfs.name_scheme == 1 && mlv_get_frame_headers(path, 0, &frame_headers))
+    struct clip_info clip_info;
+    if(mlvfs.name_scheme == 1 && mlvfs_get_clip_info(path, &clip_info) && clip_info.has_headers)
     {
         *mlv_basename =  malloc(sizeof(char) * (strlen(start) + 1024));
-        sprintf(*mlv_basename, "%s%s_1_%d-%02d-%02d_%04d_C%04d", start, dot + 1, 1900 + frame_headers.rtci_hdr.tm_year, frame_headers.rtci_hdr.tm_mon + 1, frame_headers.rtci_hdr.tm_mday, 1, 0);
+        sprintf(*mlv_basename, "%s%s_1_%d-%02d-%02d_%04d_C%04d", start, dot + 1, clip_info.year, clip_info.month, clip_info.day, 1, 0);
     }
     else
     {
@@ -706,34 +607,64 @@ static int get_mlv_basename(const char *path, char ** mlv_basename)
     return 1;
 }
 
-static char * get_capture(struct slre_cap cap)
+/**
+ * Joins a base path and a relative path into a buffer, with the separators fixed
+ * @param path The relative path, does not need to be null terminated
+ * @param length The length of the relative path
+ * @return 1 if successful, 0 if the result doesn't fit into the buffer
+ */
+static int path_join(char * buffer, size_t size, const char * base, const char * path, size_t length)
 {
-    if (!cap.ptr) return NULL;
-    char * result = copy_string(cap.ptr);
-    if(result) result[cap.len] = 0;
-    return result;
+    size_t base_length = strlen(base);
+    while (length > 0 && is_dir_separator(path[0]))
+    {
+        path++;
+        length--;
+    }
+    if (base_length + length + 2 > size) return 0;
+
+    memcpy(buffer, base, base_length);
+    if (base_length == 0 || !is_dir_separator(base[base_length - 1]))
+    {
+        buffer[base_length++] = DIR_SEP_CHAR;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        buffer[base_length + i] = is_dir_separator(path[i]) ? DIR_SEP_CHAR : path[i];
+    }
+    buffer[base_length + length] = 0;
+    return 1;
 }
 
 /**
- * Generates a customizable virtual name for the MLV file (for the virtual directory)
- * Make sure you free() the result!!!
- * @param path The virtual path
- * @param mlv_basename [out] The MLV basename
+ * Finds the real MLV for a customized virtual name of a MLV (for the virtual directory)
+ * @param path The virtual path, does not need to be null terminated
+ * @param length The length of the virtual path
+ * @param mlv_file [out] The real path of the MLV, MLVFS_PATH_MAX in size
  * @return 1 if successful, 0 otherwise
  */
-static int get_mlv_name_from_basename(const char *path, char ** mlv_name)
+static int get_mlv_name_from_basename(const char *path, size_t length, char * mlv_file)
 {
     if(mlvfs.name_scheme == 1)
     {
+        //the regex can only match names that contain this
+        int possible = 0;
+        for(size_t i = 0; i + 6 <= length && !possible; i++)
+        {
+            possible = !strncmp(path + i, "MLV_1_", 6) || !strncmp(path + i, "mlv_1_", 6);
+        }
+        if(!possible) return 0;
+
         struct slre_cap caps[2];
         memset(caps, 0, sizeof(caps));
-        if(slre_match("(.+)(MLV|mlv)_1_\\d+-\\d+-\\d+_\\d+_[C|c]\\d+", path, (int)strlen(path), caps, 2, 0) >= 0)
+        if(slre_match("(.+)(MLV|mlv)_1_\\d+-\\d+-\\d+_\\d+_[C|c]\\d+", path, (int)length, caps, 2, 0) >= 0 && caps[0].ptr && caps[1].ptr)
         {
-            char * result = get_capture(caps[0]);
-            char * ext = get_capture(caps[1]);
-            *mlv_name = concat_string3(result, ".", ext);
-            free(ext);
-            free(result);
+            if(!path_join(mlv_file, MLVFS_PATH_MAX, mlvfs.mlv_path, caps[0].ptr, caps[0].len)) return 0;
+            size_t mlv_length = strlen(mlv_file);
+            if(mlv_length + caps[1].len + 2 > MLVFS_PATH_MAX) return 0;
+            mlv_file[mlv_length] = '.';
+            memcpy(mlv_file + mlv_length + 1, caps[1].ptr, caps[1].len);
+            mlv_file[mlv_length + 1 + caps[1].len] = 0;
             return 1;
         }
         else
@@ -743,12 +674,41 @@ static int get_mlv_name_from_basename(const char *path, char ** mlv_name)
     }
     else
     {
-        *mlv_name = copy_string(path);
-        return 1;
+        return path_join(mlv_file, MLVFS_PATH_MAX, mlvfs.mlv_path, path, length);
     }
     return 0;
 }
 
+/**
+ * Checks if a part of a virtual path names a MLV
+ * @param path The virtual path, does not need to be null terminated
+ * @param length The length of the virtual path
+ * @param mlv_file [out] The real path of the MLV, MLVFS_PATH_MAX in size
+ * @return 1 if it is a MLV, 0 otherwise
+ */
+static int resolve_mlv_name(const char *path, size_t length, char * mlv_file)
+{
+    if (mlvfs.name_scheme)
+    {
+        /* readdir registers the names it generates, so this is rarely a miss */
+        if (mlvfs_lookup_clip_path(path, length, mlvfs.name_scheme, mlv_file, MLVFS_PATH_MAX))
+        {
+            return 1;
+        }
+        if (get_mlv_name_from_basename(path, length, mlv_file))
+        {
+            mlvfs_register_clip_path(path, length, mlvfs.name_scheme, mlv_file);
+            return 1;
+        }
+    }
+
+    /* just treat as if it were existing. will fail later */
+    if (length >= 4 && (!filename_strncmp(path + length - 4, ".MLV", 4) || !filename_strncmp(path + length - 4, ".mlv", 4)))
+    {
+        return path_join(mlv_file, MLVFS_PATH_MAX, mlvfs.mlv_path, path, length);
+    }
+    return 0;
+}
 
 static int is_mlv_file(char *filename)
 {
@@ -766,81 +726,105 @@ static int is_mlv_file(char *filename)
 
 /**
  * check if the given path is within a MLV file or a MLV itself
- * Make sure you free() the result
+ * Nothing is allocated, resolved->path_in_mlv points into path
  * @return 1 if the real path is a MLV or inside a MLV, 0 otherwise
  */
-static int mlvfs_resolve_path(const char *path, char **mlv_file, char **path_in_mlv)
+static int mlvfs_resolve_path(const char *path, struct mlvfs_path * resolved)
 {
     if(strstr(path,"/._")) return 0;
-    int ret = 0;
-    int done = 0;
-    const char *current_token = path;
-    char *current_path = malloc(strlen(path) + 16);
-    current_path[0] = 0;
-    
-    while (!done)
+
+    /* the parts of the path are checked one by one, [start, end) is the part checked so far */
+    const char *start = path;
+    while (is_dir_separator(*start))
+    {
+        start++;
+    }
+    const char *end = start;
+
+    while (1)
     {
         /* skip leading slashes */
-        while (find_first_separator(current_token) == current_token)
-        {
-            current_token++;
-        }
-        
-        /* check if the current path is already a valid MLV */
-        char *mlv_file_check = path_append(mlvfs.mlv_path, path_slashfix(current_path));
-        char *mlv_name = NULL;
-        
-        if (mlvfs.name_scheme && get_mlv_name_from_basename(path_slashfix(current_path), &mlv_name))
+        const char *rest = end;
+        while (is_dir_separator(*rest))
         {
-            *mlv_file = path_append(mlvfs.mlv_path, mlv_name);
-            *path_in_mlv = copy_string(current_token);
-            done = 1;
-            ret = 1;
-            free(mlv_name);
+            rest++;
         }
-        else if (is_mlv_file(mlv_file_check))
+
+        if (resolve_mlv_name(start, (size_t)(end - start), resolved->mlv_file))
         {
             /* ok, return MLV path and virtual file path (or empty) */
-            *mlv_file = path_append(mlvfs.mlv_path, path_slashfix(current_path));
-            *path_in_mlv = copy_string(current_token);
-            done = 1;
-            ret = 1;
+            resolved->path_in_mlv = rest;
+            resolved->type = MLVFS_FILE_OTHER;
+            resolved->frame_number = 0;
+
+            /* DNGs etc in the MLV root are virtual */
+            if (*rest && !find_first_separator(rest))
+            {
+                if (string_ends_with(rest, ".dng")) resolved->type = MLVFS_FILE_DNG;
+                else if (string_ends_with(rest, ".exr")) resolved->type = MLVFS_FILE_EXR;
+                else if (string_ends_with(rest, ".wav")) resolved->type = MLVFS_FILE_WAV;
+                else if (string_ends_with(rest, ".gif")) resolved->type = MLVFS_FILE_GIF;
+                else if (string_ends_with(rest, ".log")) resolved->type = MLVFS_FILE_LOG;
+
+                /* the frame number are the 6 digits in front of the extension */
+                if ((resolved->type == MLVFS_FILE_DNG || resolved->type == MLVFS_FILE_EXR) && strlen(rest) > 10)
+                {
+                    resolved->frame_number = atoi(rest + strlen(rest) - 10);
+                }
+            }
+            return 1;
         }
-        else if (*current_token == 0)
+        else if (*rest == 0)
         {
             /* no more tokens, its not a virtual file */
-            done = 1;
+            return 0;
         }
-        else
+
+        /* add the next token */
+        end = rest;
+        while (*end && !is_dir_separator(*end))
         {
-            /* no slash in the front */
-            if (strlen(current_path) != 0)
-            {
-                strcat(current_path, DIR_SEP_STR);
-            }
-            
-            /* is there another slash? */
-            char *token_end = find_first_separator((const char*)current_token);
-            if (token_end)
-            {
-                /* yes, add token until slash */
-                uint32_t length = (uint32_t)((uintmax_t)token_end - (uintmax_t)current_token);
-                strncat(current_path, current_token, length);
-                current_token = token_end + 1;
-            }
-            else
-            {
-                /* no, add remaining token */
-                strcat(current_path, current_token);
-                current_token += strlen(current_token);
-            }
+            end++;
         }
-        free(mlv_file_check);
     }
-    
-    free(current_path);
-    
-    return ret;
+    return 0;
+}
+
+/**
+ * try to find the real file path from a resolved virtual path
+ * @param in_mlv The result of mlvfs_resolve_path() for that path
+ * @param real_path [out] The name of the file on disk, MLVFS_PATH_MAX in size
+ * @return 0 if this is a pure virtual file, 1 otherwise
+ */
+static int mlvfs_get_real_path(const char *path, struct mlvfs_path * resolved, int in_mlv, char * real_path)
+{
+    if (!in_mlv)
+    {
+        /* this file is not within a virtual directory, so just get it from the existing one */
+        return path_join(real_path, MLVFS_PATH_MAX, mlvfs.mlv_path, path, strlen(path));
+    }
+    else if (resolved->type != MLVFS_FILE_OTHER)
+    {
+        /* a DNG etc in the MLV root -> virtual */
+        return 0;
+    }
+    else if (*resolved->path_in_mlv == 0)
+    {
+        /* it is the MLV itself */
+        strcpy(real_path, resolved->mlv_file);
+        return 1;
+    }
+    else
+    {
+        char mld_name[MLVFS_PATH_MAX];
+        strcpy(mld_name, resolved->mlv_file);
+        char *dot = strrchr(mld_name, '.');
+        if (dot && strlen(dot) == 4)
+        {
+            strcpy(dot, ".MLD");
+        }
+        return path_join(real_path, MLVFS_PATH_MAX, mld_name, resolved->path_in_mlv, strlen(resolved->path_in_mlv));
+    }
 }
 
 static void check_mld_exists(char * path)
@@ -877,150 +861,349 @@ static void deflicker(struct frame_headers * frame_headers, int target, uint16_t
     frame_headers->rawi_hdr.raw_info.exposure_bias[1] = 10000;
 }
 
+static uint64_t settings_hash(uint64_t hash, int64_t value)
+{
+    return fnv1a_data(&value, sizeof(value), hash);
+}
+
+//the raw processing DNGs and EXRs share, see process_frame()
+static uint64_t raw_settings()
+{
+    uint64_t hash = FNV1A_SEED;
+    hash = settings_hash(hash, mlvfs.deflicker);
+    hash = settings_hash(hash, mlvfs.fix_pattern_noise);
+    hash = settings_hash(hash, mlvfs.dual_iso);
+    if(mlvfs.dual_iso == 2)
+    {
+        hash = settings_hash(hash, mlvfs.hdr_interpolation_method);
+        hash = settings_hash(hash, mlvfs.hdr_no_fullres);
+        hash = settings_hash(hash, mlvfs.hdr_no_alias_map);
+    }
+    hash = settings_hash(hash, mlvfs.fix_bad_pixels);
+    hash = settings_hash(hash, mlvfs.chroma_smooth);
+    hash = settings_hash(hash, mlvfs.fix_stripes);
+    return hash;
+}
+
+uint64_t mlvfs_dng_settings()
+{
+    uint64_t hash = raw_settings();
+    hash = settings_hash(hash, (int64_t)(mlvfs.fps * 1000));
+    hash = settings_hash(hash, mlvfs.compress_dng);
+    return hash;
+}
+
+uint64_t mlvfs_exr_settings()
+{
+    uint64_t hash = raw_settings();
+    //process_frame() clamps it the same way
+    hash = settings_hash(hash, mlvfs.white_balance ? COERCE(mlvfs.white_balance, 100, 9500) : 0);
+    hash = settings_hash(hash, (int64_t)(mlvfs.headroom * 1000));
+    hash = settings_hash(hash, mlvfs.highlight);
+    hash = settings_hash(hash, mlvfs.debayer);
+    return hash;
+}
+
+/**
+ * The settings a rendered file depends on, rendered files are cached with them (see get_or_create_image_buffer)
+ * DNGs don't depend on the EXR settings and vice versa, so changing those in the webgui keeps the others cached
+ */
+uint64_t mlvfs_image_settings(const char * path)
+{
+    //previews are never post processed
+    if(string_ends_with(path, ".gif")) return 0;
+    return string_ends_with(path, ".exr") ? mlvfs_exr_settings() : mlvfs_dng_settings();
+}
+
+//whether a DNG is anything but the unpacked pixels of the MLV
+static int dng_needs_processing()
+{
+    return mlvfs.deflicker || mlvfs.fix_pattern_noise || mlvfs.dual_iso || mlvfs.fix_bad_pixels ||
+           mlvfs.chroma_smooth || mlvfs.fix_stripes || mlvfs.compress_dng;
+}
+
 static int process_frame(struct image_buffer * image_buffer)
 {
-    char * mlv_filename = NULL;
-    char * path_in_mlv = NULL;
+    struct mlvfs_path resolved;
     const char * path = image_buffer->dng_filename;
     
-    if((string_ends_with(path, ".dng") || string_ends_with(path, ".exr")) && mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    if(!mlvfs_resolve_path(path, &resolved) || (resolved.type != MLVFS_FILE_DNG && resolved.type != MLVFS_FILE_EXR))
     {
-        int frame_number = get_mlv_frame_number(path);
-        struct frame_headers frame_headers;
-        int is_exr = string_ends_with(path, ".exr");
-        if(mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers))
-        {
-            FILE **chunk_files = NULL;
-            uint32_t chunk_count = 0;
-            
-            chunk_files = mlvfs_load_chunks(mlv_filename, &chunk_count);
-            if(!chunk_files || !chunk_count)
-            {
-                free(mlv_filename);
-                return 0;
-            }
-            
-            image_buffer->size = dng_get_image_size(&frame_headers);
-            image_buffer->header_size = dng_get_header_size();
-            image_buffer->header = (uint8_t*)malloc(image_buffer->header_size + image_buffer->size);
-            image_buffer->data = (uint16_t*)(image_buffer->header + image_buffer->header_size);
-            image_buffer->free_flag = 0;
-            
-            uint8_t* mlv_basename = copy_string(image_buffer->dng_filename);
-            if(mlv_basename != NULL)
-            {
-                char * dir = find_last_separator(mlv_basename);
-                if(dir != NULL) *dir = 0;
-            }
+        return 0;
+    }
 
-            if (mlvfs.white_balance != 0){
-                if (mlvfs.white_balance > 9500) mlvfs.white_balance = 9500;
-                if (mlvfs.white_balance < 100) mlvfs.white_balance = 100;
-                if (string_ends_with(path, ".exr") && mlvfs.white_balance > 0){
-                    frame_headers.wbal_hdr.wb_mode = WB_KELVIN;
-                    frame_headers.wbal_hdr.kelvin  = mlvfs.white_balance;
-                }
-            }
-            
-            get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_buffer->data, 0, image_buffer->size);
-            if(mlvfs.deflicker) deflicker(&frame_headers, mlvfs.deflicker, image_buffer->data, image_buffer->size);
-            dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, mlvfs.fps, mlv_basename, mlvfs.compress_dng && !is_exr);
-            
-            if(mlvfs.fix_pattern_noise)
-            {
-                fix_pattern_noise((int16_t*)image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, frame_headers.rawi_hdr.raw_info.white_level, 0);
-            }
-            
-            int is_dual_iso = 0;
-            if(mlvfs.dual_iso == 1)
-            {
-                is_dual_iso = hdr_convert_data(&frame_headers, image_buffer->data, 0, image_buffer->size);
-            }
-            else if(mlvfs.dual_iso == 2)
-            {
-                is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, mlvfs.hdr_interpolation_method, !mlvfs.hdr_no_fullres, !mlvfs.hdr_no_alias_map, mlvfs.chroma_smooth, mlvfs.fix_bad_pixels);
-            }
-            
-            if(is_dual_iso)
+    const char * mlv_filename = resolved.mlv_file;
+    struct frame_headers frame_headers;
+    int is_exr = resolved.type == MLVFS_FILE_EXR;
+    if(!mlv_get_frame_headers(mlv_filename, resolved.frame_number, &frame_headers))
+    {
+        return 0;
+    }
+
+    image_buffer->size = dng_get_image_size(&frame_headers);
+    image_buffer->header_size = dng_get_header_size();
+    image_buffer->header = (uint8_t*)bufpool_alloc(image_buffer->header_size + image_buffer->size);
+    if(!image_buffer->header)
+    {
+        err_printf("malloc error (requested size %zu)\n", image_buffer->header_size + image_buffer->size);
+        return 0;
+    }
+    image_buffer->data = (uint16_t*)(image_buffer->header + image_buffer->header_size);
+    image_buffer->free_flag = 0;
+    
+    uint8_t* mlv_basename = copy_string(image_buffer->dng_filename);
+    if(mlv_basename != NULL)
+    {
+        char * dir = find_last_separator(mlv_basename);
+        if(dir != NULL) *dir = 0;
+    }
+
+    if (mlvfs.white_balance != 0){
+        if (mlvfs.white_balance > 9500) mlvfs.white_balance = 9500;
+        if (mlvfs.white_balance < 100) mlvfs.white_balance = 100;
+        if (is_exr && mlvfs.white_balance > 0){
+            frame_headers.wbal_hdr.wb_mode = WB_KELVIN;
+            frame_headers.wbal_hdr.kelvin  = mlvfs.white_balance;
+        }
+    }
+    
+    //a frame that was decoded before (e.g. served as DNG, now as EXR, or with other settings) isn't read again
+    if(!mlvfs_get_raw_frame(mlv_filename, resolved.frame_number, frame_headers.fileNumber, frame_headers.position, image_buffer->data, image_buffer->size))
+    {
+        struct mlv_chunks * chunks = mlvfs_open_chunks(mlv_filename);
+        size_t read_size = chunks ? get_image_data(&frame_headers, chunks, (uint8_t*) image_buffer->data, 0, image_buffer->size) : 0;
+        if(chunks) mlvfs_release_chunks(chunks);
+        if(read_size != image_buffer->size)
+        {
+            //e.g. a truncated MLV, don't render (and cache) whatever was in the buffer
+            err_printf("%s: could not read frame %d\n", mlv_filename, resolved.frame_number);
+            bufpool_free(image_buffer->header);
+            image_buffer->header = NULL;
+            image_buffer->data = NULL;
+            free(mlv_basename);
+            return 0;
+        }
+        //plain DNGs are streamed from the MLV, there is nothing to save on them
+        if(is_exr || dng_needs_processing())
+        {
+            mlvfs_put_raw_frame(mlv_filename, resolved.frame_number, frame_headers.fileNumber, frame_headers.position, image_buffer->data, image_buffer->size);
+        }
+    }
+    if(mlvfs.deflicker) deflicker(&frame_headers, mlvfs.deflicker, image_buffer->data, image_buffer->size);
+    dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, mlvfs.fps, mlv_basename, mlvfs.compress_dng && !is_exr);
+    
+    if(mlvfs.fix_pattern_noise)
+    {
+        fix_pattern_noise((int16_t*)image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, frame_headers.rawi_hdr.raw_info.white_level, 0);
+    }
+    
+    int is_dual_iso = 0;
+    if(mlvfs.dual_iso == 1)
+    {
+        is_dual_iso = hdr_convert_data(&frame_headers, image_buffer->data, 0, image_buffer->size);
+    }
+    else if(mlvfs.dual_iso == 2)
+    {
+        is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, mlvfs.hdr_interpolation_method, !mlvfs.hdr_no_fullres, !mlvfs.hdr_no_alias_map, mlvfs.chroma_smooth, mlvfs.fix_bad_pixels);
+    }
+    
+    if(mlvfs.dual_iso)
+    {
+        //headers of frames that aren't rendered yet assume the same (see make_dng_header)
+        mlvfs_set_dual_iso_calibration(mlv_filename, mlvfs.dual_iso, is_dual_iso);
+    }
+    
+    if(is_dual_iso)
+    {
+        //redo the dng header b/c white and black levels will be different
+        dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, mlvfs.fps, mlv_basename, mlvfs.compress_dng && !is_exr);
+    }
+    else
+    {
+        fix_focus_pixels(&frame_headers, image_buffer->data, 0);
+        if(mlvfs.fix_bad_pixels)
+        {
+            fix_bad_pixels(&frame_headers, image_buffer->data, mlvfs.fix_bad_pixels == 2, is_dual_iso);
+        }
+    }
+    
+    if(mlvfs.chroma_smooth && mlvfs.dual_iso != 2)
+    {
+        chroma_smooth(&frame_headers, image_buffer->data, mlvfs.chroma_smooth);
+    }
+    
+    if(mlvfs.fix_stripes)
+    {
+        struct stripes_correction * correction = stripes_get_correction(mlv_filename);
+        if(correction == NULL)
+        {
+            correction = stripes_new_correction(mlv_filename);
+            if(correction)
             {
-                //redo the dng header b/c white and black levels will be different
-                dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, mlvfs.fps, mlv_basename, mlvfs.compress_dng && !is_exr);
+                stripes_compute_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
             }
             else
             {
-                fix_focus_pixels(&frame_headers, image_buffer->data, 0);
-                if(mlvfs.fix_bad_pixels)
-                {
-                    fix_bad_pixels(&frame_headers, image_buffer->data, mlvfs.fix_bad_pixels == 2, is_dual_iso);
-                }
-            }
-            
-            if(mlvfs.chroma_smooth && mlvfs.dual_iso != 2)
-            {
-                chroma_smooth(&frame_headers, image_buffer->data, mlvfs.chroma_smooth);
-            }
-            
-            if(mlvfs.fix_stripes)
-            {
-                struct stripes_correction * correction = stripes_get_correction(mlv_filename);
-                if(correction == NULL)
-                {
-                    correction = stripes_new_correction(mlv_filename);
-                    if(correction)
-                    {
-                        stripes_compute_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
-                    }
-                    else
-                    {
-                        int err = errno;
-                        err_printf("malloc error: %s\n", strerror(err));
-                    }
-                }
-                stripes_apply_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
+                int err = errno;
+                err_printf("malloc error: %s\n", strerror(err));
             }
-            mlvfs_close_chunks(chunk_files, chunk_count);
-            free(mlv_basename);
         }
+        stripes_apply_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
+    }
+    free(mlv_basename);
 
-        if ( string_ends_with(path, ".exr") )
+    if (is_exr)
+    {
+        process_aces(&frame_headers, image_buffer, mlv_filename, &mlvfs);
+    } else if (mlvfs.compress_dng){
+        uint8_t *encoded = NULL;
+        int encoded_size;
+        lj92_encode(image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, 16, image_buffer->size, 0, NULL, 0, &encoded, &encoded_size);
+        //the frame goes back to the pool, only the header is kept
+        uint8_t * header = encoded ? bufpool_alloc(image_buffer->header_size) : NULL;
+        if(!header)
         {
-            process_aces(&frame_headers, image_buffer, mlv_filename, &mlvfs);
-        } else if (mlvfs.compress_dng){
-            uint8_t *encoded = NULL;
-            int encoded_size;
-            lj92_encode(image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, 16, image_buffer->size, 0, NULL, 0, &encoded, &encoded_size);
-            image_buffer->header = realloc(image_buffer->header, image_buffer->header_size);
-            image_buffer->data = (uint16_t*)encoded;
-            image_buffer->size = encoded_size;
-            image_buffer->free_flag = 1;
+            err_printf("%s: could not compress frame %d\n", mlv_filename, resolved.frame_number);
+            free(encoded);
+            bufpool_free(image_buffer->header);
+            image_buffer->header = NULL;
+            image_buffer->data = NULL;
+            return 0;
         }
+        memcpy(header, image_buffer->header, image_buffer->header_size);
+        bufpool_free(image_buffer->header);
+        image_buffer->header = header;
+        image_buffer->data = (uint16_t*)encoded;
+        image_buffer->size = encoded_size;
+        image_buffer->free_flag = 1;
+    }
+
+    return 1;
+}
 
-        free(mlv_filename);
-        free(path_in_mlv);
+/**
+ * Makes just the DNG header of a frame, for reads that don't touch the image data
+ * @return 1 if successful, 0 if the header depends on the image data (the frame has to be rendered)
+ */
+static int make_dng_header(const char * path, uint8_t * header, size_t size)
+{
+    struct mlvfs_path resolved;
+    struct frame_headers frame_headers;
+
+    /* deflicker sets the exposure from the image data */
+    if(mlvfs.deflicker) return 0;
+    if(!mlvfs_resolve_path(path, &resolved) || resolved.type != MLVFS_FILE_DNG) return 0;
+    if(!mlv_get_frame_headers(resolved.mlv_file, resolved.frame_number, &frame_headers)) return 0;
+
+    if(mlvfs.dual_iso)
+    {
+        /* dual ISO conversion changes the levels, go with what the rendered frames of this clip turned out to be */
+        int is_dual_iso = mlvfs_get_dual_iso_calibration(resolved.mlv_file, mlvfs.dual_iso);
+        if(is_dual_iso < 0) return 0;
+        if(is_dual_iso)
+        {
+            frame_headers.rawi_hdr.raw_info.black_level *= 4;
+            frame_headers.rawi_hdr.raw_info.white_level *= 4;
+        }
     }
 
+    char * mlv_basename = copy_string(path);
+    if(mlv_basename != NULL)
+    {
+        char * dir = find_last_separator(mlv_basename);
+        if(dir != NULL) *dir = 0;
+    }
+    dng_get_header_data(&frame_headers, header, 0, size, mlvfs.fps, mlv_basename, mlvfs.compress_dng);
+    free(mlv_basename);
     return 1;
 }
 
+/* the options a DNG header depends on, headers made with other options are not used */
+static uint64_t dng_header_settings()
+{
+    return (uint64_t)(uint32_t)(mlvfs.fps * 1000) | ((uint64_t)(mlvfs.compress_dng != 0) << 32) | ((uint64_t)mlvfs.dual_iso << 33);
+}
+
+/**
+ * Serves a read of an uncompressed DNG that needs no processing without rendering the frame:
+ * the header comes from make_dng_header(), the requested pixels are unpacked right into buf
+ * @return the number of bytes read, or -1 if the frame has to be rendered
+ */
+static int stream_dng(const char * path, const struct mlvfs_path * resolved, char * buf, size_t size, off_t offset)
+{
+    if(dng_needs_processing()) return -1;
+
+    struct frame_headers frame_headers;
+    if(!mlv_get_frame_headers(resolved->mlv_file, resolved->frame_number, &frame_headers)) return -1;
+    if(frame_headers.file_hdr.videoClass & (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92)) return -1;
+    if(has_focus_pixels(&frame_headers)) return -1;
+
+    size_t header_size = dng_get_header_size();
+    size_t file_size = header_size + dng_get_image_size(&frame_headers);
+    size_t read_offset = (size_t)MAX(0, MIN(offset, (off_t)file_size));
+    size_t read_size = MIN(size, file_size - read_offset);
+    size_t done = 0;
+
+    if(read_offset < header_size)
+    {
+        int result = mlvfs_read_dng_header(path, dng_header_settings(), &make_dng_header, buf, read_offset, MIN(read_size, header_size - read_offset));
+        if(result < 0) return -1;
+        done = (size_t)result;
+    }
+
+    if(done < read_size)
+    {
+        struct mlv_chunks * chunks = mlvfs_open_chunks(resolved->mlv_file);
+        if(!chunks) return -1;
+
+        /* the unpacker works on whole pixels, go through a small buffer if the range isn't aligned to them */
+        size_t image_offset = read_offset + done - header_size;
+        size_t image_size = read_size - done;
+        int complete = 0;
+        if(!(image_offset & 1) && !(image_size & 1))
+        {
+            complete = get_image_data(&frame_headers, chunks, (uint8_t*)buf + done, image_offset, image_size) == image_size;
+        }
+        else
+        {
+            size_t aligned_offset = image_offset & ~(size_t)1;
+            size_t aligned_size = ((image_offset + image_size + 1) & ~(size_t)1) - aligned_offset;
+            uint8_t * pixels = malloc(aligned_size);
+            if(!pixels)
+            {
+                mlvfs_release_chunks(chunks);
+                return -1;
+            }
+            complete = get_image_data(&frame_headers, chunks, pixels, aligned_offset, aligned_size) == aligned_size;
+            memcpy(buf + done, pixels + (image_offset - aligned_offset), image_size);
+            free(pixels);
+        }
+        mlvfs_release_chunks(chunks);
+
+        //e.g. a truncated MLV, leave it to the render path like any other frame it can't stream
+        if(!complete) return -1;
+    }
+
+    return (int)read_size;
+}
+
 int create_preview(struct image_buffer * image_buffer)
 {
-    char * mlv_filename = NULL;
-    char * path_in_mlv = NULL;
+    struct mlvfs_path resolved;
     const char * path = image_buffer->dng_filename;
     
-    if(string_ends_with(path, ".gif") && mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    if(mlvfs_resolve_path(path, &resolved) && resolved.type == MLVFS_FILE_GIF)
     {
         struct frame_headers frame_headers;
-        if(mlv_get_frame_headers(mlv_filename, 0, &frame_headers))
+        if(mlv_get_frame_headers(resolved.mlv_file, 0, &frame_headers))
         {
             image_buffer->size = gif_get_size(&frame_headers);
             image_buffer->data = (uint16_t*)malloc(image_buffer->size);
             image_buffer->header_size = 0;
             image_buffer->header = NULL;
-            gif_get_data(mlv_filename, (uint8_t*)image_buffer->data, 0, image_buffer->size);
+            image_buffer->free_flag = 1;
+            gif_get_data(resolved.mlv_file, (uint8_t*)image_buffer->data, 0, image_buffer->size);
         }
-        free(mlv_filename);
-        free(path_in_mlv);
     }
     return 1;
 }
@@ -1032,54 +1215,11 @@ int create_preview(struct image_buffer * image_buffer)
  */
 static char *mlvfs_resolve_virtual(const char *path)
 {
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
-    char *resolved_filename = NULL;
-    
-    /* is this within a virtual directory? */
-    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
-    {
-        int is_in_mlv_root = (find_first_separator(path_in_mlv) == NULL);
-        
-        if ( is_in_mlv_root && !strstr(path,"/._") &&
-            ( string_ends_with(path_in_mlv, ".exr") || string_ends_with(path_in_mlv, ".dng" ) ||
-              string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif" ) ||
-              string_ends_with(path_in_mlv, ".log") ) )
-        {
-            /* a DNG etc in the MLV root -> virtual */
-            resolved_filename = NULL;
-        }
-        else if (strlen(path_in_mlv) == 0)
-        {
-            /* it is the MLV itself */
-            resolved_filename = copy_string(mlv_filename);
-        }
-        else
-        {
-            char *mld_name = copy_string(mlv_filename);
-            char *dot = strrchr(mld_name, '.');
-            
-            if (dot)
-            {
-                strcpy(dot, ".MLD");
-            }
-            
-            resolved_filename = path_append(mld_name, path_slashfix(path_in_mlv));
-            
-            free(mld_name);
-        }
-        free(mlv_filename);
-        free(path_in_mlv);
-    }
-    else
-    {
-        /* this file is not within a virtual directory, so just get it from the existing one */
-        char *tmp_path = path_slashfix(copy_string(path));
-        resolved_filename = path_append((const char*)mlvfs.mlv_path, (const char*)tmp_path);
-        free(tmp_path);
-    }
-    
-    return resolved_filename;
+    struct mlvfs_path resolved;
+    char real_path[MLVFS_PATH_MAX];
+    int in_mlv = mlvfs_resolve_path(path, &resolved);
+
+    return mlvfs_get_real_path(path, &resolved, in_mlv, real_path) ? copy_string(real_path) : NULL;
 }
 
 static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
@@ -1087,14 +1227,12 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
     memset(stbuf, 0, sizeof(struct FUSE_STAT));
 
     int result = -ENOENT;
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
-    char *resolved_filename = NULL;
+    struct mlvfs_path resolved;
+    char resolved_filename[MLVFS_PATH_MAX];
+    int in_mlv = mlvfs_resolve_path(path, &resolved);
 
     /* try to find the real file on disk */
-    resolved_filename = mlvfs_resolve_virtual(path);
-
-    if (resolved_filename)
+    if (mlvfs_get_real_path(path, &resolved, in_mlv, resolved_filename))
     {
         /* now try to get the file stat */
         struct STAT64 file_stat;
@@ -1146,96 +1284,49 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
             stbuf->st_mtim = file_stat.st_mtim;
 #endif
         }
-        free(resolved_filename);
 
         return (stat_code == 0) ? 0 : -ENOENT;
     }
 
-    /* so this must be a virtual file, fetch MLV name and path */
-    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    /* so this must be a virtual file, if it's a file in root, all accesses to DNG, WAV, GIF and LOG are redirected */
+    if (in_mlv && resolved.type != MLVFS_FILE_OTHER)
     {
-        if (string_ends_with(path_in_mlv, ".exr") || string_ends_with(path_in_mlv, ".dng") || string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif") || string_ends_with(path_in_mlv, ".log"))
-        {
-            /* if it's a file in root, all accesses to DNG, WAV, GIF and LOG are redirected */
-            struct FUSE_STAT * dng_st = NULL;
+        const char *mlv_filename = resolved.mlv_file;
+        int is_frame = resolved.type == MLVFS_FILE_DNG || resolved.type == MLVFS_FILE_EXR;
 
-            if (string_ends_with(path_in_mlv, ".dng") && (dng_st = lookup_dng_attr(mlv_filename)) != NULL)
+        /* the other files carry the attributes of the first frame */
+        if (mlvfs_get_frame_stat(mlv_filename, resolved.frame_number, resolved.type == MLVFS_FILE_EXR, stbuf))
+        {
+            if (is_frame)
             {
-                memcpy(stbuf, dng_st, sizeof(struct FUSE_STAT));
-                result = 0;
+                result = 0; // DNG frame found
             }
-            else
+            else if (resolved.type == MLVFS_FILE_GIF)
             {
-                int frame_number = string_ends_with(path_in_mlv, ".dng") ? get_mlv_frame_number(path_in_mlv) : 0;
-
-#ifdef ALLOW_WRITEABLE_DNGS
-                stbuf->st_mode = S_IFREG | 0666;
-#else
-                stbuf->st_mode = S_IFREG | 0444;
-#endif
-                stbuf->st_nlink = 1;
-
                 struct frame_headers frame_headers;
-                if (mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers))
+                if (mlv_get_frame_headers(mlv_filename, 0, &frame_headers))
                 {
-                    struct tm tm_str;
-                    tm_str.tm_sec = (int)(frame_headers.rtci_hdr.tm_sec + (frame_headers.vidf_hdr.timestamp - frame_headers.rtci_hdr.timestamp) / 1000000);
-                    tm_str.tm_min = frame_headers.rtci_hdr.tm_min;
-                    tm_str.tm_hour = frame_headers.rtci_hdr.tm_hour;
-                    tm_str.tm_mday = frame_headers.rtci_hdr.tm_mday;
-                    tm_str.tm_mon = frame_headers.rtci_hdr.tm_mon;
-                    tm_str.tm_year = frame_headers.rtci_hdr.tm_year;
-                    tm_str.tm_isdst = frame_headers.rtci_hdr.tm_isdst;
-
-                    struct timespec timespec_str;
-                    timespec_str.tv_sec = mktime(&tm_str);
-                    timespec_str.tv_nsec = ((frame_headers.vidf_hdr.timestamp - frame_headers.rtci_hdr.timestamp) % 1000000) * 1000;
-
-                    // OS-specific timestamps
-#if __DARWIN_UNIX03
-                    memcpy(&stbuf->st_atimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_birthtimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_ctimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_mtimespec, &timespec_str, sizeof(struct timespec));
-#else
-                    memcpy(&stbuf->st_atim, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_ctim, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_mtim, &timespec_str, sizeof(struct timespec));
-#endif
-
-                    if (string_ends_with(path_in_mlv, ".dng"))
-                    {
-                        stbuf->st_size = dng_get_size(&frame_headers);
-                        register_dng_attr(mlv_filename, stbuf);
-                    }
-                    else if (string_ends_with(path_in_mlv, ".exr"))
-                    {
-                        stbuf->st_size = exr_get_size(&frame_headers, mlv_filename);
-                        register_dng_attr(mlv_filename, stbuf);
-                    }
-                    else if (string_ends_with(path_in_mlv, ".gif"))
-                    {
-                        stbuf->st_size = gif_get_size(&frame_headers);
-                    }
-                    else if (string_ends_with(path_in_mlv, ".log"))
-                    {
-                        char * log = mlv_read_debug_log(mlv_filename);
-                        if (log)
-                        {
-                            stbuf->st_size = strlen(log);
-                            free(log);
-                        }
-                    }
-                    else
-                    {
-                        stbuf->st_size = wav_get_size(mlv_filename);
-                    }
-                    result = 0; // DNG frame found
+                    stbuf->st_size = gif_get_size(&frame_headers);
+                    result = 0;
+                }
+            }
+            else if (resolved.type == MLVFS_FILE_LOG)
+            {
+                stbuf->st_size = 0;
+                char * log = mlv_read_debug_log(mlv_filename);
+                if (log)
+                {
+                    stbuf->st_size = strlen(log);
+                    free(log);
                 }
+                result = 0;
+            }
+            else
+            {
+                stbuf->st_size = wav_get_size(mlv_filename);
+                result = 0;
             }
         }
-        free(mlv_filename);
-        free(path_in_mlv);
     }
 
     return result;
@@ -1245,7 +1336,7 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
 {
     int result = 0;
 
-    /* reset the cached image buffer, if any */
+    /* virtual files have no handle */
     fi->fh = 0;
 
     /* try to find the real file on disk */
@@ -1253,7 +1344,11 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
 
     if (resolved_filename)
     {
+#ifdef _WIN32
         int fd = open(resolved_filename, O_RDONLY | O_BINARY);
+#else
+        int fd = open(resolved_filename, (fi->flags & O_ACCMODE) | O_BINARY);
+#endif
         free(resolved_filename);
 
         if (fd < 0)
@@ -1261,8 +1356,13 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
             return -errno;
         }
 
+#ifdef _WIN32
         /* always close file after read/write operations. else deleting etc will fail on windows */
         close(fd);
+#else
+        /* reads and writes on this handle use it until release */
+        fi->fh = FH_FROM_FD(fd);
+#endif
 
         return 0;
     }
@@ -1278,8 +1378,7 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
 static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FUSE_OFF_T offset, struct fuse_file_info *fi)
 {
     char *real_path = NULL;
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
+    struct mlvfs_path resolved;
     int result = -ENOENT;
     int is_mld_dir = 0;
 
@@ -1289,10 +1388,12 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
     }
 
     /* first check if that directory can be resolved */
-    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    if (mlvfs_resolve_path(path, &resolved))
     {
+        const char *mlv_filename = resolved.mlv_file;
+
         /* it refers to a subdir (existing or not) */
-        if (strlen(path_in_mlv) > 0)
+        if (strlen(resolved.path_in_mlv) > 0)
         {
             real_path = mlvfs_resolve_virtual(path);
         }
@@ -1307,16 +1408,21 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
             if(get_mlv_basename(mlv_filename, &mlv_basename))
             {
                 char *filename = malloc(sizeof(char) * (strlen(mlv_basename) + 1024));
+                struct clip_info clip_info;
+                if (!mlvfs_get_clip_info(mlv_filename, &clip_info))
+                {
+                    memset(&clip_info, 0, sizeof(struct clip_info));
+                }
                 if (filename)
                 {
-                    if (has_audio(mlv_filename))
+                    if (clip_info.has_audio)
                     {
                         sprintf(filename, "%s.wav", mlv_basename);
                         filler(buf, filename, NULL, 0);
                     }
                     sprintf(filename, "%s.log", mlv_basename);
                     filler(buf, filename, NULL, 0);
-                    int frame_count = mlv_get_frame_count(mlv_filename);
+                    int frame_count = clip_info.frame_count;
                     for (int i = 0; i < frame_count; i++)
                     {
                         char* format = "dng";
@@ -1354,8 +1460,6 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
                 err_printf("could not get mlv basename\n");
             }
         }
-        free(mlv_filename);
-        free(path_in_mlv);
     }
     else
     {
@@ -1363,6 +1467,9 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
         char *tmp_path = path_slashfix(copy_string(path));
         real_path = path_append((const char*)mlvfs.mlv_path, (const char*)tmp_path);
         free(tmp_path);
+
+        /* the user is looking at this directory, so index its clips next */
+        if (real_path) preindex_prioritize(real_path);
     }
 
     if (real_path)
@@ -1391,6 +1498,15 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
 
                 if (mlvfs.name_scheme && get_mlv_basename(real_file_path, &mlv_basename))
                 {
+                    /* remember the generated name, so the resolver doesn't have to parse it */
+                    char virtual_path[MLVFS_PATH_MAX];
+                    const char *virtual_dir = path;
+                    while (is_dir_separator(*virtual_dir)) virtual_dir++;
+                    if (strlen(virtual_dir) + strlen(mlv_basename) + 2 <= MLVFS_PATH_MAX)
+                    {
+                        sprintf(virtual_path, "%s%s%s", virtual_dir, *virtual_dir ? "/" : "", mlv_basename);
+                        mlvfs_register_clip_path(virtual_path, strlen(virtual_path), mlvfs.name_scheme, real_file_path);
+                    }
                     filler(buf, mlv_basename, NULL, 0);
                     free(mlv_basename);
                 }
@@ -1419,82 +1535,87 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
 
 static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
 {
-    /* if we already had a read on that handle and it was a .dng, it's info will be cached */
-    if (fi->fh == 0)
+    struct mlvfs_path resolved;
+    char resolved_filename[MLVFS_PATH_MAX];
+
+    /* a real file that is open already */
+    if (fi->fh)
     {
-        /* files are always opened/closed before/after any file operation */
-        char *resolved_filename = mlvfs_resolve_virtual(path);
-        int fd = -1;
+        int res = (int)pread(FD_FROM_FH(fi->fh), buf, size, offset);
+        return res < 0 ? -errno : res;
+    }
 
-        if (resolved_filename)
-        {
-            fd = open(resolved_filename, O_RDONLY | O_BINARY);
-            free(resolved_filename);
+    /* without a handle, real files are opened/closed before/after the read */
+    int in_mlv = mlvfs_resolve_path(path, &resolved);
+    if (mlvfs_get_real_path(path, &resolved, in_mlv, resolved_filename))
+    {
+        int fd = open(resolved_filename, O_RDONLY | O_BINARY);
 
-            if (fd < 0)
-            {
-                return -errno;
-            }
+        if (fd < 0)
+        {
+            return -errno;
+        }
 
-            int res = (int)pread(fd, buf, size, offset);
-            if (res < 0)
-            {
-                res = -errno;
-            }
+        int res = (int)pread(fd, buf, size, offset);
+        if (res < 0)
+        {
+            res = -errno;
+        }
 
-            /* always close file after read/write operations. else deleting etc will fail on windows */
-            close(fd);
+        /* always close file after read/write operations. else deleting etc will fail on windows */
+        close(fd);
 
-            return res;
-        }
+        return res;
     }
 
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
-
-    /* if there is no handle, it must be a virtual file, or it is an already opened .dng */
-    if (fi->fh || mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    /* so it must be a virtual file */
+    if (in_mlv)
     {
-        if (fi->fh || (string_ends_with(path_in_mlv, ".dng")))
+        const char *mlv_filename = resolved.mlv_file;
+
+        if (resolved.type == MLVFS_FILE_DNG)
         {
             size_t header_size = dng_get_header_size();
             size_t remaining = 0;
             off_t image_offset = 0;
             int was_created = 0;
 
-            struct image_buffer * image_buffer = (struct image_buffer *)fi->fh;
-            
-            /* was the image buffer already cached? */
-            if (!image_buffer)
+            /* a read within the header, or of a frame that needs no processing, doesn't need the frame rendered (unless it already is) */
+            uint64_t settings = mlvfs_image_settings(path);
+            if (!has_image_buffer(path, settings))
             {
-                image_buffer = get_or_create_image_buffer(path, &process_frame, &was_created);
+                int result = stream_dng(path, &resolved, buf, size, offset);
+                if (result < 0 && offset + size <= header_size)
+                {
+                    result = mlvfs_read_dng_header(path, dng_header_settings(), &make_dng_header, buf, offset, size);
+                }
+                if (result >= 0)
+                {
+                    return result;
+                }
             }
 
+            prefetch_frame_requested(path, &resolved);
+            struct image_buffer * image_buffer = get_or_create_image_buffer(path, settings, &process_frame, &was_created);
+
             if (!image_buffer)
             {
                 err_printf("DNG image_buffer is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
                 return 0;
             }
             if (!image_buffer->header)
             {
                 err_printf("DNG image_buffer->header is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
+                release_image_buffer(image_buffer);
                 return 0;
             }
             if (!image_buffer->data)
             {
                 err_printf("DNG image_buffer->data is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
+                release_image_buffer(image_buffer);
                 return 0;
             }
 
-            /* cache the expensive locking/lookup for a potential next read */
-            fi->fh = (uint64_t)image_buffer;
-
             /* sanitize parameters to prevent errors by accesses beyond end */
             long file_size = image_buffer->header_size + image_buffer->size;
             long read_offset = MAX(0, MIN(offset, file_size));
@@ -1521,26 +1642,23 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
                 memcpy(image_output_buf, ((uint8_t*)image_buffer->data) + image_offset, MIN(read_size - remaining, image_buffer->size - image_offset));
             }
             
-            free(mlv_filename);
-            free(path_in_mlv);
+            release_image_buffer(image_buffer);
             return (int)read_size;
         }
-        else if (string_ends_with(path_in_mlv, ".exr"))
+        else if (resolved.type == MLVFS_FILE_EXR)
         {
             int was_created;
-            struct image_buffer * image_buffer = get_or_create_image_buffer(path, &process_frame, &was_created);
+            prefetch_frame_requested(path, &resolved);
+            struct image_buffer * image_buffer = get_or_create_image_buffer(path, mlvfs_image_settings(path), &process_frame, &was_created);
             if (!image_buffer)
             {
                 err_printf("EXR image_buffer is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
                 return 0;
             }
             if (!image_buffer->data)
             {
                 err_printf("EXR image_buffer->data is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
+                release_image_buffer(image_buffer);
                 return 0;
             }
 
@@ -1550,33 +1668,26 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
 
             memcpy(buf, ((uint8_t*)image_buffer->data) + read_offset, read_size);
             release_image_buffer(image_buffer);
-            free(mlv_filename);
-            free(path_in_mlv);
             return (int)read_size;
         }
-        else if (string_ends_with(path_in_mlv, ".wav"))
+        else if (resolved.type == MLVFS_FILE_WAV)
         {
             int result = (int)wav_get_data(mlv_filename, (uint8_t*)buf, offset, size);
-            free(mlv_filename);
-            free(path_in_mlv);
             return result;
         }
-        else if (string_ends_with(path_in_mlv, ".gif"))
+        else if (resolved.type == MLVFS_FILE_GIF)
         {
             int was_created;
-            struct image_buffer * image_buffer = get_or_create_image_buffer(path, &create_preview, &was_created);
+            struct image_buffer * image_buffer = get_or_create_image_buffer(path, 0, &create_preview, &was_created);
             if (!image_buffer)
             {
                 err_printf("GIF image_buffer is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
                 return 0;
             }
             if (!image_buffer->data)
             {
                 err_printf("GIF image_buffer->data is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
+                release_image_buffer(image_buffer);
                 return 0;
             }
 
@@ -1586,11 +1697,9 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
 
             memcpy(buf, ((uint8_t*)image_buffer->data) + read_offset, read_size);
             release_image_buffer(image_buffer);
-            free(mlv_filename);
-            free(path_in_mlv);
             return (int)read_size;
         }
-        else if (string_ends_with(path_in_mlv, ".log"))
+        else if (resolved.type == MLVFS_FILE_LOG)
         {
             char * log = mlv_read_debug_log(mlv_filename);
             size_t read_bytes = 0;
@@ -1604,12 +1713,8 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
                 }
                 free(log);
             }
-            free(mlv_filename);
-            free(path_in_mlv);
             return (int)read_bytes;
         }
-        free(mlv_filename);
-        free(path_in_mlv);
     }
     
     return -ENOENT;
@@ -1633,7 +1738,12 @@ static int mlvfs_create(const char *path, mode_t mode, struct fuse_file_info *fi
     mode &= (_S_IREAD | _S_IWRITE);
 #endif
 
+#ifdef _WIN32
     int fd = creat(resolved_filename, mode);
+#else
+    /* like creat(), but the handle may be read from too */
+    int fd = open(resolved_filename, O_CREAT | O_TRUNC | O_RDWR | O_BINARY, mode);
+#endif
     free(resolved_filename);
 
     if (fd < 0)
@@ -1641,15 +1751,23 @@ static int mlvfs_create(const char *path, mode_t mode, struct fuse_file_info *fi
         return -errno;
     }
 
+#ifdef _WIN32
     /* always close file after read/write operations. else deleting etc will fail on windows */
     close(fd);
+#else
+    fi->fh = FH_FROM_FD(fd);
+#endif
 
     return 0;
 }
 
 static int mlvfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-    /* we always close files on every read/write, no need to fsync */
+    /* without a handle the file was closed after every read/write, no need to fsync */
+    if (fi->fh && fsync(FD_FROM_FH(fi->fh)))
+    {
+        return -errno;
+    }
     return 0;
 }
 
@@ -1673,12 +1791,10 @@ static int mlvfs_mkdir(const char *path, mode_t mode)
 
 static int mlvfs_release(const char *path, struct fuse_file_info *fi)
 {
-    /* reset the cached image buffer pointer, if any */
-    fi->fh = 0;
-
-    if (string_ends_with(path, ".exr") ||string_ends_with(path, ".dng") || string_ends_with(path, ".gif"))
+    if (fi->fh)
     {
-        release_image_buffer_by_path(path);
+        close(FD_FROM_FH(fi->fh));
+        fi->fh = 0;
     }
     return 0;
 }
@@ -1754,7 +1870,13 @@ static int mlvfs_truncate(const char *path, FUSE_OFF_T offset)
 
 static int mlvfs_write(const char *path, const char *buf, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
 {
-    /* files are always opened/closed before/after any file operation */
+    if (fi->fh)
+    {
+        int res = (int)pwrite(FD_FROM_FH(fi->fh), buf, size, offset);
+        return res < 0 ? -errno : res;
+    }
+
+    /* without a handle, files are opened/closed before/after the write */
     char *resolved_filename = mlvfs_resolve_virtual(path);
     int fd = -1;
 
@@ -1791,6 +1913,53 @@ static int mlvfs_statfs(const char *path, struct statvfs *stat)
     return 0;
 }
 
+#if !defined(_WIN32) && FUSE_VERSION >= 29
+static void *mlvfs_init(struct fuse_conn_info *conn)
+{
+    /* let the kernel splice the files we hand out as descriptors */
+    conn->want |= (conn->capable & FUSE_CAP_SPLICE_WRITE);
+    return NULL;
+}
+
+/**
+ * reads of real files that are open are served from their descriptor, so FUSE can splice the
+ * data into the reply instead of copying it through our buffer. Virtual files are read as usual.
+ */
+static int mlvfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufvec = malloc(sizeof(struct fuse_bufvec));
+    if (!bufvec)
+    {
+        return -ENOMEM;
+    }
+
+    if (fi->fh)
+    {
+        *bufvec = FUSE_BUFVEC_INIT(size);
+        bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufvec->buf[0].fd = FD_FROM_FH(fi->fh);
+        bufvec->buf[0].pos = offset;
+        *bufp = bufvec;
+        return 0;
+    }
+
+    /* FUSE frees both */
+    char *buf = malloc(size);
+    int res = buf ? mlvfs_read(path, buf, size, offset, fi) : -ENOMEM;
+    if (res < 0)
+    {
+        free(buf);
+        free(bufvec);
+        return res;
+    }
+
+    *bufvec = FUSE_BUFVEC_INIT((size_t)res);
+    bufvec->buf[0].mem = buf;
+    *bufp = bufvec;
+    return 0;
+}
+#endif
+
 static int mlvfs_wrap_getattr(const char *path, struct FUSE_STAT *stbuf)
 {
     dbg_printf("'%s' 0x%08X\n", path, (uint32_t)stbuf);
@@ -1811,6 +1980,13 @@ static int mlvfs_wrap_read(const char *path, char *buf, size_t size, FUSE_OFF_T
     dbg_printf("'%s' 0x%08X 0x%08X 0x%08X 0x%08X\n", path, (uint32_t)buf, (uint32_t)size, (uint32_t)offset, (uint32_t)fi);
     TRY_WRAP(return mlvfs_read(path, buf, size, offset, fi); )
 }
+#if !defined(_WIN32) && FUSE_VERSION >= 29
+static int mlvfs_wrap_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
+{
+    dbg_printf("'%s' 0x%08X 0x%08X 0x%08X 0x%08X\n", path, (uint32_t)bufp, (uint32_t)size, (uint32_t)offset, (uint32_t)fi);
+    TRY_WRAP(return mlvfs_read_buf(path, bufp, size, offset, fi); )
+}
+#endif
 static int mlvfs_wrap_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     dbg_printf("'%s' 0x%08X 0x%08X\n", path, (uint32_t)mode, (uint32_t)fi);
@@ -1862,6 +2038,46 @@ static int mlvfs_wrap_unlink(const char *path)
     TRY_WRAP(return mlvfs_unlink(path); )
 }
 
+#ifndef _WIN32
+/**
+ * inode numbers for the low-level backend: the files in a clip get the hash of the clip's virtual path
+ * in the upper bits and the frame (or which other file it is) in the lower 24 bits, so they are the same
+ * on every lookup. Anything else gets the hash of its path with the top bit set.
+ * @param cacheable [out] 1 for clips and the files in them, they don't change while mounted
+ */
+static uint64_t mlvfs_path_ino(const char *path, int *cacheable)
+{
+    struct mlvfs_path resolved;
+    *cacheable = 0;
+
+    if (mlvfs_resolve_path(path, &resolved) && (*resolved.path_in_mlv == 0 || resolved.type != MLVFS_FILE_OTHER))
+    {
+        /* the clip is everything in front of the file name */
+        size_t clip_length = (size_t)(resolved.path_in_mlv - path);
+        while (clip_length > 0 && is_dir_separator(path[clip_length - 1]))
+        {
+            clip_length--;
+        }
+
+        uint64_t item = 0;
+        switch (resolved.type)
+        {
+            case MLVFS_FILE_DNG:
+            case MLVFS_FILE_EXR: item = 16 + (uint64_t)resolved.frame_number; break;
+            case MLVFS_FILE_WAV: item = 1; break;
+            case MLVFS_FILE_LOG: item = 2; break;
+            case MLVFS_FILE_GIF: item = 3; break;
+        }
+
+        *cacheable = 1;
+        /* bit 61 keeps them clear of 0 and the root inode, bit 62 is left to the inode table */
+        return (fnv1a_data(path, clip_length, FNV1A_SEED) & 0x1FFFFFFFFF000000ULL) | (1ULL << 61) | (item & 0xFFFFFF);
+    }
+
+    return (fnv1a(path, FNV1A_SEED) & 0x3FFFFFFFFFFFFFFFULL) | (1ULL << 63);
+}
+#endif
+
 static struct fuse_operations mlvfs_filesystem_operations =
 {
     .getattr     = mlvfs_wrap_getattr,
@@ -1877,7 +2093,11 @@ static struct fuse_operations mlvfs_filesystem_operations =
     .truncate    = mlvfs_wrap_truncate,
     .write       = mlvfs_wrap_write,
     .statfs      = mlvfs_wrap_statfs,
-    .unlink      = mlvfs_wrap_unlink
+    .unlink      = mlvfs_wrap_unlink,
+#if !defined(_WIN32) && FUSE_VERSION >= 29
+    .init        = mlvfs_init,
+    .read_buf    = mlvfs_wrap_read_buf,
+#endif
 };
 
 struct fuse_opt_ex
@@ -1896,7 +2116,21 @@ static const struct fuse_opt_ex mlvfs_opts_ex[] =
 "File/folder options"),
     MLVFS_OPTION("--mlv-dir=%s",        mlv_path,                 0, "Directory containing MLV files", 0),
     MLVFS_OPTION("--exr",               format_exr,               1, "Use RAWtoACES EXR images", 0),
-    MLVFS_OPTION("--resolve-naming",    name_scheme,              1, "File names compatible with DaVinci Resolve",
+    MLVFS_OPTION("--resolve-naming",    name_scheme,              1, "File names compatible with DaVinci Resolve", 0),
+    MLVFS_OPTION("--preindex",          preindex,                 2, "Index all MLV files in the background after mounting", 0),
+    MLVFS_OPTION("--preindex=%d",       preindex,                 0, "Same, with this many worker threads", 0),
+    MLVFS_OPTION("--prefetch=%d",       prefetch,                 0, "When frames are read in order, render up to this many of the next ones ahead", 0),
+    MLVFS_OPTION("--mmap",              use_mmap,                 1, "Read uncompressed frames from memory mapped MLV files", 0),
+    MLVFS_OPTION("--readahead",         readahead,                1, "When frames are read in order, have the kernel read the next ones from disk ahead", 0),
+    MLVFS_OPTION("--drop-behind",       drop_behind,              1, "Drop MLV data from the page cache once it was read (for large ingests)", 0),
+    MLVFS_OPTION("--direct-io",         direct_io,                1, "Read frames from the MLV files without going through the page cache", 0),
+    MLVFS_OPTION("--lowlevel",          lowlevel,                 1, "Use the FUSE low-level API (stable inode numbers, the kernel caches rendered frames)", 0),
+    MLVFS_OPTION("--cache-timeout=%d",  cache_timeout,            0, "With --lowlevel: how long the kernel may cache the files in clips (seconds, default 60)", 0),
+    MLVFS_OPTION("--cache-size=%d",     cache_size,               0, "How much memory rendered frames may use (MB, default 256)", 0),
+    MLVFS_OPTION("--raw-cache-size=%d", raw_cache_size,           0, "How much memory decoded frames may use, to post process them again (MB, default 128)", 0),
+    MLVFS_OPTION("--buffer-pool=%d",    buffer_pool,              0, "How much memory freed frame buffers may keep for the next frames (MB, default 128, 0 to disable; the three add up to what MLVFS may hold on to)", 0),
+    MLVFS_OPTION("--huge-pages",        huge_pages,               1, "Back large frame buffers with huge pages (Linux)", 0),
+    MLVFS_OPTION("--max-open-files=%d", max_open_files,           0, "How many MLV chunk files to keep open (default 256)",
 "Processing options"),
     MLVFS_OPTION("--cs2x2",             chroma_smooth,            2, "2x2 chroma smoothing", 0),
     MLVFS_OPTION("--cs3x3",             chroma_smooth,            3, "3x3 chroma smoothing", 0),
@@ -1972,6 +2206,9 @@ int main(int argc, char **argv)
     mlvfs.highlight = 1;
     mlvfs.debayer = 1;
     mlvfs.compress_dng = 0;
+    mlvfs.max_open_files = DEFAULT_MAX_OPEN_FILES;
+    mlvfs.cache_timeout = DEFAULT_CACHE_TIMEOUT;
+    mlvfs.buffer_pool = DEFAULT_BUFFER_POOL_SIZE;
 
     mlvfs_args_init();
 
@@ -2039,9 +2276,26 @@ int main(int argc, char **argv)
 
         if(!res)
         {
+            mlvfs_set_max_open_files(mlvfs.max_open_files);
+            mlvfs_set_cache_size(mlvfs.cache_size);
+            mlvfs_set_raw_cache_size(mlvfs.raw_cache_size);
+            bufpool_configure((size_t)MAX(0, mlvfs.buffer_pool) * 1024 * 1024, mlvfs.huge_pages);
+            mlvfs_set_mmap_chunks(mlvfs.use_mmap);
+            mlvfs_set_io_policy((mlvfs.readahead ? MLVFS_IO_WILLNEED : 0) | (mlvfs.drop_behind ? MLVFS_IO_DONTNEED : 0) | (mlvfs.direct_io ? MLVFS_IO_DIRECT : 0));
             webgui_start(&mlvfs);
+            preindex_start(&mlvfs);
+            prefetch_start(&mlvfs, &process_frame);
             umask(0);
-            res = fuse_main(args.argc, args.argv, &mlvfs_filesystem_operations, NULL);
+#ifndef _WIN32
+            if (mlvfs.lowlevel)
+            {
+                res = lowlevel_main(&args, &mlvfs_filesystem_operations, &mlvfs_path_ino, mlvfs.cache_timeout);
+            }
+            else
+#endif
+            {
+                res = fuse_main(args.argc, args.argv, &mlvfs_filesystem_operations, NULL);
+            }
         }
 
         free(expanded_path);
@@ -2053,11 +2307,21 @@ int main(int argc, char **argv)
     }
 
     fuse_opt_free_args(&args);
+    preindex_stop();
+    prefetch_stop();
     webgui_stop();
     stripes_free_corrections();
     free_all_image_buffers();
+    free_all_raw_frames();
     close_all_chunks();
-    free_dng_attr_mappings();
+    free_all_clip_infos();
+    free_all_clip_paths();
+    free_all_stat_tables();
+    free_all_dng_headers();
+    free_all_dual_iso_calibrations();
+    free_all_frame_tables();
     free_focus_pixel_maps();
+    //last, the caches above hand their buffers back to the pool
+    bufpool_release_all();
     return res;
 }
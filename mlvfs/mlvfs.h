@@ -50,6 +50,19 @@ struct mlvfs
     int deflicker;
     int fix_pattern_noise;
     int compress_dng;
+    int preindex;
+    int prefetch;
+    int max_open_files;
+    int cache_size;
+    int raw_cache_size;
+    int buffer_pool;
+    int huge_pages;
+    int use_mmap;
+    int readahead;
+    int drop_behind;
+    int direct_io;
+    int lowlevel;
+    int cache_timeout;
     int version;
 };
 
@@ -79,11 +92,37 @@ struct frame_headers
 //You'll get an error if you actually try to write to them
 #define ALLOW_WRITEABLE_DNGS
 
+//longest real path the virtual path resolver handles
+#define MLVFS_PATH_MAX 4096
+
+enum mlvfs_file_type
+{
+    MLVFS_FILE_OTHER,
+    MLVFS_FILE_DNG,
+    MLVFS_FILE_EXR,
+    MLVFS_FILE_WAV,
+    MLVFS_FILE_GIF,
+    MLVFS_FILE_LOG
+};
+
+//a virtual path within a MLV, parsed once per request
+struct mlvfs_path
+{
+    char mlv_file[MLVFS_PATH_MAX];      /* the real MLV the path is in (or is) */
+    const char * path_in_mlv;           /* points into the virtual path, empty for the MLV itself */
+    int type;                           /* one of enum mlvfs_file_type, only set for the virtual files in the MLV root */
+    int frame_number;                   /* for DNG and EXR */
+};
+
+struct mlv_chunks;
+
 int string_ends_with(const char *source, const char *ending);
-FILE** mlvfs_load_chunks(const char * path, uint32_t * chunk_count);
+uint64_t mlvfs_image_settings(const char * path);
+uint64_t mlvfs_dng_settings(void);
+uint64_t mlvfs_exr_settings(void);
 int mlv_get_frame_headers(const char *path, int index, struct frame_headers * frame_headers);
 int mlv_get_frame_count(const char *real_path);
-size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t * output_buffer, off_t offset, size_t max_size);
+size_t get_image_data(struct frame_headers * frame_headers, struct mlv_chunks * chunks, uint8_t * output_buffer, off_t offset, size_t max_size);
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -99,6 +138,8 @@ int * get_ev2raw();
 
 #ifdef _WIN32
 #define filename_strcmp _stricmp
+#define filename_strncmp _strnicmp
+#define is_dir_separator(c) ((c) == '/' || (c) == '\\')
 #define DIR_SEP_CHAR '\\'
 #define DIR_SEP_STR "\\"
 #define find_last_separator(path) MAX(strrchr((path), '/'), strrchr((path), '\\'))
@@ -131,6 +172,8 @@ static void *find_first_separator(const char *path)
 #else
 #define O_BINARY 0
 #define filename_strcmp strcmp
+#define filename_strncmp strncmp
+#define is_dir_separator(c) ((c) == '/')
 #define DIR_SEP_CHAR '/'
 #define DIR_SEP_STR "/"
 #define find_last_separator(path) strrchr((path), '/')
@@ -29,6 +29,7 @@
 #include "mlv.h"
 #include "dng.h"
 #include "mlvfs.h"
+#include "bufpool.h"
 #include "opt_med.h"
 #include "wirth.h"
 #include "cs.h"
@@ -57,7 +58,7 @@ void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data,
     
     if(raw2ev == NULL) return;
     
-    uint16_t * buf = (uint16_t *)malloc(w*h*sizeof(uint16_t));
+    uint16_t * buf = (uint16_t *)bufpool_alloc(w*h*sizeof(uint16_t));
     if (!buf)
     {
         return;
@@ -80,7 +81,7 @@ void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data,
             break;
     }
     
-    free(buf);
+    bufpool_free(buf);
 }
 
 
@@ -439,6 +440,12 @@ static struct focus_pixel_map * get_focus_pixel_map(struct frame_headers * frame
     return load_focus_pixel_map(camera_id, rawi_width, rawi_height);
 }
 
+//whether fix_focus_pixels() would change anything for frames of this camera and resolution
+int has_focus_pixels(struct frame_headers * frame_headers)
+{
+    return get_focus_pixel_map(frame_headers) != NULL;
+}
+
 void fix_focus_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int dual_iso)
 {
     struct focus_pixel_map * map = get_focus_pixel_map(frame_headers);
@@ -31,6 +31,7 @@
 #include "opt_med.h"
 #include "wirth.h"
 #include "cs.h"
+#include "bufpool.h"
 #include <pthread.h>
 
 #define LOCK(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER; pthread_mutex_lock(&x);
@@ -827,7 +828,7 @@ static inline uint32_t * convert_to_20bit(struct raw_info raw_info, uint16_t * i
     int w = raw_info.width;
     int h = raw_info.height;
     /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-    uint32_t * raw_buffer_32 = malloc(w * h * sizeof(raw_buffer_32[0]));
+    uint32_t * raw_buffer_32 = bufpool_alloc(w * h * sizeof(raw_buffer_32[0]));
     
     for (int y = 0; y < h; y ++)
         for (int x = 0; x < w; x ++)
@@ -1389,7 +1390,7 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
     double * fullres_curve = build_fullres_curve(black);
     printf("Building alias map...\n");
     
-    uint16_t* alias_aux = malloc(w * h * sizeof(uint16_t));
+    uint16_t* alias_aux = bufpool_alloc(w * h * sizeof(uint16_t));
     
     /* build the aliasing maps (where it's likely to get aliasing) */
     /* do this by comparing fullres and halfres images */
@@ -1482,7 +1483,7 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
         }
     }
     
-    free(alias_aux);
+    bufpool_free(alias_aux);
 }
 
 #define CHROMA_SMOOTH_TYPE uint32_t
@@ -1633,7 +1634,7 @@ static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32
     }
     
     /* "blur" the overexposed map */
-    uint16_t* over_aux = malloc(w * h * sizeof(uint16_t));
+    uint16_t* over_aux = bufpool_alloc(w * h * sizeof(uint16_t));
     memcpy(over_aux, overexposed, w * h * sizeof(uint16_t));
     
     for (int y = 3; y < h-3; y ++)
@@ -1654,7 +1655,7 @@ static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32
         }
     }
     
-    free(over_aux); over_aux = 0;
+    bufpool_free(over_aux); over_aux = 0;
     free(mix_curve);
     
     return 1;
@@ -1823,18 +1824,18 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     bright_noise_ev += 6;
     
     /* dark and bright exposures, interpolated */
-    uint32_t* dark   = malloc(w * h * sizeof(uint32_t));
-    uint32_t* bright = malloc(w * h * sizeof(uint32_t));
+    uint32_t* dark   = bufpool_alloc(w * h * sizeof(uint32_t));
+    uint32_t* bright = bufpool_alloc(w * h * sizeof(uint32_t));
     memset(dark, 0, w * h * sizeof(uint32_t));
     memset(bright, 0, w * h * sizeof(uint32_t));
     
     /* fullres image (minimizes aliasing) */
-    uint32_t* fullres = malloc(w * h * sizeof(uint32_t));
+    uint32_t* fullres = bufpool_alloc(w * h * sizeof(uint32_t));
     memset(fullres, 0, w * h * sizeof(uint32_t));
     uint32_t* fullres_smooth = fullres;
     
     /* halfres image (minimizes noise and banding) */
-    uint32_t* halfres = malloc(w * h * sizeof(uint32_t));
+    uint32_t* halfres = bufpool_alloc(w * h * sizeof(uint32_t));
     memset(halfres, 0, w * h * sizeof(uint32_t));
     uint32_t* halfres_smooth = halfres;
     
@@ -1842,19 +1843,19 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     {
         if (use_fullres)
         {
-            fullres_smooth = malloc(w * h * sizeof(uint32_t));
+            fullres_smooth = bufpool_alloc(w * h * sizeof(uint32_t));
         }
-        halfres_smooth = malloc(w * h * sizeof(uint32_t));
+        halfres_smooth = bufpool_alloc(w * h * sizeof(uint32_t));
     }
     
     /* overexposure map */
-    uint16_t * overexposed = malloc(w * h * sizeof(uint16_t));
+    uint16_t * overexposed = bufpool_alloc(w * h * sizeof(uint16_t));
     memset(overexposed, 0, w * h * sizeof(uint16_t));
     
     uint16_t* alias_map = NULL;
     if(use_alias_map)
     {
-        alias_map = malloc(w * h * sizeof(uint16_t));
+        alias_map = bufpool_alloc(w * h * sizeof(uint16_t));
         memset(alias_map, 0, w * h * sizeof(uint16_t));
     }
     
@@ -1918,14 +1919,15 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         h++;
     }
     
-    free(dark);
-    free(bright);
-    free(fullres);
-    free(halfres);
-    free(overexposed);
-    free(raw_buffer_32);
-    if (fullres_smooth && fullres_smooth != fullres) free(fullres_smooth);
-    if (halfres_smooth && halfres_smooth != halfres) free(halfres_smooth);
+    bufpool_free(dark);
+    bufpool_free(bright);
+    bufpool_free(fullres);
+    bufpool_free(halfres);
+    bufpool_free(overexposed);
+    bufpool_free(alias_map);
+    bufpool_free(raw_buffer_32);
+    if (fullres_smooth && fullres_smooth != fullres) bufpool_free(fullres_smooth);
+    if (halfres_smooth && halfres_smooth != halfres) bufpool_free(halfres_smooth);
     return ret;
 }
 
@@ -25,6 +25,7 @@
 #include "wirth.h"
 #include "math.h"
 #include "patternnoise.h"
+#include "bufpool.h"
 
 static int g_debug_flags;
 #ifndef WIN32
@@ -104,9 +105,9 @@ static void horizontal_edge_aware_blur_rggb(
     strength /= 2;
     
     /* precompute average green, red-green and blue-green */
-    int16_t * avg_g  = malloc(w * h * sizeof(avg_g[0]));
-    int16_t * dif_rg = malloc(w * h * sizeof(dif_rg[0]));
-    int16_t * dif_bg = malloc(w * h * sizeof(dif_bg[0]));
+    int16_t * avg_g  = bufpool_alloc(w * h * sizeof(avg_g[0]));
+    int16_t * dif_rg = bufpool_alloc(w * h * sizeof(dif_rg[0]));
+    int16_t * dif_bg = bufpool_alloc(w * h * sizeof(dif_bg[0]));
     average(in_g1, in_g2, avg_g, w, h);
     subtract(in_r, avg_g, dif_rg, w, h);
     subtract(in_b, avg_g, dif_bg, w, h);
@@ -174,9 +175,9 @@ static void horizontal_edge_aware_blur_rggb(
         }
     }
     
-    free(avg_g);
-    free(dif_rg);
-    free(dif_bg);
+    bufpool_free(avg_g);
+    bufpool_free(dif_rg);
+    bufpool_free(dif_bg);
 }
 
 /* Find and apply a scalar offset to each column, to reduce pattern noise */
@@ -185,17 +186,17 @@ static void horizontal_edge_aware_blur_rggb(
 static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int white)
 {
     /* let's say the difference between original and denoised is mostly noise */
-    int16_t * noise = malloc(w * h * sizeof(noise[0]));
+    int16_t * noise = bufpool_alloc(w * h * sizeof(noise[0]));
     subtract(original, denoised, noise, w, h);
     
     /* from this noise, keep the FPN part (constant offset for each line/column) */
-    int* col_offsets = malloc(w * sizeof(col_offsets[0]));
-    int* noise_row = malloc(MAX(w,h) * sizeof(noise_row[0]));
+    int* col_offsets = bufpool_alloc(w * sizeof(col_offsets[0]));
+    int* noise_row = bufpool_alloc(MAX(w,h) * sizeof(noise_row[0]));
     int  noise_row_num = 0;
     
     /* certain areas will give false readings, mask them out */
-    int16_t * mask  = malloc(w * h * sizeof(mask[0]));
-    int16_t * hgrad = malloc(w * h * sizeof(mask[0]));
+    int16_t * mask  = bufpool_alloc(w * h * sizeof(mask[0]));
+    int16_t * hgrad = bufpool_alloc(w * h * sizeof(mask[0]));
     
     horizontal_gradient(original, hgrad, w, h);
     
@@ -274,11 +275,11 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
     }
     
 end:
-    free(noise);
-    free(col_offsets);
-    free(noise_row);
-    free(mask);
-    free(hgrad);
+    bufpool_free(noise);
+    bufpool_free(col_offsets);
+    bufpool_free(noise_row);
+    bufpool_free(mask);
+    bufpool_free(hgrad);
 }
 
 /* extract a color channel from a Bayer image */
@@ -312,14 +313,14 @@ static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int d
 static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
 {
     /* assume Bayer order [RGGB] */
-    int16_t * r        = malloc(w/2 * h/2 * sizeof(r[0]));   /* red channel (bottom left) */
-    int16_t * g1       = malloc(w/2 * h/2 * sizeof(r[0]));   /* top-left green */
-    int16_t * g2       = malloc(w/2 * h/2 * sizeof(r[0]));   /* bottom-right green */
-    int16_t * b        = malloc(w/2 * h/2 * sizeof(r[0]));   /* blue channel (top right) */
-    int16_t * rs       = malloc(w/2 * h/2 * sizeof(r[0]));   /* r  after smoothing */
-    int16_t * g1s      = malloc(w/2 * h/2 * sizeof(r[0]));   /* g1 after smoothing */
-    int16_t * g2s      = malloc(w/2 * h/2 * sizeof(r[0]));   /* g2 after smoothing */
-    int16_t * bs       = malloc(w/2 * h/2 * sizeof(r[0]));   /* b  after smoothing */
+    int16_t * r        = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* red channel (bottom left) */
+    int16_t * g1       = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* top-left green */
+    int16_t * g2       = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* bottom-right green */
+    int16_t * b        = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* blue channel (top right) */
+    int16_t * rs       = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* r  after smoothing */
+    int16_t * g1s      = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* g1 after smoothing */
+    int16_t * g2s      = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* g2 after smoothing */
+    int16_t * bs       = bufpool_alloc(w/2 * h/2 * sizeof(r[0]));   /* b  after smoothing */
     
     /* extract half-res color channels from Bayer data */
     extract_channel(raw, r,  w, h, 0, 0);
@@ -344,14 +345,14 @@ static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
     set_channel(raw, b,  w, h, 1, 1);
     
     /* cleanup */
-    free(r);
-    free(g1);
-    free(g2);
-    free(b);
-    free(rs);
-    free(g1s);
-    free(g2s);
-    free(bs);
+    bufpool_free(r);
+    bufpool_free(g1);
+    bufpool_free(g2);
+    bufpool_free(b);
+    bufpool_free(rs);
+    bufpool_free(g1s);
+    bufpool_free(g2s);
+    bufpool_free(bs);
 }
 
 void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags)
@@ -371,10 +372,10 @@ void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags)
     if (!g_debug_flags || (g_debug_flags & FIXPN_DBG_ROWNOISE))
     {
         /* transpose, process just like before, then transpose back */
-        int16_t * raw_t = malloc(w * h * sizeof(raw[0]));
+        int16_t * raw_t = bufpool_alloc(w * h * sizeof(raw[0]));
         transpose(raw, raw_t, w, h);
         fix_column_noise_rggb(raw_t, h, w, white);
         transpose(raw_t, raw, h, w);
-        free(raw_t);
+        bufpool_free(raw_t);
     }
 }
\ No newline at end of file
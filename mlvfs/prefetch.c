@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "prefetch.h"
+#include "async_io.h"
+
+/*
+ * Renders the frames after the one a program is reading, while it is still busy with the
+ * current one. Every clip gets a tracker that watches which frames are requested; once a few
+ * requests in a row went forward (or backward) one frame at a time, the next frames in that
+ * direction are queued for the worker threads, which render them into the image_buffer cache.
+ * How far ahead we go depends on how long a frame takes to render compared to how quickly the
+ * reader asks for the next one, up to --prefetch=%d frames.
+ * With --readahead, the kernel is also told to read the source data of those frames (or of the
+ * next READAHEAD_DEPTH frames when nothing is rendered ahead), so it is in the page cache by the
+ * time a worker or the reader gets to it.
+ */
+
+//how many sequential requests in a row before we start prefetching
+#define PREFETCH_MIN_RUN 2
+
+struct access_pattern
+{
+    struct access_pattern * next;
+    char * mlv_path;
+    int last_frame;
+    int direction;              /* 1 forward, -1 backward, 0 not sequential */
+    int run_length;             /* sequential requests in a row */
+    double last_request;
+    double request_interval;    /* moving average of the time between two sequential requests */
+    double render_time;         /* moving average of the time a worker needs for one frame */
+};
+
+struct prefetch_job
+{
+    struct prefetch_job * next;
+    struct access_pattern * pattern;
+    char * path;
+};
+
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch_job * prefetch_queue = NULL;
+static struct access_pattern * access_patterns = NULL;
+static int halt_prefetch = 0;
+
+static pthread_t prefetch_workers[MAX_PREFETCH_THREADS];
+static int prefetch_worker_count = 0;
+static int prefetch_running = 0;
+static int readahead_running = 0;
+static int prefetch_max_depth = 0;
+static int(*prefetch_render_cbr)(struct image_buffer *) = NULL;
+
+static double moving_average(double average, double sample)
+{
+    return average > 0 ? average * 0.75 + sample * 0.25 : sample;
+}
+
+static struct access_pattern * get_access_pattern(const char * mlv_path)
+{
+    for(struct access_pattern * current = access_patterns; current != NULL; current = current->next)
+    {
+        if(!strcmp(current->mlv_path, mlv_path)) return current;
+    }
+
+    struct access_pattern * pattern = malloc(sizeof(struct access_pattern));
+    if(!pattern) return NULL;
+    memset(pattern, 0, sizeof(struct access_pattern));
+    pattern->mlv_path = malloc(strlen(mlv_path) + 1);
+    if(!pattern->mlv_path)
+    {
+        free(pattern);
+        return NULL;
+    }
+    strcpy(pattern->mlv_path, mlv_path);
+    pattern->last_frame = -1;
+    pattern->next = access_patterns;
+    access_patterns = pattern;
+    return pattern;
+}
+
+//how many frames to keep in flight: enough to cover the render time of one frame, plus one
+static int prefetch_depth(struct access_pattern * pattern)
+{
+    if(pattern->render_time <= 0 || pattern->request_interval <= 0) return MIN(2, prefetch_max_depth);
+    int depth = (int)ceil(pattern->render_time / pattern->request_interval) + 1;
+    return MAX(1, MIN(depth, prefetch_max_depth));
+}
+
+//drops the frames queued for this clip, they are from an older position of the reader
+static void prefetch_dequeue(struct access_pattern * pattern)
+{
+    struct prefetch_job * previous = NULL;
+    struct prefetch_job * next = NULL;
+    for(struct prefetch_job * current = prefetch_queue; current != NULL; current = next)
+    {
+        next = current->next;
+        if(current->pattern == pattern)
+        {
+            if(previous) previous->next = next;
+            else prefetch_queue = next;
+            free(current->path);
+            free(current);
+        }
+        else
+        {
+            previous = current;
+        }
+    }
+}
+
+static void prefetch_enqueue(struct access_pattern * pattern, const char * path)
+{
+    struct prefetch_job * job = malloc(sizeof(struct prefetch_job));
+    if(!job) return;
+    job->next = NULL;
+    job->pattern = pattern;
+    job->path = malloc(strlen(path) + 1);
+    if(!job->path)
+    {
+        free(job);
+        return;
+    }
+    strcpy(job->path, path);
+
+    struct prefetch_job * tail = prefetch_queue;
+    while(tail && tail->next) tail = tail->next;
+    if(tail) tail->next = job;
+    else prefetch_queue = job;
+}
+
+//the whole VIDF blocks of these frames, headers included
+static void readahead_frames(const char * mlv_path, const int * frames, int count)
+{
+    if(count <= 0) return;
+
+    struct mlv_chunks * chunks = mlvfs_open_chunks(mlv_path);
+    if(!chunks) return;
+
+    for(int i = 0; i < count; i++)
+    {
+        struct frame_headers frame_headers;
+        if(!mlv_get_frame_headers(mlv_path, frames[i], &frame_headers)) break;
+        mlvfs_advise_chunk(chunks, frame_headers.fileNumber, frame_headers.position, frame_headers.vidf_hdr.blockSize, MLVFS_IO_WILLNEED);
+    }
+
+    mlvfs_release_chunks(chunks);
+}
+
+void prefetch_frame_requested(const char * path, const struct mlvfs_path * resolved)
+{
+    if(!prefetch_running && !readahead_running) return;
+    if(resolved->type != MLVFS_FILE_DNG && resolved->type != MLVFS_FILE_EXR) return;
+
+    size_t length = strlen(path);
+    if(length < 10 || length >= MLVFS_PATH_MAX) return;
+
+    int frame = resolved->frame_number;
+
+    //the same frame again (EXRs are looked up on every read), nothing changed, don't even stat the clip
+    pthread_mutex_lock(&prefetch_mutex);
+    struct access_pattern * pattern = get_access_pattern(resolved->mlv_file);
+    int repeated = !pattern || frame == pattern->last_frame;
+    pthread_mutex_unlock(&prefetch_mutex);
+    if(repeated) return;
+
+    struct clip_info clip_info;
+    if(!mlvfs_get_clip_info(resolved->mlv_file, &clip_info)) return;
+
+    double now = mlvfs_time();
+
+    pthread_mutex_lock(&prefetch_mutex);
+
+    //another request for this frame may have been faster
+    pattern = get_access_pattern(resolved->mlv_file);
+    if(!pattern || frame == pattern->last_frame)
+    {
+        pthread_mutex_unlock(&prefetch_mutex);
+        return;
+    }
+
+    int direction = frame == pattern->last_frame + 1 ? 1 : (frame == pattern->last_frame - 1 ? -1 : 0);
+    if(direction && (pattern->run_length == 0 || direction == pattern->direction))
+    {
+        pattern->request_interval = moving_average(pattern->request_interval, now - pattern->last_request);
+        pattern->run_length++;
+    }
+    else
+    {
+        pattern->run_length = 0;
+    }
+    pattern->direction = direction;
+    pattern->last_frame = frame;
+    pattern->last_request = now;
+
+    prefetch_dequeue(pattern);
+
+    int frames[MAX_PREFETCH_DEPTH];
+    int frame_count = 0;
+    if(pattern->run_length >= PREFETCH_MIN_RUN)
+    {
+        char frame_path[MLVFS_PATH_MAX];
+        char digits[16];
+        strcpy(frame_path, path);
+
+        int depth = prefetch_running ? prefetch_depth(pattern) : READAHEAD_DEPTH;
+        for(int i = 1; i <= depth; i++)
+        {
+            int next_frame = frame + i * direction;
+            if(next_frame < 0 || next_frame >= clip_info.frame_count) break;
+
+            //same name, different 6 digits in front of the extension (see mlvfs_readdir)
+            if(snprintf(digits, sizeof(digits), "%06d", next_frame) != 6) break;
+            memcpy(frame_path + length - 10, digits, 6);
+
+            //nothing to read for frames that are already rendered
+            if(!has_image_buffer(frame_path, mlvfs_image_settings(frame_path))) frames[frame_count++] = next_frame;
+            if(prefetch_running) prefetch_enqueue(pattern, frame_path);
+        }
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if(readahead_running) readahead_frames(resolved->mlv_file, frames, frame_count);
+
+    //get the reads of compressed frames going while the workers are still busy with the previous ones
+    async_read_payloads(resolved->mlv_file, frames, frame_count);
+}
+
+static void * prefetch_run(void * arg)
+{
+    while(1)
+    {
+        pthread_mutex_lock(&prefetch_mutex);
+        while(!halt_prefetch && !prefetch_queue)
+        {
+            pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+        }
+        struct prefetch_job * job = halt_prefetch ? NULL : prefetch_queue;
+        if(job)
+        {
+            prefetch_queue = job->next;
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if(!job) break;
+
+        //frames that are already cached (or being rendered for a reader) are skipped
+        double start = mlvfs_time();
+        if(prefetch_image_buffer(job->path, mlvfs_image_settings(job->path), prefetch_render_cbr))
+        {
+            double elapsed = mlvfs_time() - start;
+            pthread_mutex_lock(&prefetch_mutex);
+            job->pattern->render_time = moving_average(job->pattern->render_time, elapsed);
+            pthread_mutex_unlock(&prefetch_mutex);
+        }
+
+        free(job->path);
+        free(job);
+    }
+    return NULL;
+}
+
+void prefetch_start(struct mlvfs * mlvfs, int(*render_cbr)(struct image_buffer *))
+{
+    //without --prefetch, only the access patterns are tracked
+    readahead_running = (mlvfs_get_io_policy() & MLVFS_IO_WILLNEED) != 0;
+    if(mlvfs->prefetch <= 0 || prefetch_running) return;
+
+    halt_prefetch = 0;
+    prefetch_render_cbr = render_cbr;
+    prefetch_max_depth = MIN(mlvfs->prefetch, MAX_PREFETCH_DEPTH);
+
+    int thread_count = MIN(mlvfs->prefetch, MAX_PREFETCH_THREADS);
+    for(prefetch_worker_count = 0; prefetch_worker_count < thread_count; prefetch_worker_count++)
+    {
+        if(pthread_create(&prefetch_workers[prefetch_worker_count], NULL, prefetch_run, NULL)) break;
+    }
+
+    if(prefetch_worker_count == 0)
+    {
+        err_printf("could not start the prefetch threads\n");
+        return;
+    }
+    async_io_start();
+    prefetch_running = 1;
+}
+
+void prefetch_stop(void)
+{
+    if(!prefetch_running && !readahead_running) return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    int had_workers = prefetch_running;
+    prefetch_running = 0;
+    readahead_running = 0;
+    halt_prefetch = 1;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if(had_workers)
+    {
+        //a worker finishes the frame it is rendering first
+        for(int i = 0; i < prefetch_worker_count; i++)
+        {
+            pthread_join(prefetch_workers[i], NULL);
+        }
+        prefetch_worker_count = 0;
+        async_io_stop();
+    }
+
+    struct prefetch_job * next_job = NULL;
+    for(struct prefetch_job * current = prefetch_queue; current != NULL; current = next_job)
+    {
+        next_job = current->next;
+        free(current->path);
+        free(current);
+    }
+    prefetch_queue = NULL;
+
+    struct access_pattern * next_pattern = NULL;
+    for(struct access_pattern * current = access_patterns; current != NULL; current = next_pattern)
+    {
+        next_pattern = current->next;
+        free(current->mlv_path);
+        free(current);
+    }
+    access_patterns = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_prefetch_h
+#define mlvfs_prefetch_h
+
+#include "mlvfs.h"
+#include "resource_manager.h"
+
+//upper limit for --prefetch=%d (frames ahead of the reader)
+#define MAX_PREFETCH_DEPTH 8
+#define MAX_PREFETCH_THREADS 4
+//frames the kernel is asked to read ahead with --readahead, when nothing is rendered ahead
+#define READAHEAD_DEPTH 4
+
+void prefetch_start(struct mlvfs * mlvfs, int(*render_cbr)(struct image_buffer *));
+void prefetch_stop(void);
+
+//tells the access pattern tracker that a DNG/EXR was requested, may queue the next frames for rendering
+void prefetch_frame_requested(const char * path, const struct mlvfs_path * resolved);
+
+#endif
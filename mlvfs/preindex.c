@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "mlvfs.h"
+#include "index.h"
+#include "resource_manager.h"
+#include "preindex.h"
+
+/*
+ * Indexes all clips below mlv_dir in the background right after mounting, so the first
+ * readdir/getattr of a clip doesn't have to build its index inside the FUSE callback.
+ * Clips go through mlvfs_get_frame_table(), so a clip that is opened while it is being
+ * indexed simply waits for the worker to finish it, and the result stays cached.
+ */
+
+struct preindex_item
+{
+    struct preindex_item * next;
+    char * path;
+};
+
+static pthread_mutex_t preindex_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preindex_cond = PTHREAD_COND_INITIALIZER;
+static struct preindex_item * preindex_queue = NULL;
+static struct preindex_item * preindex_queue_tail = NULL;
+static int preindex_total = 0;
+static int preindex_done = 0;
+static int preindex_walking = 0;
+static int halt_preindex = 0;
+
+static pthread_t preindex_walker;
+static pthread_t preindex_workers[MAX_PREINDEX_THREADS];
+static int preindex_worker_count = 0;
+static int preindex_running = 0;
+
+static char * preindex_root = NULL;
+
+static void preindex_add(const char * path)
+{
+    struct preindex_item * item = malloc(sizeof(struct preindex_item));
+    if(!item) return;
+
+    item->next = NULL;
+    item->path = malloc(strlen(path) + 1);
+    if(!item->path)
+    {
+        free(item);
+        return;
+    }
+    strcpy(item->path, path);
+
+    pthread_mutex_lock(&preindex_mutex);
+    if(preindex_queue_tail)
+    {
+        preindex_queue_tail->next = item;
+    }
+    else
+    {
+        preindex_queue = item;
+    }
+    preindex_queue_tail = item;
+    preindex_total++;
+    pthread_cond_signal(&preindex_cond);
+    pthread_mutex_unlock(&preindex_mutex);
+}
+
+static void preindex_walk(const char * path)
+{
+    DIR * dir = opendir(path);
+    if(!dir) return;
+
+    size_t path_length = strlen(path);
+    int has_separator = path_length > 0 && (path[path_length - 1] == '/' || path[path_length - 1] == '\\');
+    struct dirent * child;
+
+    while (!halt_preindex && (child = readdir(dir)) != NULL)
+    {
+        if(string_ends_with(child->d_name, ".MLD") || !strcmp(child->d_name, "..") || !strcmp(child->d_name, "."))
+        {
+            continue;
+        }
+
+        char * child_path = malloc(path_length + strlen(child->d_name) + 2);
+        if(!child_path) break;
+        sprintf(child_path, "%s%s%s", path, has_separator ? "" : DIR_SEP_STR, child->d_name);
+
+        if(string_ends_with(child->d_name, ".MLV") || string_ends_with(child->d_name, ".mlv"))
+        {
+            preindex_add(child_path);
+        }
+        else if(child->d_type == DT_DIR)
+        {
+            preindex_walk(child_path);
+        }
+        else if(child->d_type == DT_UNKNOWN) // If d_type is not supported on this filesystem
+        {
+            struct stat file_stat;
+            if((stat(child_path, &file_stat) == 0) && S_ISDIR(file_stat.st_mode))
+            {
+                preindex_walk(child_path);
+            }
+        }
+        free(child_path);
+    }
+    closedir(dir);
+}
+
+static void * preindex_walk_run(void * arg)
+{
+    preindex_walk(preindex_root);
+
+    pthread_mutex_lock(&preindex_mutex);
+    preindex_walking = 0;
+    pthread_cond_broadcast(&preindex_cond);
+    pthread_mutex_unlock(&preindex_mutex);
+    return NULL;
+}
+
+static void * preindex_run(void * arg)
+{
+    while(1)
+    {
+        pthread_mutex_lock(&preindex_mutex);
+        while(!halt_preindex && !preindex_queue && preindex_walking)
+        {
+            pthread_cond_wait(&preindex_cond, &preindex_mutex);
+        }
+        struct preindex_item * item = halt_preindex ? NULL : preindex_queue;
+        if(item)
+        {
+            preindex_queue = item->next;
+            if(!preindex_queue) preindex_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&preindex_mutex);
+
+        if(!item) break;
+
+        //builds (or validates) the IDX file and keeps the frame table cached
+        mlvfs_release_frame_table(mlvfs_get_frame_table(item->path));
+
+        pthread_mutex_lock(&preindex_mutex);
+        preindex_done++;
+        pthread_mutex_unlock(&preindex_mutex);
+
+        free(item->path);
+        free(item);
+    }
+    return NULL;
+}
+
+void preindex_start(struct mlvfs * mlvfs)
+{
+    if(mlvfs->preindex <= 0 || preindex_running) return;
+
+    preindex_root = malloc(strlen(mlvfs->mlv_path) + 1);
+    if(!preindex_root) return;
+    strcpy(preindex_root, mlvfs->mlv_path);
+
+    halt_preindex = 0;
+    preindex_walking = 1;
+    if(pthread_create(&preindex_walker, NULL, preindex_walk_run, NULL))
+    {
+        err_printf("could not start the pre-indexing\n");
+        free(preindex_root);
+        preindex_root = NULL;
+        return;
+    }
+    preindex_running = 1;
+
+    int thread_count = MIN(mlvfs->preindex, MAX_PREINDEX_THREADS);
+    for(preindex_worker_count = 0; preindex_worker_count < thread_count; preindex_worker_count++)
+    {
+        if(pthread_create(&preindex_workers[preindex_worker_count], NULL, preindex_run, NULL)) break;
+    }
+}
+
+void preindex_stop(void)
+{
+    if(!preindex_running) return;
+
+    pthread_mutex_lock(&preindex_mutex);
+    halt_preindex = 1;
+    pthread_cond_broadcast(&preindex_cond);
+    pthread_mutex_unlock(&preindex_mutex);
+
+    //a worker finishes the clip it is working on first
+    pthread_join(preindex_walker, NULL);
+    for(int i = 0; i < preindex_worker_count; i++)
+    {
+        pthread_join(preindex_workers[i], NULL);
+    }
+    preindex_worker_count = 0;
+    preindex_running = 0;
+
+    struct preindex_item * next = NULL;
+    for(struct preindex_item * current = preindex_queue; current != NULL; current = next)
+    {
+        next = current->next;
+        free(current->path);
+        free(current);
+    }
+    preindex_queue = preindex_queue_tail = NULL;
+    free(preindex_root);
+    preindex_root = NULL;
+}
+
+void preindex_prioritize(const char * real_path)
+{
+    size_t length = strlen(real_path);
+    while(length > 0 && (real_path[length - 1] == '/' || real_path[length - 1] == '\\')) length--;
+
+    pthread_mutex_lock(&preindex_mutex);
+
+    struct preindex_item * front = NULL;
+    struct preindex_item * front_tail = NULL;
+    struct preindex_item * previous = NULL;
+    struct preindex_item * next = NULL;
+    for(struct preindex_item * current = preindex_queue; current != NULL; current = next)
+    {
+        next = current->next;
+        if(!filename_strncmp(current->path, real_path, length) &&
+           (current->path[length] == 0 || current->path[length] == '/' || current->path[length] == '\\'))
+        {
+            //unlink it and keep it in order at the front
+            if(previous) previous->next = next;
+            else preindex_queue = next;
+            if(preindex_queue_tail == current) preindex_queue_tail = previous;
+
+            current->next = NULL;
+            if(front_tail) front_tail->next = current;
+            else front = current;
+            front_tail = current;
+        }
+        else
+        {
+            previous = current;
+        }
+    }
+    if(front)
+    {
+        front_tail->next = preindex_queue;
+        if(!preindex_queue) preindex_queue_tail = front_tail;
+        preindex_queue = front;
+    }
+
+    pthread_mutex_unlock(&preindex_mutex);
+}
+
+void preindex_get_progress(int * done, int * total)
+{
+    pthread_mutex_lock(&preindex_mutex);
+    *done = preindex_done;
+    *total = preindex_total;
+    pthread_mutex_unlock(&preindex_mutex);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_preindex_h
+#define mlvfs_preindex_h
+
+#include "mlvfs.h"
+
+//upper limit for --preindex=%d
+#define MAX_PREINDEX_THREADS 16
+
+void preindex_start(struct mlvfs * mlvfs);
+void preindex_stop(void);
+
+//moves all queued clips within this directory (or this clip) to the front of the queue
+void preindex_prioritize(const char * real_path);
+
+void preindex_get_progress(int * done, int * total);
+
+#endif
@@ -18,66 +18,177 @@
  * Boston, MA  02110-1301, USA.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* O_DIRECT */
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fuse.h>
 #include "index.h"
 #include "mlvfs.h"
 #include "resource_manager.h"
+#include "wav.h"
+#include "dng.h"
+#include "aces.h"
+#include "bufpool.h"
 #include "sys/stat.h"
 
-//some macros for simple thread synchronization
-#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
-#define LOCK(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER; pthread_mutex_lock(&x);
-#define RELOCK(x) pthread_mutex_lock(&(x));
-#define UNLOCK(x) pthread_mutex_unlock(&(x));
-#define CURRENT_THREAD (pthread_self())
-#define INIT_LOCK(x) pthread_mutex_init(&(x), NULL)
-#define DESTROY_LOCK(x) pthread_mutex_destroy(&(x))
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
-#define MAX_UNUSED_IMAGE_BUFFER_COUNT 4
-#define MAX_TOTAL_IMAGE_BUFFER_COUNT 16
+//frames rendered by --prefetch that were not read yet, on top of what the reader holds
+#define MAX_PREFETCHED_IMAGE_BUFFER_COUNT 8
+//the cache is split by path hash, threads reading different frames rarely need the same lock
+#define IMAGE_BUFFER_SHARD_COUNT 16
+#define IMAGE_BUFFER_BUCKET_COUNT 64
 
-CREATE_MUTEX(image_buffer_mutex)
+/*
+ * Rendered frames (and GIF previews) are kept in hash tables by virtual path and the settings
+ * they were rendered with (see mlvfs_image_settings), and in lists ordered by last use. Each
+ * shard has its own lock, which is only held for the lookup, never while a frame is rendered.
+ * Once the rendered data exceeds --cache-size, a cleaner thread frees the least recently used
+ * buffers nobody holds a reference to.
+ */
+struct image_buffer_shard
+{
+    LOCK_T mutex;
+    struct image_buffer * buckets[IMAGE_BUFFER_BUCKET_COUNT];
+    struct lru_list recent;
+};
 
-static void image_buffer_cleanup();
+static struct image_buffer_shard image_buffer_shards[IMAGE_BUFFER_SHARD_COUNT];
+static pthread_once_t image_buffer_shards_once = PTHREAD_ONCE_INIT;
 
-static struct image_buffer * image_buffers = NULL;
+//the totals and the cleaner thread, only ever taken after a shard's mutex (never the other way around)
+CREATE_MUTEX(image_cache_mutex)
+static pthread_cond_t image_cache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t image_cache_cleaner;
+static int image_cache_cleaner_running = 0;
+static int halt_image_cache_cleaner = 0;
+static uint64_t image_cache_releases = 0;       /* wakes up the cleaner once something can be freed again */
 
 static int image_buffer_count = 0;
+static int prefetched_image_buffer_count = 0;
+static uint64_t image_buffer_bytes = 0;
+static uint64_t image_buffer_budget = (uint64_t)DEFAULT_CACHE_SIZE * 1024 * 1024;
 
-static struct image_buffer * get_image_buffer(const char * dng_filename)
+uint64_t fnv1a_data(const void * data, size_t size, uint64_t seed)
 {
-    for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+    uint64_t hash = seed;
+    for(size_t i = 0; i < size; i++)
     {
-        if(!strcmp(current->dng_filename, dng_filename)) return current;
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 1099511628211ULL;
     }
-    return NULL;
+    return hash;
 }
 
-static struct image_buffer * new_image_buffer(const char * dng_filename)
+uint64_t fnv1a(const char * string, uint64_t seed)
 {
-    image_buffer_cleanup();
-    struct image_buffer * new_buffer = malloc(sizeof(struct image_buffer));
-    if(new_buffer == NULL) return NULL;
-    
-    image_buffer_count++;
-    memset(new_buffer, 0, sizeof(struct image_buffer));
-    
-    if(image_buffers == NULL)
+    return fnv1a_data(string, strlen(string), seed);
+}
+
+static void lru_unlink(struct lru_list * list, struct lru_node * node)
+{
+    if(node->prev) node->prev->next = node->next;
+    else if(list->mru == node) list->mru = node->next;
+    if(node->next) node->next->prev = node->prev;
+    else if(list->lru == node) list->lru = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void lru_push_front(struct lru_list * list, struct lru_node * node)
+{
+    node->prev = NULL;
+    node->next = list->mru;
+    if(list->mru) list->mru->prev = node;
+    else list->lru = node;
+    list->mru = node;
+}
+
+double mlvfs_time()
+{
+#if defined(_WIN32)
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#endif
+}
+
+static void init_image_buffer_shards()
+{
+    for(int i = 0; i < IMAGE_BUFFER_SHARD_COUNT; i++)
+    {
+        INIT_LOCK(image_buffer_shards[i].mutex);
+    }
+}
+
+static uint32_t image_buffer_hash(const char * dng_filename)
+{
+    return (uint32_t)fnv1a(dng_filename, FNV1A_SEED);
+}
+
+static struct image_buffer_shard * get_image_buffer_shard(uint32_t hash)
+{
+    pthread_once(&image_buffer_shards_once, init_image_buffer_shards);
+    return &image_buffer_shards[hash % IMAGE_BUFFER_SHARD_COUNT];
+}
+
+static struct image_buffer ** get_image_buffer_bucket(struct image_buffer_shard * shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / IMAGE_BUFFER_SHARD_COUNT) % IMAGE_BUFFER_BUCKET_COUNT];
+}
+
+static struct image_buffer * get_image_buffer(struct image_buffer_shard * shard, const char * dng_filename, uint32_t hash, uint64_t settings)
+{
+    for(struct image_buffer * current = *get_image_buffer_bucket(shard, hash); current != NULL; current = current->next)
     {
-        image_buffers = new_buffer;
+        if(current->hash == hash && current->settings == settings && !current->stale && !strcmp(current->dng_filename, dng_filename)) return current;
     }
-    else
+    return NULL;
+}
+
+//the buffer was just used
+static void touch_image_buffer(struct image_buffer_shard * shard, struct image_buffer * image_buffer)
+{
+    lru_unlink(&shard->recent, &image_buffer->lru);
+    lru_push_front(&shard->recent, &image_buffer->lru);
+    image_buffer->last_used = mlvfs_time();
+}
+
+static void free_image_buffer(struct image_buffer_shard * shard, struct image_buffer * image_buffer);
+
+static struct image_buffer * new_image_buffer(struct image_buffer_shard * shard, const char * dng_filename, uint32_t hash, uint64_t settings)
+{
+    //the same file rendered with other settings won't be asked for again (unless they are changed back)
+    struct image_buffer * next = NULL;
+    for(struct image_buffer * current = *get_image_buffer_bucket(shard, hash); current != NULL; current = next)
     {
-        struct image_buffer * current = image_buffers;
-        while(current->next != NULL)
+        next = current->next;
+        if(current->hash == hash && !current->refcount && !strcmp(current->dng_filename, dng_filename))
         {
-            current = current->next;
+            free_image_buffer(shard, current);
         }
-        current->next = new_buffer;
     }
+
+
+    struct image_buffer * new_buffer = malloc(sizeof(struct image_buffer));
+    if(new_buffer == NULL) return NULL;
+    memset(new_buffer, 0, sizeof(struct image_buffer));
+    
     new_buffer->dng_filename = malloc((sizeof(char) * (strlen(dng_filename) + 2)));
     if (!new_buffer->dng_filename)
     {
@@ -86,102 +197,281 @@ static struct image_buffer * new_image_buffer(const char * dng_filename)
     }
     strcpy(new_buffer->dng_filename, dng_filename);
     INIT_LOCK(new_buffer->mutex);
+
+    new_buffer->hash = hash;
+    new_buffer->settings = settings;
+    struct image_buffer ** bucket = get_image_buffer_bucket(shard, hash);
+    new_buffer->next = *bucket;
+    *bucket = new_buffer;
+    lru_push_front(&shard->recent, &new_buffer->lru);
+    new_buffer->last_used = mlvfs_time();
+
+    RELOCK(image_cache_mutex)
+    {
+        image_buffer_count++;
+    }
+    UNLOCK(image_cache_mutex)
     return new_buffer;
 }
 
-struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created)
+static void free_image_buffer(struct image_buffer_shard * shard, struct image_buffer * image_buffer)
 {
-    struct image_buffer * image_buffer = NULL;
-    *was_created = 0;
+    if(!image_buffer) return;
     
-    RELOCK(image_buffer_mutex)
+    struct image_buffer ** link = get_image_buffer_bucket(shard, image_buffer->hash);
+    while(*link && *link != image_buffer) link = &(*link)->next;
+    if(*link) *link = image_buffer->next;
+    lru_unlink(&shard->recent, &image_buffer->lru);
+
+    RELOCK(image_cache_mutex)
     {
-        image_buffer = get_image_buffer(path);
-        if(!image_buffer)
+        if(image_buffer->prefetched) prefetched_image_buffer_count--;
+        image_buffer_bytes -= image_buffer->charged;
+        image_buffer_count--;
+    }
+    UNLOCK(image_cache_mutex)
+    
+    DESTROY_LOCK(image_buffer->mutex);
+    free(image_buffer->dng_filename);
+    bufpool_free(image_buffer->header);
+    if(image_buffer->free_flag) free(image_buffer->data);
+    free(image_buffer);
+}
+
+//the least recently used buffer of a shard nobody holds a reference to
+static struct image_buffer * find_unused_image_buffer(struct image_buffer_shard * shard, int prefetched_only)
+{
+    for(struct lru_node * node = shard->recent.lru; node != NULL; node = node->prev)
+    {
+        struct image_buffer * current = LRU_ENTRY(node, struct image_buffer);
+        if(!current->refcount && (current->prefetched || !prefetched_only)) return current;
+    }
+    return NULL;
+}
+
+/**
+ * Frees the least recently used buffer of all shards that nobody holds a reference to
+ * @return 1 if a buffer was freed, 0 if all of them are in use
+ */
+static int evict_image_buffer(int prefetched_only)
+{
+    //only one shard is locked at a time, so the oldest buffer might have been used again in the meantime
+    struct image_buffer_shard * oldest_shard = NULL;
+    double oldest = 0;
+    for(int i = 0; i < IMAGE_BUFFER_SHARD_COUNT; i++)
+    {
+        struct image_buffer_shard * shard = &image_buffer_shards[i];
+        RELOCK(shard->mutex)
         {
-            image_buffer = new_image_buffer(path);
-            image_buffer->in_use = 1;
-            *was_created = 1;
+            struct image_buffer * unused = find_unused_image_buffer(shard, prefetched_only);
+            if(unused && (!oldest_shard || unused->last_used < oldest))
+            {
+                oldest_shard = shard;
+                oldest = unused->last_used;
+            }
         }
+        UNLOCK(shard->mutex)
     }
-    UNLOCK(image_buffer_mutex)
-    
-    if(!image_buffer) return NULL;
-    
+    if(!oldest_shard) return 0;
+
+    int result = 0;
+    RELOCK(oldest_shard->mutex)
+    {
+        struct image_buffer * unused = find_unused_image_buffer(oldest_shard, prefetched_only);
+        if(unused)
+        {
+            free_image_buffer(oldest_shard, unused);
+            result = 1;
+        }
+    }
+    UNLOCK(oldest_shard->mutex)
+    return result;
+}
+
+/*
+ * Frees buffers while the cache is above its budget, so that neither lookups nor renders have to
+ * (buffers somebody holds a reference to are skipped, so we may stay above it for a while)
+ */
+static void * image_cache_clean(void * arg)
+{
+    RELOCK(image_cache_mutex)
+    {
+        while(!halt_image_cache_cleaner)
+        {
+            if(image_buffer_bytes <= image_buffer_budget)
+            {
+                pthread_cond_wait(&image_cache_cond, &image_cache_mutex);
+                continue;
+            }
+
+            uint64_t releases = image_cache_releases;
+            UNLOCK(image_cache_mutex)
+            int freed = evict_image_buffer(0);
+            RELOCK(image_cache_mutex)
+
+            //everything is in use, try again once a reader is done with a buffer
+            if(!freed && releases == image_cache_releases && !halt_image_cache_cleaner)
+            {
+                pthread_cond_wait(&image_cache_cond, &image_cache_mutex);
+            }
+        }
+    }
+    UNLOCK(image_cache_mutex)
+    return NULL;
+}
+
+//call with image_cache_mutex locked
+static void wake_image_cache_cleaner()
+{
+    if(image_buffer_bytes <= image_buffer_budget) return;
+    if(!image_cache_cleaner_running && !halt_image_cache_cleaner)
+    {
+        image_cache_cleaner_running = !pthread_create(&image_cache_cleaner, NULL, image_cache_clean, NULL);
+        if(!image_cache_cleaner_running) err_printf("could not start the image cache cleaner\n");
+    }
+    pthread_cond_signal(&image_cache_cond);
+}
+
+//counts what a buffer holds now against the budget, it only knows its size once it is rendered
+static void charge_image_buffer(struct image_buffer * image_buffer)
+{
+    size_t size = image_buffer->data ? image_buffer->header_size + image_buffer->size : 0;
+    RELOCK(image_cache_mutex)
+    {
+        image_buffer_bytes = image_buffer_bytes - image_buffer->charged + size;
+        image_buffer->charged = size;
+        wake_image_cache_cleaner();
+    }
+    UNLOCK(image_cache_mutex)
+}
+
+/**
+ * Renders a buffer unless that happened already (or is happening in another thread, then waits for it)
+ */
+static void render_image_buffer(struct image_buffer * image_buffer, int(*new_buffer_cbr)(struct image_buffer *))
+{
+    int rendered = 0;
     RELOCK(image_buffer->mutex)
     {
         if(!image_buffer->data)
         {
             new_buffer_cbr(image_buffer);
+            rendered = 1;
         }
     }
     UNLOCK(image_buffer->mutex)
-    
-    return image_buffer;
+
+    if(rendered)
+    {
+        struct image_buffer_shard * shard = get_image_buffer_shard(image_buffer->hash);
+        RELOCK(shard->mutex)
+        {
+            charge_image_buffer(image_buffer);
+        }
+        UNLOCK(shard->mutex)
+    }
 }
 
-static void free_image_buffer(struct image_buffer * image_buffer)
+/**
+ * The buffer for this path, rendered if it wasn't cached yet
+ * The caller holds a reference that keeps it from being freed, give it back with release_image_buffer()
+ */
+struct image_buffer * get_or_create_image_buffer(const char * path, uint64_t settings, int(*new_buffer_cbr)(struct image_buffer *), int * was_created)
 {
-    if(!image_buffer) return;
+    struct image_buffer * image_buffer = NULL;
+    uint32_t hash = image_buffer_hash(path);
+    struct image_buffer_shard * shard = get_image_buffer_shard(hash);
+    *was_created = 0;
     
-    if(image_buffer == image_buffers)
-    {
-        image_buffers = image_buffer->next;
-    }
-    else
+    RELOCK(shard->mutex)
     {
-        struct image_buffer * current = image_buffers;
-        while(current->next != NULL)
+        image_buffer = get_image_buffer(shard, path, hash, settings);
+        if(!image_buffer)
+        {
+            image_buffer = new_image_buffer(shard, path, hash, settings);
+            *was_created = image_buffer != NULL;
+        }
+        else
         {
-            if(current->next == image_buffer) break;
-            current = current->next;
+            touch_image_buffer(shard, image_buffer);
+            if(image_buffer->prefetched)
+            {
+                //a reader picked up a prefetched frame, from now on it is a regular buffer
+                image_buffer->prefetched = 0;
+                RELOCK(image_cache_mutex)
+                {
+                    prefetched_image_buffer_count--;
+                }
+                UNLOCK(image_cache_mutex)
+            }
         }
-        current->next = image_buffer->next;
+        if(image_buffer) image_buffer->refcount++;
     }
+    UNLOCK(shard->mutex)
     
-    DESTROY_LOCK(image_buffer->mutex);
-    free(image_buffer->dng_filename);
-    free(image_buffer->header);
-    if(image_buffer->free_flag) free(image_buffer->data);
-    free(image_buffer);
-    image_buffer_count--;
+    if(!image_buffer) return NULL;
+    
+    render_image_buffer(image_buffer, new_buffer_cbr);
+    return image_buffer;
 }
 
 void release_image_buffer(struct image_buffer * image_buffer)
 {
-    RELOCK(image_buffer->mutex)
+    struct image_buffer_shard * shard = get_image_buffer_shard(image_buffer->hash);
+    RELOCK(shard->mutex)
     {
-        image_buffer->in_use = 0;
+        image_buffer->refcount--;
+        if(!image_buffer->refcount)
+        {
+            //rendering failed (the next reader tries again from scratch), or the settings changed
+            if(!image_buffer->data || image_buffer->stale)
+            {
+                free_image_buffer(shard, image_buffer);
+            }
+            else
+            {
+                RELOCK(image_cache_mutex)
+                {
+                    image_cache_releases++;
+                    wake_image_cache_cleaner();
+                }
+                UNLOCK(image_cache_mutex)
+            }
+        }
     }
-    UNLOCK(image_buffer->mutex)
+    UNLOCK(shard->mutex)
 }
 
-void release_image_buffer_by_path(const char * path)
+void free_all_image_buffers()
 {
-    RELOCK(image_buffer_mutex)
+    RELOCK(image_cache_mutex)
+    {
+        halt_image_cache_cleaner = 1;
+        pthread_cond_signal(&image_cache_cond);
+    }
+    UNLOCK(image_cache_mutex)
+    if(image_cache_cleaner_running)
+    {
+        pthread_join(image_cache_cleaner, NULL);
+        image_cache_cleaner_running = 0;
+    }
+
+    pthread_once(&image_buffer_shards_once, init_image_buffer_shards);
+    for(int i = 0; i < IMAGE_BUFFER_SHARD_COUNT; i++)
     {
-        struct image_buffer * image_buffer = get_image_buffer(path);
-        if(image_buffer)
+        struct image_buffer_shard * shard = &image_buffer_shards[i];
+        RELOCK(shard->mutex)
         {
-            image_buffer->in_use = 0;
+            while(shard->recent.mru) free_image_buffer(shard, LRU_ENTRY(shard->recent.mru, struct image_buffer));
         }
+        UNLOCK(shard->mutex)
     }
-    UNLOCK(image_buffer_mutex)
-}
 
-void free_all_image_buffers()
-{
-    struct image_buffer * next = NULL;
-    struct image_buffer * current = image_buffers;
-    while(current != NULL)
+    RELOCK(image_cache_mutex)
     {
-        next = current->next;
-        free(current->dng_filename);
-        if(current->free_flag) free(current->data);
-        free(current->header);
-        free(current);
-        current = next;
+        halt_image_cache_cleaner = 0;
     }
+    UNLOCK(image_cache_mutex)
 }
 
 int get_image_buffer_count()
@@ -189,203 +479,1723 @@ int get_image_buffer_count()
     return image_buffer_count;
 }
 
-/*
- * Try and cleanup any potentially unused image_buffers
+int has_image_buffer(const char * path, uint64_t settings)
+{
+    int result = 0;
+    uint32_t hash = image_buffer_hash(path);
+    struct image_buffer_shard * shard = get_image_buffer_shard(hash);
+    RELOCK(shard->mutex)
+    {
+        result = get_image_buffer(shard, path, hash, settings) != NULL;
+    }
+    UNLOCK(shard->mutex)
+    return result;
+}
+
+/**
+ * Renders a frame ahead of time into the cache, unless it is already there
+ * @return 1 if the frame was rendered
  */
-static void image_buffer_cleanup()
+int prefetch_image_buffer(const char * path, uint64_t settings, int(*new_buffer_cbr)(struct image_buffer *))
 {
-    while (get_image_buffer_count() > MAX_UNUSED_IMAGE_BUFFER_COUNT)
+    struct image_buffer * image_buffer = NULL;
+    uint32_t hash = image_buffer_hash(path);
+    struct image_buffer_shard * shard = get_image_buffer_shard(hash);
+
+    if(has_image_buffer(path, settings)) return 0;
+
+    //make room by dropping the oldest prefetched frame nobody read (the reader went elsewhere)
+    int full = 0;
+    RELOCK(image_cache_mutex)
+    {
+        full = prefetched_image_buffer_count >= MAX_PREFETCHED_IMAGE_BUFFER_COUNT;
+    }
+    UNLOCK(image_cache_mutex)
+    if(full) evict_image_buffer(1);
+
+    RELOCK(shard->mutex)
     {
-        //cleanup no longer in use image buffers starting with the oldest (appearing first in the linked list)
-        int any_in_use = 0;
-        for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+        if(!get_image_buffer(shard, path, hash, settings))
         {
-            int in_use = 0;
-            RELOCK(current->mutex)
+            RELOCK(image_cache_mutex)
             {
-                in_use = current->in_use;
+                full = prefetched_image_buffer_count >= MAX_PREFETCHED_IMAGE_BUFFER_COUNT;
+                if(!full) prefetched_image_buffer_count++;
             }
-            UNLOCK(current->mutex)
-            if(!in_use)
+            UNLOCK(image_cache_mutex)
+
+            //our reference keeps it from being freed while we render it
+            image_buffer = full ? NULL : new_image_buffer(shard, path, hash, settings);
+            if(image_buffer)
             {
-                any_in_use = 1;
-                free_image_buffer(current);
-                //freeing the buffer modifies our linked list, so we better exit the loop or screwy things could happen
-                //TODO: figure out how to cleanup everything in one pass
-                break;
+                image_buffer->refcount = 1;
+                image_buffer->prefetched = 1;
+            }
+            else if(!full)
+            {
+                RELOCK(image_cache_mutex)
+                {
+                    prefetched_image_buffer_count--;
+                }
+                UNLOCK(image_cache_mutex)
             }
         }
-        if (!any_in_use) break;
     }
-    
-    //just in case programs don't close a file, limit the total number of buffers we can have
-    while (get_image_buffer_count() > MAX_TOTAL_IMAGE_BUFFER_COUNT)
-    {
-        if(!image_buffers) break;
-        free_image_buffer(image_buffers);
-    }
-}
+    UNLOCK(shard->mutex)
 
-#ifdef KEEP_FILES_OPEN
-static struct mlv_chunks * loaded_chunks = NULL;
+    if(!image_buffer) return 0;
 
-static struct mlv_chunks * get_chunks(const char * path)
+    render_image_buffer(image_buffer, new_buffer_cbr);
+    release_image_buffer(image_buffer);
+    return 1;
+}
+
+/**
+ * Drops the buffers that were rendered with settings that no longer apply to them,
+ * those still being read are dropped once they are released
+ * @param settings_cbr the current settings for a path
+ */
+void invalidate_image_buffers(uint64_t(*settings_cbr)(const char *))
 {
-    for(struct mlv_chunks * current = loaded_chunks; current != NULL; current = current->next)
+    pthread_once(&image_buffer_shards_once, init_image_buffer_shards);
+    for(int i = 0; i < IMAGE_BUFFER_SHARD_COUNT; i++)
     {
-        if(current->thread_id == CURRENT_THREAD && !filename_strcmp(current->path, path)) return current;
+        struct image_buffer_shard * shard = &image_buffer_shards[i];
+        RELOCK(shard->mutex)
+        {
+            struct lru_node * less_recent = NULL;
+            for(struct lru_node * node = shard->recent.mru; node != NULL; node = less_recent)
+            {
+                struct image_buffer * current = LRU_ENTRY(node, struct image_buffer);
+                less_recent = node->next;
+                if(current->settings == settings_cbr(current->dng_filename)) continue;
+                if(current->refcount) current->stale = 1;
+                else free_image_buffer(shard, current);
+            }
+        }
+        UNLOCK(shard->mutex)
     }
-    return NULL;
 }
 
-static struct mlv_chunks * new_chunks(const char * path, FILE** files, uint32_t chunk_count)
+void mlvfs_set_cache_size(int megabytes)
 {
-    struct mlv_chunks * new_buffer = (struct mlv_chunks *)malloc(sizeof(struct mlv_chunks));
-    if(new_buffer == NULL) return NULL;
-    
-    if(loaded_chunks == NULL)
-    {
-        loaded_chunks = new_buffer;
-    }
-    else
+    RELOCK(image_cache_mutex)
     {
-        struct mlv_chunks * current = loaded_chunks;
-        while(current->next != NULL)
-        {
-            current = current->next;
-        }
-        current->next = new_buffer;
+        image_buffer_budget = (uint64_t)(megabytes > 0 ? megabytes : DEFAULT_CACHE_SIZE) * 1024 * 1024;
+        wake_image_cache_cleaner();
     }
-    new_buffer->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
-    strcpy(new_buffer->path, path);
-    new_buffer->next = NULL;
-    new_buffer->chunks = files;
-    new_buffer->chunk_count = chunk_count;
-    new_buffer->thread_id = CURRENT_THREAD;
-    return new_buffer;
+    UNLOCK(image_cache_mutex)
 }
-#endif
 
-void close_all_chunks()
+void get_image_cache_stats(uint64_t * bytes, int * count)
 {
-#ifdef KEEP_FILES_OPEN
-    struct mlv_chunks * next = NULL;
-    struct mlv_chunks * current = loaded_chunks;
-    while(current != NULL)
+    RELOCK(image_cache_mutex)
     {
-        next = current->next;
-        free(current->path);
-        close_chunks(current->chunks, current->chunk_count);
-        free(current);
-        current = next;
+        *bytes = image_buffer_bytes;
+        *count = image_buffer_count;
     }
-#endif
+    UNLOCK(image_cache_mutex)
+}
+
+#define RAW_FRAME_BUCKET_COUNT 256
+
+/*
+ * Decoded frames (LJ92/LZMA decompressed or unpacked to 16 bit), so a frame can be post processed
+ * again (other settings, or as EXR after it was served as DNG) without reading and decoding it
+ * from the MLV again. The least recently used ones are dropped once they exceed --raw-cache-size.
+ * Frames are copied in and out, the post processing works in place on the copy.
+ */
+CREATE_MUTEX(raw_frame_mutex)
+
+static struct raw_frame * raw_frames[RAW_FRAME_BUCKET_COUNT];
+static struct lru_list raw_frames_recent;
+static int raw_frame_count = 0;
+static uint64_t raw_frame_bytes = 0;
+static uint64_t raw_frame_budget = (uint64_t)DEFAULT_RAW_CACHE_SIZE * 1024 * 1024;
+
+static uint32_t raw_frame_hash(const char * mlv_path, int frame_number)
+{
+    return (uint32_t)fnv1a_data(&frame_number, sizeof(frame_number), fnv1a(mlv_path, FNV1A_SEED));
 }
 
-FILE** mlvfs_load_chunks(const char * path, uint32_t * chunk_count)
+static struct raw_frame * find_raw_frame(const char * mlv_path, int frame_number, uint32_t hash)
 {
-#ifdef KEEP_FILES_OPEN
-    FILE **chunk_files = NULL;
-    *chunk_count = 0;
-    
-    LOCK(chunk_load_mutex)
+    for(struct raw_frame * current = raw_frames[hash % RAW_FRAME_BUCKET_COUNT]; current != NULL; current = current->next)
     {
-        struct mlv_chunks * mlv_chunks = get_chunks(path);
-        if(!mlv_chunks)
-        {
-            chunk_files = load_chunks(path, chunk_count);
-            new_chunks(path, chunk_files, *chunk_count);
-        }
-        else
-        {
-            chunk_files = mlv_chunks->chunks;
-            *chunk_count = mlv_chunks->chunk_count;
-        }
+        if(current->hash == hash && current->frame_number == frame_number && !strcmp(current->mlv_path, mlv_path)) return current;
     }
-    UNLOCK(chunk_load_mutex)
-    return chunk_files;
-#else
-    return load_chunks(path, chunk_count);
-#endif
+    return NULL;
 }
 
-void mlvfs_close_chunks(FILE **chunk_files, uint32_t chunk_count)
+static void unlink_raw_frame(struct raw_frame * raw_frame)
 {
-#ifndef KEEP_FILES_OPEN
-    close_chunks(chunk_files, chunk_count);
-#endif
+    struct raw_frame ** link = &raw_frames[raw_frame->hash % RAW_FRAME_BUCKET_COUNT];
+    while(*link && *link != raw_frame) link = &(*link)->next;
+    if(*link) *link = raw_frame->next;
+    raw_frame->next = NULL;
+    lru_unlink(&raw_frames_recent, &raw_frame->lru);
 }
 
-CREATE_MUTEX(dng_attr_mapping_mutex)
+static void free_raw_frame(struct raw_frame * raw_frame)
+{
+    unlink_raw_frame(raw_frame);
 
-static struct dng_attr_mapping * dng_attr_mappings = NULL;
+    raw_frame_bytes -= raw_frame->size;
+    raw_frame_count--;
+    free(raw_frame->mlv_path);
+    bufpool_free(raw_frame->data);
+    free(raw_frame);
+}
 
-static struct FUSE_STAT * lookup_dng_attr_internal(const char * path)
+//takes a frame out of the cache, if it is still being copied out that frees it when done
+static void retire_raw_frame(struct raw_frame * raw_frame)
 {
-    for(struct dng_attr_mapping * current = dng_attr_mappings; current != NULL; current = current->next)
+    if(!raw_frame->refcount)
     {
-        if(!filename_strcmp(current->path, path)) return current->attr;
+        free_raw_frame(raw_frame);
+        return;
     }
-    return NULL;
+    unlink_raw_frame(raw_frame);
+    raw_frame->stale = 1;
 }
 
-struct FUSE_STAT * lookup_dng_attr(const char * path)
+static void raw_frame_cleanup()
 {
-    struct FUSE_STAT * result = NULL;
-    RELOCK(dng_attr_mapping_mutex)
+    struct lru_node * node = raw_frames_recent.lru;
+    while(raw_frame_bytes > raw_frame_budget && node != NULL)
     {
-        result = lookup_dng_attr_internal(path);
+        struct lru_node * more_recent = node->prev;
+        struct raw_frame * current = LRU_ENTRY(node, struct raw_frame);
+        if(!current->refcount) free_raw_frame(current);
+        node = more_recent;
     }
-    UNLOCK(dng_attr_mapping_mutex)
-    return result;
 }
 
-void register_dng_attr(const char * path, struct FUSE_STAT *attr)
+/**
+ * Copies a decoded frame out of the cache
+ * @return 1 if it was cached (with the same size, from the same place in the MLV), 0 otherwise
+ */
+int mlvfs_get_raw_frame(const char * mlv_path, int frame_number, uint32_t file_number, uint64_t position, uint16_t * data, size_t size)
 {
-    RELOCK(dng_attr_mapping_mutex)
+    struct raw_frame * raw_frame = NULL;
+    uint32_t hash = raw_frame_hash(mlv_path, frame_number);
+
+    RELOCK(raw_frame_mutex)
     {
-        if(!lookup_dng_attr_internal(path))
+        raw_frame = find_raw_frame(mlv_path, frame_number, hash);
+        if(raw_frame && (raw_frame->file_number != file_number || raw_frame->position != position || raw_frame->size != size))
         {
-            struct dng_attr_mapping * new_buffer = (struct dng_attr_mapping *)malloc(sizeof(struct dng_attr_mapping));
-            if(new_buffer)
-            {
-                new_buffer->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
-                if (!new_buffer->path)
-                {
-                    UNLOCK(dng_attr_mapping_mutex)
-                    return;
-                }
-                strcpy(new_buffer->path, path);
-                new_buffer->attr = (struct FUSE_STAT*)malloc(sizeof(struct FUSE_STAT));
-                if (!new_buffer->attr)
-                {
-                    free(new_buffer->path);
-                    UNLOCK(dng_attr_mapping_mutex)
-                    return;
-                }
-                memcpy(new_buffer->attr, attr, sizeof(struct FUSE_STAT));
-                new_buffer->next = dng_attr_mappings;
-                dng_attr_mappings = new_buffer;
-            }
+            //the MLV was rewritten since
+            retire_raw_frame(raw_frame);
+            raw_frame = NULL;
+        }
+        if(raw_frame)
+        {
+            raw_frame->refcount++;
+            lru_unlink(&raw_frames_recent, &raw_frame->lru);
+            lru_push_front(&raw_frames_recent, &raw_frame->lru);
         }
     }
-    UNLOCK(dng_attr_mapping_mutex)
+    UNLOCK(raw_frame_mutex)
+
+    if(!raw_frame) return 0;
+
+    //the copy is made without the lock, our reference keeps the frame around
+    memcpy(data, raw_frame->data, size);
+
+    RELOCK(raw_frame_mutex)
+    {
+        raw_frame->refcount--;
+        if(raw_frame->stale && !raw_frame->refcount) free_raw_frame(raw_frame);
+        raw_frame_cleanup();
+    }
+    UNLOCK(raw_frame_mutex)
+    return 1;
 }
 
-void free_dng_attr_mappings()
+/**
+ * Keeps a copy of a decoded frame, unless it is larger than the whole cache
+ */
+void mlvfs_put_raw_frame(const char * mlv_path, int frame_number, uint32_t file_number, uint64_t position, const uint16_t * data, size_t size)
 {
-    RELOCK(dng_attr_mapping_mutex)
+    if(size > raw_frame_budget) return;
+
+    struct raw_frame * raw_frame = (struct raw_frame *)malloc(sizeof(struct raw_frame));
+    if(!raw_frame) return;
+    memset(raw_frame, 0, sizeof(struct raw_frame));
+    raw_frame->mlv_path = (char*)malloc((sizeof(char) * (strlen(mlv_path) + 2)));
+    raw_frame->data = (uint16_t *)bufpool_alloc(size);
+    if(!raw_frame->mlv_path || !raw_frame->data)
     {
-        struct dng_attr_mapping * next = NULL;
-        struct dng_attr_mapping * current = dng_attr_mappings;
-        while(current != NULL)
-        {
+        free(raw_frame->mlv_path);
+        bufpool_free(raw_frame->data);
+        free(raw_frame);
+        return;
+    }
+    strcpy(raw_frame->mlv_path, mlv_path);
+    memcpy(raw_frame->data, data, size);
+    raw_frame->hash = raw_frame_hash(mlv_path, frame_number);
+    raw_frame->frame_number = frame_number;
+    raw_frame->file_number = file_number;
+    raw_frame->position = position;
+    raw_frame->size = size;
+
+    RELOCK(raw_frame_mutex)
+    {
+        //another thread decoded the same frame at the same time, keep the newer one
+        struct raw_frame * existing = find_raw_frame(mlv_path, frame_number, raw_frame->hash);
+        if(existing) retire_raw_frame(existing);
+
+        struct raw_frame ** bucket = &raw_frames[raw_frame->hash % RAW_FRAME_BUCKET_COUNT];
+        raw_frame->next = *bucket;
+        *bucket = raw_frame;
+        lru_push_front(&raw_frames_recent, &raw_frame->lru);
+        raw_frame_bytes += size;
+        raw_frame_count++;
+        raw_frame_cleanup();
+    }
+    UNLOCK(raw_frame_mutex)
+}
+
+void mlvfs_set_raw_cache_size(int megabytes)
+{
+    RELOCK(raw_frame_mutex)
+    {
+        raw_frame_budget = (uint64_t)(megabytes > 0 ? megabytes : DEFAULT_RAW_CACHE_SIZE) * 1024 * 1024;
+        raw_frame_cleanup();
+    }
+    UNLOCK(raw_frame_mutex)
+}
+
+void get_raw_cache_stats(uint64_t * bytes, int * count)
+{
+    RELOCK(raw_frame_mutex)
+    {
+        *bytes = raw_frame_bytes;
+        *count = raw_frame_count;
+    }
+    UNLOCK(raw_frame_mutex)
+}
+
+void free_all_raw_frames()
+{
+    RELOCK(raw_frame_mutex)
+    {
+        while(raw_frames_recent.mru) free_raw_frame(LRU_ENTRY(raw_frames_recent.mru, struct raw_frame));
+    }
+    UNLOCK(raw_frame_mutex)
+}
+
+CREATE_MUTEX(chunk_pool_mutex)
+
+static struct mlv_chunks * chunk_pool = NULL;   /* most recently used first */
+static int chunk_pool_open_files = 0;
+static int chunk_pool_max_open_files = DEFAULT_MAX_OPEN_FILES;
+static int chunk_pool_use_mmap = 0;
+static int chunk_pool_io_policy = 0;
+
+//--direct-io: reads smaller than this still go through the page cache
+#define DIRECT_IO_MIN_SIZE (1024 * 1024)
+//offset, size and buffer address of reads without caching must be multiples of this
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_FD_NOT_OPEN -2
+
+static void free_chunks(struct mlv_chunks * chunks)
+{
+    for(uint32_t i = 0; i < chunks->chunk_count; i++)
+    {
+        close(chunks->fds[i]);
+        if(chunks->direct_fds && chunks->direct_fds[i] >= 0)
+        {
+            close(chunks->direct_fds[i]);
+        }
+#ifndef _WIN32
+        if(chunks->maps && chunks->maps[i] && chunks->maps[i] != MAP_FAILED)
+        {
+            munmap(chunks->maps[i], (size_t)chunks->map_sizes[i]);
+        }
+#endif
+    }
+    free(chunks->maps);
+    free(chunks->map_sizes);
+    free(chunks->map_mtimes);
+    free(chunks->direct_fds);
+    free(chunks->fds);
+    free(chunks->path);
+    free(chunks);
+}
+
+/**
+ * Opens the MLV and all its chunks (M00, M01 etc), like load_chunks() but with raw file descriptors
+ */
+static struct mlv_chunks * open_chunks(const char * path, struct stat * mlv_stat)
+{
+    struct mlv_chunks * chunks = (struct mlv_chunks *)malloc(sizeof(struct mlv_chunks));
+    if(!chunks) return NULL;
+    memset(chunks, 0, sizeof(struct mlv_chunks));
+
+    chunks->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
+    chunks->fds = (int *)malloc(sizeof(int) * MAX_CHUNK_COUNT);
+    char * filename = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
+    if(!chunks->path || !chunks->fds || !filename)
+    {
+        err_printf("malloc error\n");
+        free(filename);
+        free(chunks->fds);
+        free(chunks->path);
+        free(chunks);
+        return NULL;
+    }
+    strcpy(chunks->path, path);
+    strcpy(filename, path);
+    chunks->mlv_dev = mlv_stat->st_dev;
+    chunks->mlv_ino = mlv_stat->st_ino;
+    chunks->mlv_size = mlv_stat->st_size;
+    chunks->mlv_mtime = mlv_stat->st_mtime;
+
+    for(int seq_number = -1; seq_number < MAX_CHUNK_COUNT - 1; seq_number++)
+    {
+        if(seq_number >= 0)
+        {
+            char seq_name[3];
+            snprintf(seq_name, 3, "%02d", seq_number);
+            strcpy(&filename[strlen(filename) - 2], seq_name);
+        }
+
+        int fd = open(filename, O_RDONLY | O_BINARY);
+        if(fd < 0)
+        {
+            if(seq_number < 0)
+            {
+                int err = errno;
+                err_printf("open('%s') error: %s\n", filename, strerror(err));
+            }
+            break;
+        }
+        chunks->fds[chunks->chunk_count++] = fd;
+    }
+    free(filename);
+
+    if(!chunks->chunk_count)
+    {
+        free_chunks(chunks);
+        return NULL;
+    }
+    return chunks;
+}
+
+static void unlink_chunks(struct mlv_chunks * chunks)
+{
+    struct mlv_chunks * previous = NULL;
+    for(struct mlv_chunks * current = chunk_pool; current != NULL; current = current->next)
+    {
+        if(current == chunks)
+        {
+            if(previous) previous->next = current->next;
+            else chunk_pool = current->next;
+            chunk_pool_open_files -= chunks->chunk_count;
+            chunks->next = NULL;
+            return;
+        }
+        previous = current;
+    }
+}
+
+/**
+ * Closes the least recently used clips that are not in use, until the open file limit is met
+ * (call with the chunk_pool_mutex locked)
+ */
+static void chunk_pool_cleanup()
+{
+    while(chunk_pool_open_files > chunk_pool_max_open_files)
+    {
+        struct mlv_chunks * oldest_unused = NULL;
+        for(struct mlv_chunks * current = chunk_pool; current != NULL; current = current->next)
+        {
+            if(!current->refcount) oldest_unused = current;
+        }
+        if(!oldest_unused) break;
+        unlink_chunks(oldest_unused);
+        free_chunks(oldest_unused);
+    }
+}
+
+/**
+ * Finds a clip in the pool and moves it to the front (call with the chunk_pool_mutex locked)
+ * Stale clips are taken out of the pool, they are freed as soon as they are not in use anymore
+ */
+static struct mlv_chunks * find_chunks(const char * path, struct stat * mlv_stat)
+{
+    for(struct mlv_chunks * current = chunk_pool; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->path, path))
+        {
+            unlink_chunks(current);
+            if(current->stale || current->mlv_dev != mlv_stat->st_dev || current->mlv_ino != mlv_stat->st_ino ||
+               current->mlv_size != mlv_stat->st_size || current->mlv_mtime != mlv_stat->st_mtime)
+            {
+                current->stale = 1;
+                if(!current->refcount) free_chunks(current);
+                return NULL;
+            }
+            current->next = chunk_pool;
+            chunk_pool = current;
+            chunk_pool_open_files += current->chunk_count;
+            return current;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Retrieves the open chunk files of a MLV. They are shared between all threads and
+ * must only be read with mlvfs_read_chunk(). Release them with mlvfs_release_chunks()
+ * @return the chunks, or NULL if the MLV could not be opened
+ */
+struct mlv_chunks * mlvfs_open_chunks(const char * path)
+{
+    struct mlv_chunks * chunks = NULL;
+    struct stat mlv_stat;
+
+    if(stat(path, &mlv_stat))
+    {
+        int err = errno;
+        err_printf("stat('%s') error: %s\n", path, strerror(err));
+        return NULL;
+    }
+
+    RELOCK(chunk_pool_mutex)
+    {
+        chunks = find_chunks(path, &mlv_stat);
+        if(chunks) chunks->refcount++;
+    }
+    UNLOCK(chunk_pool_mutex)
+
+    if(chunks) return chunks;
+
+    //open outside of the lock, so other clips are not blocked
+    struct mlv_chunks * new_chunks = open_chunks(path, &mlv_stat);
+    if(!new_chunks) return NULL;
+
+    RELOCK(chunk_pool_mutex)
+    {
+        //another thread might have opened it in the meantime
+        chunks = find_chunks(path, &mlv_stat);
+        if(!chunks)
+        {
+            chunks = new_chunks;
+            new_chunks = NULL;
+            chunks->next = chunk_pool;
+            chunk_pool = chunks;
+            chunk_pool_open_files += chunks->chunk_count;
+        }
+        chunks->refcount++;
+        chunk_pool_cleanup();
+    }
+    UNLOCK(chunk_pool_mutex)
+
+    if(new_chunks) free_chunks(new_chunks);
+    return chunks;
+}
+
+//another reference to chunks that are already open, e.g. for a read that outlives the caller
+void mlvfs_retain_chunks(struct mlv_chunks * chunks)
+{
+    RELOCK(chunk_pool_mutex)
+    {
+        chunks->refcount++;
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+void mlvfs_release_chunks(struct mlv_chunks * chunks)
+{
+    if(!chunks) return;
+
+    RELOCK(chunk_pool_mutex)
+    {
+        chunks->refcount--;
+        if(!chunks->refcount && chunks->stale)
+        {
+            unlink_chunks(chunks);
+            free_chunks(chunks);
+        }
+        else
+        {
+            chunk_pool_cleanup();
+        }
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+#ifndef _WIN32
+/**
+ * With --direct-io, the chunk file opened a second time without caching
+ * @return the file descriptor, or -1 if the file system does not support that
+ */
+static int get_direct_fd(struct mlv_chunks * chunks, uint32_t chunk)
+{
+    int fd = -1;
+    RELOCK(chunk_pool_mutex)
+    {
+        if(!chunks->direct_fds)
+        {
+            chunks->direct_fds = (int *)malloc(sizeof(int) * chunks->chunk_count);
+            for(uint32_t i = 0; chunks->direct_fds && i < chunks->chunk_count; i++)
+            {
+                chunks->direct_fds[i] = DIRECT_FD_NOT_OPEN;
+            }
+        }
+
+        if(chunks->direct_fds && chunks->direct_fds[chunk] == DIRECT_FD_NOT_OPEN)
+        {
+            //same names as in open_chunks()
+            char * filename = (char*)malloc((sizeof(char) * (strlen(chunks->path) + 2)));
+            if(filename)
+            {
+                strcpy(filename, chunks->path);
+                if(chunk > 0) snprintf(&filename[strlen(filename) - 2], 3, "%02u", chunk - 1);
+#if defined(O_DIRECT)
+                chunks->direct_fds[chunk] = open(filename, O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+                chunks->direct_fds[chunk] = open(filename, O_RDONLY);
+                if(chunks->direct_fds[chunk] >= 0) fcntl(chunks->direct_fds[chunk], F_NOCACHE, 1);
+#else
+                chunks->direct_fds[chunk] = -1;
+#endif
+                if(chunks->direct_fds[chunk] < 0)
+                {
+                    int err = errno;
+                    err_printf("%s: could not open for direct I/O: %s\n", filename, strerror(err));
+                }
+                free(filename);
+            }
+        }
+
+        if(chunks->direct_fds) fd = chunks->direct_fds[chunk];
+    }
+    UNLOCK(chunk_pool_mutex)
+    return fd;
+}
+
+/**
+ * Reads around the page cache, through a bounce buffer unless the read is aligned already
+ * @return 1 if the read went through, 0 if it has to be done the normal way
+ */
+static int read_chunk_direct(struct mlv_chunks * chunks, uint32_t chunk, void * buffer, size_t size, uint64_t offset, size_t * result)
+{
+    int fd = get_direct_fd(chunks, chunk);
+    if(fd < 0) return 0;
+
+    uint64_t aligned_offset = offset & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1);
+    size_t head = (size_t)(offset - aligned_offset);
+    size_t aligned_size = (head + size + DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+
+    uint8_t * bounce = NULL;
+    if(!head && aligned_size == size && !((uintptr_t)buffer & (DIRECT_IO_ALIGNMENT - 1)))
+    {
+        bounce = (uint8_t *)buffer;
+    }
+    else if(posix_memalign((void **)&bounce, DIRECT_IO_ALIGNMENT, aligned_size))
+    {
+        return 0;
+    }
+
+    size_t bytes_done = 0;
+    int failed = 0;
+    while(bytes_done < aligned_size)
+    {
+        ssize_t bytes_read = pread(fd, bounce + bytes_done, aligned_size - bytes_done, (off_t)(aligned_offset + bytes_done));
+        if(bytes_read < 0)
+        {
+            int err = errno;
+            if(err == EINTR) continue;
+            if(err == EINVAL)
+            {
+                //the file system wants a different alignment (or none of this), stop trying
+                RELOCK(chunk_pool_mutex)
+                {
+                    if(chunks->direct_fds[chunk] == fd)
+                    {
+                        close(fd);
+                        chunks->direct_fds[chunk] = -1;
+                    }
+                }
+                UNLOCK(chunk_pool_mutex)
+            }
+            err_printf("%s: direct I/O error: %s\n", chunks->path, strerror(err));
+            failed = 1;
+            break;
+        }
+        bytes_done += bytes_read;
+        //a short read only happens at the end of the file, the next offset would not be aligned anyway
+        if(bytes_read == 0 || (bytes_read & (DIRECT_IO_ALIGNMENT - 1))) break;
+    }
+
+    if(!failed)
+    {
+        *result = bytes_done > head ? MIN(size, bytes_done - head) : 0;
+        if(bounce != buffer) memcpy(buffer, bounce + head, *result);
+    }
+    if(bounce != buffer) free(bounce);
+    return !failed;
+}
+#endif
+
+/**
+ * Reads from a chunk at an absolute position, without touching any shared file position
+ * @return the number of bytes read, short at the end of the file or after an error (which is reported)
+ */
+size_t mlvfs_read_chunk(struct mlv_chunks * chunks, uint32_t chunk, void * buffer, size_t size, uint64_t offset)
+{
+    if(chunk >= chunks->chunk_count)
+    {
+        //probably a chunk that was added after the clip was opened
+        err_printf("%s: chunk %u is not open\n", chunks->path, chunk);
+        RELOCK(chunk_pool_mutex)
+        {
+            chunks->stale = 1;
+        }
+        UNLOCK(chunk_pool_mutex)
+        return 0;
+    }
+
+    size_t result = 0;
+#ifndef _WIN32
+    if((chunk_pool_io_policy & MLVFS_IO_DIRECT) && size >= DIRECT_IO_MIN_SIZE && read_chunk_direct(chunks, chunk, buffer, size, offset, &result))
+    {
+        return result;
+    }
+#endif
+    while(result < size)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(OVERLAPPED));
+        overlapped.Offset = (DWORD)(offset + result);
+        overlapped.OffsetHigh = (DWORD)((offset + result) >> 32);
+        DWORD bytes_read = 0;
+        if(!ReadFile((HANDLE)_get_osfhandle(chunks->fds[chunk]), (uint8_t*)buffer + result, (DWORD)MIN(size - result, 0x40000000), &bytes_read, &overlapped))
+        {
+            if(GetLastError() != ERROR_HANDLE_EOF)
+            {
+                err_printf("%s: ReadFile error: %lu\n", chunks->path, GetLastError());
+            }
+            break;
+        }
+#else
+        ssize_t bytes_read = pread(chunks->fds[chunk], (uint8_t*)buffer + result, size - result, (off_t)(offset + result));
+        if(bytes_read < 0)
+        {
+            int err = errno;
+            if(err == EINTR) continue;
+            err_printf("%s: pread error: %s\n", chunks->path, strerror(err));
+            break;
+        }
+#endif
+        if(bytes_read == 0) break;
+        result += bytes_read;
+    }
+    return result;
+}
+
+/**
+ * With --mmap, the part of a chunk file that is mapped into memory (the whole file is mapped on first use)
+ * The pointer stays valid as long as the chunks are not released
+ * @return NULL if the range is not mapped (--mmap is off, mapping failed, it goes beyond the end of the file,
+ * or the file changed since it was mapped), read it with mlvfs_read_chunk() then
+ */
+const uint8_t * mlvfs_map_chunk(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, size_t size)
+{
+    const uint8_t * result = NULL;
+#ifndef _WIN32
+    if(!chunk_pool_use_mmap || chunk >= chunks->chunk_count) return NULL;
+
+    //touching a page past the end of a file that was truncated after mapping it is a SIGBUS, so check every time
+    struct stat chunk_stat;
+    if(fstat(chunks->fds[chunk], &chunk_stat)) return NULL;
+
+    RELOCK(chunk_pool_mutex)
+    {
+        if(!chunks->maps)
+        {
+            chunks->maps = (uint8_t **)calloc(chunks->chunk_count, sizeof(uint8_t *));
+            chunks->map_sizes = (uint64_t *)calloc(chunks->chunk_count, sizeof(uint64_t));
+            chunks->map_mtimes = (time_t *)calloc(chunks->chunk_count, sizeof(time_t));
+            if(!chunks->maps || !chunks->map_sizes || !chunks->map_mtimes)
+            {
+                free(chunks->maps);
+                free(chunks->map_sizes);
+                free(chunks->map_mtimes);
+                chunks->maps = NULL;
+                chunks->map_sizes = NULL;
+                chunks->map_mtimes = NULL;
+            }
+        }
+
+        if(chunks->maps && !chunks->maps[chunk])
+        {
+            //a failed mapping is remembered as MAP_FAILED, those reads go through mlvfs_read_chunk()
+            chunks->maps[chunk] = MAP_FAILED;
+            if(chunk_stat.st_size > 0 && (uint64_t)chunk_stat.st_size <= SIZE_MAX)
+            {
+                void * map = mmap(NULL, (size_t)chunk_stat.st_size, PROT_READ, MAP_SHARED, chunks->fds[chunk], 0);
+                if(map != MAP_FAILED)
+                {
+                    //frames are mostly read in order, and big pages keep the page tables small
+                    madvise(map, (size_t)chunk_stat.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+                    madvise(map, (size_t)chunk_stat.st_size, MADV_HUGEPAGE);
+#endif
+                    chunks->maps[chunk] = (uint8_t *)map;
+                    chunks->map_sizes[chunk] = (uint64_t)chunk_stat.st_size;
+                    chunks->map_mtimes[chunk] = chunk_stat.st_mtime;
+                }
+                else
+                {
+                    int err = errno;
+                    err_printf("%s: mmap error: %s\n", chunks->path, strerror(err));
+                }
+            }
+        }
+
+        if(chunks->maps && chunks->maps[chunk] != MAP_FAILED &&
+           ((uint64_t)chunk_stat.st_size != chunks->map_sizes[chunk] || chunk_stat.st_mtime != chunks->map_mtimes[chunk]))
+        {
+            //written to (or truncated) since: keep the mapping for whoever still uses it, but read the rest with pread
+            //and open the files again on the next use
+            chunks->stale = 1;
+        }
+        else if(chunks->maps && chunks->maps[chunk] != MAP_FAILED && offset <= chunks->map_sizes[chunk] && size <= chunks->map_sizes[chunk] - offset)
+        {
+            result = chunks->maps[chunk] + offset;
+        }
+    }
+    UNLOCK(chunk_pool_mutex)
+#endif
+    return result;
+}
+
+void mlvfs_set_mmap_chunks(int use_mmap)
+{
+    RELOCK(chunk_pool_mutex)
+    {
+        chunk_pool_use_mmap = use_mmap;
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+void mlvfs_set_max_open_files(int max_open_files)
+{
+    RELOCK(chunk_pool_mutex)
+    {
+        chunk_pool_max_open_files = max_open_files > 0 ? max_open_files : DEFAULT_MAX_OPEN_FILES;
+        chunk_pool_cleanup();
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+void mlvfs_set_io_policy(int policy)
+{
+#if defined(_WIN32) || (!defined(O_DIRECT) && !defined(F_NOCACHE))
+    if(policy & MLVFS_IO_DIRECT) err_printf("direct I/O is not supported on this platform\n");
+#endif
+#if defined(_WIN32) || (!defined(POSIX_FADV_WILLNEED) && !defined(F_RDADVISE))
+    if(policy & MLVFS_IO_WILLNEED) err_printf("read ahead hints are not supported on this platform\n");
+#endif
+#if defined(_WIN32) || !defined(POSIX_FADV_DONTNEED)
+    if(policy & MLVFS_IO_DONTNEED) err_printf("dropping pages from the cache is not supported on this platform\n");
+#endif
+    RELOCK(chunk_pool_mutex)
+    {
+        chunk_pool_io_policy = policy;
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+int mlvfs_get_io_policy()
+{
+    return chunk_pool_io_policy;
+}
+
+void mlvfs_advise_fd(int fd, uint64_t offset, uint64_t size, int advice)
+{
+    if(fd < 0 || !size || !(chunk_pool_io_policy & advice)) return;
+#ifndef _WIN32
+    if(advice == MLVFS_IO_WILLNEED)
+    {
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+        struct radvisory advisory;
+        advisory.ra_offset = (off_t)offset;
+        advisory.ra_count = (int)MIN(size, INT_MAX);
+        fcntl(fd, F_RDADVISE, &advisory);
+#endif
+    }
+    else if(advice == MLVFS_IO_DONTNEED)
+    {
+        //only pages completely within the range are dropped, a neighbouring frame sharing a page stays cached
+#if defined(POSIX_FADV_DONTNEED)
+        posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_DONTNEED);
+#endif
+    }
+#endif
+}
+
+void mlvfs_advise_chunk(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, uint64_t size, int advice)
+{
+    if(chunk < chunks->chunk_count)
+    {
+        mlvfs_advise_fd(chunks->fds[chunk], offset, size, advice);
+    }
+}
+
+void close_all_chunks()
+{
+    RELOCK(chunk_pool_mutex)
+    {
+        struct mlv_chunks * next = NULL;
+        struct mlv_chunks * current = chunk_pool;
+        while(current != NULL)
+        {
+            next = current->next;
+            free_chunks(current);
+            current = next;
+        }
+        chunk_pool = NULL;
+        chunk_pool_open_files = 0;
+    }
+    UNLOCK(chunk_pool_mutex)
+}
+
+/**
+ * The combined size and the latest mtime of all the chunk files of a recording (MLV, M00, M01 etc),
+ * so data appended to any of them, or a new chunk, is noticed
+ * @return 1 if successful, 0 if the MLV doesn't exist
+ */
+static int recording_stat(const char * path, off_t * size, time_t * mtime)
+{
+    struct stat file_stat;
+    *size = 0;
+    *mtime = 0;
+    if(stat(path, &file_stat)) return 0;
+    *size = file_stat.st_size;
+    *mtime = file_stat.st_mtime;
+
+    size_t path_size = strlen(path) + 1;
+    char * filename = (char*)malloc(path_size);
+    if(!filename) return 1;
+    strcpy(filename, path);
+    for(int seq_number = 0; seq_number < MAX_CHUNK_COUNT - 1; seq_number++)
+    {
+        char seq_name[3];
+        snprintf(seq_name, 3, "%02d", seq_number);
+        strcpy(&filename[path_size - 3], seq_name);
+        if(stat(filename, &file_stat)) break;
+        *size += file_stat.st_size;
+        *mtime = MAX(*mtime, file_stat.st_mtime);
+    }
+    free(filename);
+    return 1;
+}
+
+#define CLIP_PATH_BUCKET_COUNT 1024
+
+CREATE_MUTEX(clip_path_mutex)
+
+static struct clip_path_mapping * clip_paths[CLIP_PATH_BUCKET_COUNT];
+
+static uint32_t clip_path_hash(const char * virtual_path, size_t length)
+{
+    return (uint32_t)fnv1a_data(virtual_path, length, FNV1A_SEED);
+}
+
+static struct clip_path_mapping * find_clip_path(const char * virtual_path, size_t length, int name_scheme, uint32_t hash)
+{
+    //names are compared exactly, a miss only means the resolver has to parse the name itself
+    for(struct clip_path_mapping * current = clip_paths[hash % CLIP_PATH_BUCKET_COUNT]; current != NULL; current = current->next)
+    {
+        if(current->hash == hash && current->length == length && current->name_scheme == name_scheme && !memcmp(current->virtual_path, virtual_path, length))
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Looks up the real MLV for the virtual name of a clip directory
+ * @param virtual_path The virtual path, does not need to be null terminated
+ * @param mlv_path [out] Receives the path of the MLV
+ * @return 1 if found, 0 otherwise
+ */
+int mlvfs_lookup_clip_path(const char * virtual_path, size_t length, int name_scheme, char * mlv_path, size_t size)
+{
+    uint32_t hash = clip_path_hash(virtual_path, length);
+    int result = 0;
+
+    RELOCK(clip_path_mutex)
+    {
+        struct clip_path_mapping * mapping = find_clip_path(virtual_path, length, name_scheme, hash);
+        if(mapping && strlen(mapping->mlv_path) < size)
+        {
+            strcpy(mlv_path, mapping->mlv_path);
+            result = 1;
+        }
+    }
+    UNLOCK(clip_path_mutex)
+
+    return result;
+}
+
+void mlvfs_register_clip_path(const char * virtual_path, size_t length, int name_scheme, const char * mlv_path)
+{
+    uint32_t hash = clip_path_hash(virtual_path, length);
+
+    RELOCK(clip_path_mutex)
+    {
+        if(!find_clip_path(virtual_path, length, name_scheme, hash))
+        {
+            struct clip_path_mapping * mapping = (struct clip_path_mapping *)malloc(sizeof(struct clip_path_mapping));
+            if(mapping)
+            {
+                mapping->virtual_path = (char*)malloc(length + 1);
+                mapping->mlv_path = (char*)malloc(strlen(mlv_path) + 1);
+                if(mapping->virtual_path && mapping->mlv_path)
+                {
+                    memcpy(mapping->virtual_path, virtual_path, length);
+                    mapping->virtual_path[length] = 0;
+                    strcpy(mapping->mlv_path, mlv_path);
+                    mapping->hash = hash;
+                    mapping->length = length;
+                    mapping->name_scheme = name_scheme;
+                    mapping->next = clip_paths[hash % CLIP_PATH_BUCKET_COUNT];
+                    clip_paths[hash % CLIP_PATH_BUCKET_COUNT] = mapping;
+                }
+                else
+                {
+                    free(mapping->virtual_path);
+                    free(mapping->mlv_path);
+                    free(mapping);
+                }
+            }
+        }
+    }
+    UNLOCK(clip_path_mutex)
+}
+
+void free_all_clip_paths()
+{
+    RELOCK(clip_path_mutex)
+    {
+        for(int i = 0; i < CLIP_PATH_BUCKET_COUNT; i++)
+        {
+            struct clip_path_mapping * next = NULL;
+            struct clip_path_mapping * current = clip_paths[i];
+            while(current != NULL)
+            {
+                next = current->next;
+                free(current->virtual_path);
+                free(current->mlv_path);
+                free(current);
+                current = next;
+            }
+            clip_paths[i] = NULL;
+        }
+    }
+    UNLOCK(clip_path_mutex)
+}
+
+CREATE_MUTEX(clip_info_mutex)
+
+static struct frame_table * get_frame_table(const char * path, int check);
+
+static struct clip_info_mapping * clip_infos = NULL;
+
+static void make_clip_info(const char * path, struct clip_info * clip_info)
+{
+    struct frame_headers frame_headers;
+
+    memset(clip_info, 0, sizeof(struct clip_info));
+    clip_info->frame_count = mlv_get_frame_count(path);
+    clip_info->has_audio = has_audio(path);
+    if(mlv_get_frame_headers(path, 0, &frame_headers))
+    {
+        clip_info->has_headers = 1;
+        clip_info->width = frame_headers.rawi_hdr.xRes;
+        clip_info->height = frame_headers.rawi_hdr.yRes;
+        clip_info->year = 1900 + frame_headers.rtci_hdr.tm_year;
+        clip_info->month = frame_headers.rtci_hdr.tm_mon + 1;
+        clip_info->day = frame_headers.rtci_hdr.tm_mday;
+    }
+}
+
+/**
+ * Retrieves the basic properties of a clip. They are only looked up again when the size or mtime of its chunks change
+ * @return 1 if successful, 0 otherwise
+ */
+int mlvfs_get_clip_info(const char * path, struct clip_info * clip_info)
+{
+    off_t mlv_size;
+    time_t mlv_mtime;
+    int found = 0;
+
+    if(!recording_stat(path, &mlv_size, &mlv_mtime)) return 0;
+
+    RELOCK(clip_info_mutex)
+    {
+        for(struct clip_info_mapping * current = clip_infos; current != NULL; current = current->next)
+        {
+            if(!filename_strcmp(current->path, path))
+            {
+                if(current->mlv_size == mlv_size && current->mlv_mtime == mlv_mtime)
+                {
+                    *clip_info = current->clip_info;
+                    found = 1;
+                }
+                break;
+            }
+        }
+    }
+    UNLOCK(clip_info_mutex)
+
+    if(found) return 1;
+
+    //look it up outside of the lock, this may have to build the index
+    //the chunks changed (or it is the first lookup), make sure the frame table is not an older one either
+    mlvfs_release_frame_table(get_frame_table(path, 1));
+    make_clip_info(path, clip_info);
+
+    RELOCK(clip_info_mutex)
+    {
+        struct clip_info_mapping * mapping = NULL;
+        for(struct clip_info_mapping * current = clip_infos; current != NULL; current = current->next)
+        {
+            if(!filename_strcmp(current->path, path))
+            {
+                mapping = current;
+                break;
+            }
+        }
+        if(!mapping)
+        {
+            mapping = (struct clip_info_mapping *)malloc(sizeof(struct clip_info_mapping));
+            if(mapping)
+            {
+                memset(mapping, 0, sizeof(struct clip_info_mapping));
+                mapping->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
+                if(mapping->path)
+                {
+                    strcpy(mapping->path, path);
+                    mapping->next = clip_infos;
+                    clip_infos = mapping;
+                }
+                else
+                {
+                    free(mapping);
+                    mapping = NULL;
+                }
+            }
+        }
+        if(mapping)
+        {
+            mapping->mlv_size = mlv_size;
+            mapping->mlv_mtime = mlv_mtime;
+            mapping->clip_info = *clip_info;
+        }
+    }
+    UNLOCK(clip_info_mutex)
+
+    return 1;
+}
+
+void free_all_clip_infos()
+{
+    RELOCK(clip_info_mutex)
+    {
+        struct clip_info_mapping * next = NULL;
+        struct clip_info_mapping * current = clip_infos;
+        while(current != NULL)
+        {
+            next = current->next;
+            free(current->path);
+            free(current);
+            current = next;
+        }
+        clip_infos = NULL;
+    }
+    UNLOCK(clip_info_mutex)
+}
+
+CREATE_MUTEX(frame_table_mutex)
+
+static struct frame_table_mapping * frame_tables = NULL;
+
+static void free_frame_table_mapping(struct frame_table_mapping * mapping)
+{
+    DESTROY_LOCK(mapping->mutex);
+    free_frame_table(mapping->frame_table);
+    free(mapping->path);
+    free(mapping);
+}
+
+//call with frame_table_mutex held
+static void remove_frame_table_mapping(struct frame_table_mapping * mapping)
+{
+    struct frame_table_mapping * previous = NULL;
+    for(struct frame_table_mapping * current = frame_tables; current != NULL; current = current->next)
+    {
+        if(current == mapping)
+        {
+            if(previous) previous->next = current->next;
+            else frame_tables = current->next;
+            free_frame_table_mapping(current);
+            break;
+        }
+        previous = current;
+    }
+}
+
+//see mlvfs_get_frame_table(), with check set the chunks are checked for changes right away
+static struct frame_table * get_frame_table(const char * path, int check)
+{
+    struct frame_table_mapping * mapping = NULL;
+    struct frame_table * frame_table = NULL;
+    int changed = 0;
+
+    RELOCK(frame_table_mutex)
+    {
+        for(struct frame_table_mapping * current = frame_tables; current != NULL; current = current->next)
+        {
+            if(!current->stale && !filename_strcmp(current->path, path))
+            {
+                mapping = current;
+                break;
+            }
+        }
+        if(!mapping)
+        {
+            mapping = (struct frame_table_mapping *)malloc(sizeof(struct frame_table_mapping));
+            if(mapping)
+            {
+                memset(mapping, 0, sizeof(struct frame_table_mapping));
+                mapping->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
+                if(mapping->path)
+                {
+                    strcpy(mapping->path, path);
+                    INIT_LOCK(mapping->mutex);
+                    mapping->next = frame_tables;
+                    frame_tables = mapping;
+                }
+                else
+                {
+                    free(mapping);
+                    mapping = NULL;
+                }
+            }
+        }
+        if(mapping) mapping->refcount++;
+    }
+    UNLOCK(frame_table_mutex)
+
+    if(!mapping) return NULL;
+
+    //build outside of the global lock, so lookups for other clips are not blocked
+    RELOCK(mapping->mutex)
+    {
+        time_t now = time(NULL);
+        if(!mapping->frame_table)
+        {
+            //stat first, a change while the table is built is picked up by the next check
+            recording_stat(path, &mapping->mlv_size, &mapping->mlv_mtime);
+            mapping->checked = now;
+            mapping->frame_table = make_frame_table(path);
+        }
+        else if(check || now - mapping->checked >= FRAME_TABLE_CHECK_INTERVAL || now < mapping->checked)
+        {
+            off_t mlv_size;
+            time_t mlv_mtime;
+            recording_stat(path, &mlv_size, &mlv_mtime);
+            mapping->checked = now;
+            changed = mlv_size != mapping->mlv_size || mlv_mtime != mapping->mlv_mtime;
+        }
+        frame_table = mapping->frame_table;
+    }
+    UNLOCK(mapping->mutex)
+
+    if(changed || !frame_table)
+    {
+        RELOCK(frame_table_mutex)
+        {
+            //whoever still uses the old table frees it when they release it
+            if(changed) mapping->stale = 1;
+            mapping->refcount--;
+            if(mapping->stale && mapping->refcount == 0) remove_frame_table_mapping(mapping);
+        }
+        UNLOCK(frame_table_mutex)
+    }
+
+    //a new mapping, make_frame_table() only indexes what was appended
+    if(changed) return get_frame_table(path, 0);
+    return frame_table;
+}
+
+/**
+ * Retrieves the frame table for an MLV, building it on first use. The table is shared between all threads.
+ * At most every FRAME_TABLE_CHECK_INTERVAL seconds, the chunks of the MLV are checked for changes; if they
+ * were appended to or rewritten, the IDX file is brought up to date and a new table is made from it
+ * (whoever still uses the old table keeps it until they release it)
+ * Make sure you mlvfs_release_frame_table() the result!!!
+ */
+struct frame_table * mlvfs_get_frame_table(const char * path)
+{
+    return get_frame_table(path, 0);
+}
+
+void mlvfs_release_frame_table(struct frame_table * frame_table)
+{
+    if(!frame_table) return;
+
+    RELOCK(frame_table_mutex)
+    {
+        for(struct frame_table_mapping * current = frame_tables; current != NULL; current = current->next)
+        {
+            if(current->frame_table == frame_table && current->refcount > 0)
+            {
+                current->refcount--;
+                if(current->stale && current->refcount == 0) remove_frame_table_mapping(current);
+                break;
+            }
+        }
+    }
+    UNLOCK(frame_table_mutex)
+}
+
+void free_all_frame_tables()
+{
+    RELOCK(frame_table_mutex)
+    {
+        struct frame_table_mapping * next = NULL;
+        struct frame_table_mapping * current = frame_tables;
+        while(current != NULL)
+        {
+            next = current->next;
+            free_frame_table_mapping(current);
+            current = next;
+        }
+        frame_tables = NULL;
+    }
+    UNLOCK(frame_table_mutex)
+}
+
+CREATE_MUTEX(stat_table_mutex)
+
+static struct stat_table_mapping * stat_tables = NULL;
+
+static void set_stat_times(struct FUSE_STAT * stat, struct timespec * timespec_str)
+{
+#if __DARWIN_UNIX03
+    memcpy(&stat->st_atimespec, timespec_str, sizeof(struct timespec));
+    memcpy(&stat->st_birthtimespec, timespec_str, sizeof(struct timespec));
+    memcpy(&stat->st_ctimespec, timespec_str, sizeof(struct timespec));
+    memcpy(&stat->st_mtimespec, timespec_str, sizeof(struct timespec));
+#else
+    memcpy(&stat->st_atim, timespec_str, sizeof(struct timespec));
+    memcpy(&stat->st_ctim, timespec_str, sizeof(struct timespec));
+    memcpy(&stat->st_mtim, timespec_str, sizeof(struct timespec));
+#endif
+}
+
+/**
+ * Fills in the stat of every frame of a clip in one pass over the frame table. The RTCI of each
+ * header set is converted with mktime() only once, the frames are offset from it by their VIDF timestamps
+ */
+static struct FUSE_STAT * make_frame_stats(struct frame_table * frame_table)
+{
+    if(!frame_table->frame_count || !frame_table->header_count) return NULL;
+
+    struct FUSE_STAT * frame_stats = (struct FUSE_STAT *)calloc(frame_table->frame_count, sizeof(struct FUSE_STAT));
+    time_t * rtc_times = (time_t *)malloc(sizeof(time_t) * frame_table->header_count);
+    size_t * sizes = (size_t *)malloc(sizeof(size_t) * frame_table->header_count);
+    if(!frame_stats || !rtc_times || !sizes)
+    {
+        free(frame_stats);
+        free(rtc_times);
+        free(sizes);
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < frame_table->header_count; i++)
+    {
+        struct frame_headers * headers = &frame_table->headers[i];
+        struct tm tm_str;
+        memset(&tm_str, 0, sizeof(struct tm));
+        tm_str.tm_sec = headers->rtci_hdr.tm_sec;
+        tm_str.tm_min = headers->rtci_hdr.tm_min;
+        tm_str.tm_hour = headers->rtci_hdr.tm_hour;
+        tm_str.tm_mday = headers->rtci_hdr.tm_mday;
+        tm_str.tm_mon = headers->rtci_hdr.tm_mon;
+        tm_str.tm_year = headers->rtci_hdr.tm_year;
+        tm_str.tm_isdst = headers->rtci_hdr.tm_isdst;
+        rtc_times[i] = mktime(&tm_str);
+        sizes[i] = dng_get_size(headers);
+    }
+
+    for(uint32_t i = 0; i < frame_table->frame_count; i++)
+    {
+        struct frame_table_entry * frame = &frame_table->frames[i];
+        struct frame_headers * headers = &frame_table->headers[frame->headers];
+        struct FUSE_STAT * stat = &frame_stats[i];
+
+        //leave frames without a RAWI empty, like mlv_get_frame_headers() refuses them
+        if(memcmp(headers->rawi_hdr.blockType, "RAWI", 4)) continue;
+
+#ifdef ALLOW_WRITEABLE_DNGS
+        stat->st_mode = S_IFREG | 0666;
+#else
+        stat->st_mode = S_IFREG | 0444;
+#endif
+        stat->st_nlink = 1;
+        stat->st_size = sizes[frame->headers];
+
+        uint64_t delta = frame->vidf_hdr.timestamp - headers->rtci_hdr.timestamp;
+        struct timespec timespec_str;
+        timespec_str.tv_sec = rtc_times[frame->headers] + (time_t)(delta / 1000000);
+        timespec_str.tv_nsec = (long)((delta % 1000000) * 1000);
+        set_stat_times(stat, &timespec_str);
+    }
+
+    free(rtc_times);
+    free(sizes);
+    return frame_stats;
+}
+
+/**
+ * Retrieves the attributes of a DNG or EXR frame of a clip. The stats of all frames are
+ * made at once on first use and stay cached for as long as the frame table of the clip
+ * @param is_exr the size of the EXR is returned instead of the size of the DNG
+ * @return 1 if successful, 0 otherwise
+ */
+int mlvfs_get_frame_stat(const char * path, int frame_number, int is_exr, struct FUSE_STAT * stat)
+{
+    struct stat_table_mapping * mapping = NULL;
+    int result = 0;
+
+    RELOCK(stat_table_mutex)
+    {
+        for(struct stat_table_mapping * current = stat_tables; current != NULL; current = current->next)
+        {
+            if(!filename_strcmp(current->path, path))
+            {
+                mapping = current;
+                break;
+            }
+        }
+        if(!mapping)
+        {
+            mapping = (struct stat_table_mapping *)malloc(sizeof(struct stat_table_mapping));
+            if(mapping)
+            {
+                memset(mapping, 0, sizeof(struct stat_table_mapping));
+                mapping->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
+                if(mapping->path)
+                {
+                    strcpy(mapping->path, path);
+                    INIT_LOCK(mapping->mutex);
+                    mapping->next = stat_tables;
+                    stat_tables = mapping;
+                }
+                else
+                {
+                    free(mapping);
+                    mapping = NULL;
+                }
+            }
+        }
+    }
+    UNLOCK(stat_table_mutex)
+
+    if(!mapping) return 0;
+
+    struct frame_table * frame_table = mlvfs_get_frame_table(path);
+    if(!frame_table) return 0;
+    //the mapping keeps its reference on the table the stats were made from, so a newer table is never mistaken for it
+    struct frame_table * unused_table = frame_table;
+
+    RELOCK(mapping->mutex)
+    {
+        if(mapping->frame_table != frame_table || mapping->frame_count != frame_table->frame_count)
+        {
+            free(mapping->frame_stats);
+            mapping->frame_stats = make_frame_stats(frame_table);
+            unused_table = mapping->frame_table;
+            mapping->frame_table = frame_table;
+            mapping->frame_count = mapping->frame_stats ? frame_table->frame_count : 0;
+            mapping->exr_size = 0;
+        }
+
+        if(frame_number >= 0 && (uint32_t)frame_number < mapping->frame_count && mapping->frame_stats[frame_number].st_mode)
+        {
+            memcpy(stat, &mapping->frame_stats[frame_number], sizeof(struct FUSE_STAT));
+
+            if(is_exr)
+            {
+                //EXR sizes only depend on the resolution, which rarely changes within a clip
+                struct frame_headers * headers = &frame_table->headers[frame_table->frames[frame_number].headers];
+                if(!mapping->exr_size || mapping->exr_dng_size != (size_t)stat->st_size)
+                {
+                    mapping->exr_size = exr_get_size(headers, path);
+                    mapping->exr_dng_size = (size_t)stat->st_size;
+                }
+                stat->st_size = mapping->exr_size;
+            }
+            result = 1;
+        }
+    }
+    UNLOCK(mapping->mutex)
+
+    mlvfs_release_frame_table(unused_table);
+    return result;
+}
+
+void free_all_stat_tables()
+{
+    RELOCK(stat_table_mutex)
+    {
+        struct stat_table_mapping * next = NULL;
+        struct stat_table_mapping * current = stat_tables;
+        while(current != NULL)
+        {
             next = current->next;
+            DESTROY_LOCK(current->mutex);
+            mlvfs_release_frame_table(current->frame_table);
+            free(current->frame_stats);
             free(current->path);
-            free(current->attr);
             free(current);
             current = next;
         }
+        stat_tables = NULL;
+    }
+    UNLOCK(stat_table_mutex)
+}
+
+#define MAX_DNG_HEADER_COUNT 2048
+#define DNG_HEADER_BUCKET_COUNT 1024
+
+/*
+ * A file browser or a metadata tool reads the header of every frame of a clip, so this holds a
+ * few thousand of them, in a hash table by virtual path (clip and frame number) and a list ordered
+ * by last use. Only the header up to its last non-zero byte is kept (about a page, of 64 KB).
+ */
+CREATE_MUTEX(dng_header_mutex)
+static struct dng_header_mapping * dng_headers[DNG_HEADER_BUCKET_COUNT];
+static struct lru_list dng_headers_recent;
+static int dng_header_count = 0;
+
+static void free_dng_header(struct dng_header_mapping * dng_header)
+{
+    struct dng_header_mapping ** link = &dng_headers[dng_header->hash % DNG_HEADER_BUCKET_COUNT];
+    while(*link && *link != dng_header) link = &(*link)->next;
+    if(*link) *link = dng_header->next;
+    lru_unlink(&dng_headers_recent, &dng_header->lru);
+    dng_header_count--;
+
+    free(dng_header->path);
+    bufpool_free(dng_header->header);
+    free(dng_header);
+}
+
+//the part of the header that is cached, the rest reads as zeros
+static void copy_dng_header(struct dng_header_mapping * dng_header, char * buf, size_t offset, size_t size)
+{
+    size_t cached = offset < dng_header->size ? MIN(size, dng_header->size - offset) : 0;
+    if(cached) memcpy(buf, dng_header->header + offset, cached);
+    memset(buf + cached, 0, size - cached);
+}
+
+/**
+ * Reads from the DNG header of a frame without rendering the frame, the headers are cached per frame
+ * @param settings The mount options the header depends on, a header cached with other settings is made again
+ * @param header_cbr Makes the header, returns 0 if that is not possible without rendering the frame
+ * @return the number of bytes read, or -1 if the frame has to be rendered
+ */
+int mlvfs_read_dng_header(const char * path, uint64_t settings, int(*header_cbr)(const char *, uint8_t *, size_t), char * buf, off_t offset, size_t size)
+{
+    size_t header_size = dng_get_header_size();
+    if(offset < 0 || (size_t)offset >= header_size) return -1;
+    size_t read_size = MIN(size, header_size - (size_t)offset);
+    uint32_t hash = (uint32_t)fnv1a(path, FNV1A_SEED);
+    int found = 0;
+
+    RELOCK(dng_header_mutex)
+    {
+        for(struct dng_header_mapping * current = dng_headers[hash % DNG_HEADER_BUCKET_COUNT]; current != NULL; current = current->next)
+        {
+            if(current->hash == hash && current->settings == settings && !strcmp(current->path, path))
+            {
+                copy_dng_header(current, buf, (size_t)offset, read_size);
+                lru_unlink(&dng_headers_recent, &current->lru);
+                lru_push_front(&dng_headers_recent, &current->lru);
+                found = 1;
+                break;
+            }
+        }
+    }
+    UNLOCK(dng_header_mutex)
+
+    if(found) return (int)read_size;
+
+    //make it outside of the lock, if two threads make the same header, both are the same
+    uint8_t * header = bufpool_alloc(header_size);
+    if(!header) return -1;
+    if(!header_cbr(path, header, header_size))
+    {
+        bufpool_free(header);
+        return -1;
+    }
+
+    struct dng_header_mapping * new_header = malloc(sizeof(struct dng_header_mapping));
+    if(!new_header)
+    {
+        bufpool_free(header);
+        return -1;
+    }
+    memset(new_header, 0, sizeof(struct dng_header_mapping));
+    new_header->hash = hash;
+    new_header->settings = settings;
+    new_header->size = header_size;
+    while(new_header->size > 0 && !header[new_header->size - 1]) new_header->size--;
+    new_header->path = malloc(strlen(path) + 1);
+    new_header->header = bufpool_alloc(MAX(new_header->size, 1));
+    if(!new_header->path || !new_header->header)
+    {
+        free(new_header->path);
+        bufpool_free(new_header->header);
+        free(new_header);
+        //still good for this read
+        memcpy(buf, header + offset, read_size);
+        bufpool_free(header);
+        return (int)read_size;
+    }
+    strcpy(new_header->path, path);
+    memcpy(new_header->header, header, new_header->size);
+    bufpool_free(header);
+    copy_dng_header(new_header, buf, (size_t)offset, read_size);
+
+    RELOCK(dng_header_mutex)
+    {
+        //another thread made the same one at the same time
+        for(struct dng_header_mapping * current = dng_headers[hash % DNG_HEADER_BUCKET_COUNT]; current != NULL; current = current->next)
+        {
+            if(current->hash == hash && current->settings == settings && !strcmp(current->path, path))
+            {
+                free_dng_header(current);
+                break;
+            }
+        }
+
+        struct dng_header_mapping ** bucket = &dng_headers[hash % DNG_HEADER_BUCKET_COUNT];
+        new_header->next = *bucket;
+        *bucket = new_header;
+        lru_push_front(&dng_headers_recent, &new_header->lru);
+        dng_header_count++;
+
+        //drop the least recently used ones
+        while(dng_header_count > MAX_DNG_HEADER_COUNT && dng_headers_recent.lru)
+        {
+            free_dng_header(LRU_ENTRY(dng_headers_recent.lru, struct dng_header_mapping));
+        }
+    }
+    UNLOCK(dng_header_mutex)
+
+    return (int)read_size;
+}
+
+void free_all_dng_headers()
+{
+    RELOCK(dng_header_mutex)
+    {
+        while(dng_headers_recent.mru) free_dng_header(LRU_ENTRY(dng_headers_recent.mru, struct dng_header_mapping));
+    }
+    UNLOCK(dng_header_mutex)
+}
+
+CREATE_MUTEX(dual_iso_calibration_mutex)
+static struct dual_iso_calibration * dual_iso_calibrations = NULL;
+
+/**
+ * Whether the rendered frames of a clip turned out to be dual ISO (they get other black and white levels)
+ * @return 1 or 0, or -1 if no frame of the clip was rendered with this dual ISO mode yet
+ */
+int mlvfs_get_dual_iso_calibration(const char * path, int dual_iso_mode)
+{
+    int result = -1;
+    RELOCK(dual_iso_calibration_mutex)
+    {
+        for(struct dual_iso_calibration * current = dual_iso_calibrations; current != NULL; current = current->next)
+        {
+            if(current->dual_iso_mode == dual_iso_mode && !strcmp(current->path, path))
+            {
+                result = current->is_dual_iso;
+                break;
+            }
+        }
+    }
+    UNLOCK(dual_iso_calibration_mutex)
+    return result;
+}
+
+void mlvfs_set_dual_iso_calibration(const char * path, int dual_iso_mode, int is_dual_iso)
+{
+    RELOCK(dual_iso_calibration_mutex)
+    {
+        struct dual_iso_calibration * calibration = NULL;
+        for(struct dual_iso_calibration * current = dual_iso_calibrations; current != NULL; current = current->next)
+        {
+            if(current->dual_iso_mode == dual_iso_mode && !strcmp(current->path, path))
+            {
+                calibration = current;
+                break;
+            }
+        }
+        if(!calibration)
+        {
+            calibration = malloc(sizeof(struct dual_iso_calibration));
+            if(calibration)
+            {
+                calibration->path = malloc(strlen(path) + 1);
+                if(calibration->path)
+                {
+                    strcpy(calibration->path, path);
+                    calibration->dual_iso_mode = dual_iso_mode;
+                    calibration->next = dual_iso_calibrations;
+                    dual_iso_calibrations = calibration;
+                }
+                else
+                {
+                    free(calibration);
+                    calibration = NULL;
+                }
+            }
+        }
+        if(calibration) calibration->is_dual_iso = is_dual_iso;
+    }
+    UNLOCK(dual_iso_calibration_mutex)
+}
+
+void free_all_dual_iso_calibrations()
+{
+    RELOCK(dual_iso_calibration_mutex)
+    {
+        struct dual_iso_calibration * next = NULL;
+        for(struct dual_iso_calibration * current = dual_iso_calibrations; current != NULL; current = next)
+        {
+            next = current->next;
+            free(current->path);
+            free(current);
+        }
+        dual_iso_calibrations = NULL;
     }
-    UNLOCK(dng_attr_mapping_mutex)
-}
\ No newline at end of file
+    UNLOCK(dual_iso_calibration_mutex)
+}
@@ -21,59 +21,255 @@
 #ifndef mlvfs_resource_manager_h
 #define mlvfs_resource_manager_h
 
-//Uncomment to keep FILE* open and reuse them, this improves performance on OSX for exFAT filesystems, but causes "Bad file descriptor" errors when trying to read
-//#define KEEP_FILES_OPEN
-
 #include <stdio.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "mlv.h"
 
 #define THREAD_T pthread_t
 #define LOCK_T pthread_mutex_t
 
+//some macros for simple thread synchronization
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER; pthread_mutex_lock(&x);
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+#define CURRENT_THREAD (pthread_self())
+#define INIT_LOCK(x) pthread_mutex_init(&(x), NULL)
+#define DESTROY_LOCK(x) pthread_mutex_destroy(&(x))
+
+//seconds on a monotonic clock, for measuring how long something took
+double mlvfs_time(void);
+
+#define FNV1A_SEED 14695981039346656037ULL
+
+//FNV-1a of a string, continuing from seed (FNV1A_SEED, or the hash of what comes before it)
+uint64_t fnv1a(const char * string, uint64_t seed);
+//same as fnv1a(), for size bytes of anything
+uint64_t fnv1a_data(const void * data, size_t size, uint64_t seed);
+
+//a place in a list ordered by last use, the cached structures below have one named 'lru'
+struct lru_node
+{
+    struct lru_node * prev;         /* used more recently */
+    struct lru_node * next;         /* used less recently */
+};
+
+struct lru_list
+{
+    struct lru_node * mru;
+    struct lru_node * lru;
+};
+
+//the structure an lru_node is a part of, NULL for NULL
+#define LRU_ENTRY(node, type) ((node) ? (type *)((char *)(node) - offsetof(type, lru)) : NULL)
+
 struct image_buffer
 {
-    struct image_buffer * next;
+    struct image_buffer * next;     /* same hash bucket */
+    struct lru_node lru;
     char * dng_filename;
+    uint32_t hash;
+    uint64_t settings;              /* part of the key, see mlvfs_image_settings() */
+    int stale;                      /* rendered with settings that were changed since */
     size_t header_size;
     size_t size;
+    size_t charged;                 /* bytes counted against --cache-size */
     uint8_t * header;
     uint16_t * data;
     int free_flag;
     LOCK_T mutex;
-    int in_use;
+    int refcount;                   /* readers (and prefetch threads) using it, it is not freed while > 0 */
+    double last_used;               /* when it was looked up last, to find the oldest buffer of all shards */
+    int prefetched;                 /* rendered ahead of time and not read yet */
 };
 
 int create_preview(struct image_buffer * image_buffer);
 
-struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created);
-void release_image_buffer_by_path(const char * path);
+//default for --cache-size (MB of rendered frames)
+#define DEFAULT_CACHE_SIZE 256
+
+struct image_buffer * get_or_create_image_buffer(const char * path, uint64_t settings, int(*new_buffer_cbr)(struct image_buffer *), int * was_created);
 void free_all_image_buffers();
 void release_image_buffer(struct image_buffer * image_buffer);
+int has_image_buffer(const char * path, uint64_t settings);
+int prefetch_image_buffer(const char * path, uint64_t settings, int(*new_buffer_cbr)(struct image_buffer *));
+void invalidate_image_buffers(uint64_t(*settings_cbr)(const char *));
 int get_image_buffer_count();
+void mlvfs_set_cache_size(int megabytes);
+void get_image_cache_stats(uint64_t * bytes, int * count);
+
+//default for --raw-cache-size (MB of decoded frames)
+#define DEFAULT_RAW_CACHE_SIZE 128
 
+//a frame as it comes out of get_image_data(), before any post processing
+struct raw_frame
+{
+    struct raw_frame * next;        /* same hash bucket */
+    struct lru_node lru;
+    char * mlv_path;
+    uint32_t hash;
+    int frame_number;
+    uint32_t file_number;           /* where the frame was read from, a rewritten MLV has it somewhere else */
+    uint64_t position;
+    int refcount;                   /* being copied out, it is not freed while > 0 */
+    int stale;                      /* replaced, not in the cache anymore, the last one to release it frees it */
+    size_t size;
+    uint16_t * data;
+};
+
+int mlvfs_get_raw_frame(const char * mlv_path, int frame_number, uint32_t file_number, uint64_t position, uint16_t * data, size_t size);
+void mlvfs_put_raw_frame(const char * mlv_path, int frame_number, uint32_t file_number, uint64_t position, const uint16_t * data, size_t size);
+void mlvfs_set_raw_cache_size(int megabytes);
+void get_raw_cache_stats(uint64_t * bytes, int * count);
+void free_all_raw_frames();
+
+//default for --max-open-files
+#define DEFAULT_MAX_OPEN_FILES 256
+#define MAX_CHUNK_COUNT 100
+
+//the chunk files of a MLV (MLV, M00, M01...), opened once and shared by all threads
 struct mlv_chunks
 {
     struct mlv_chunks * next;
     char *path;
-    THREAD_T thread_id;
+    int refcount;
+    int stale;                      /* the files on disk changed, reopen on next use */
+    dev_t mlv_dev;
+    ino_t mlv_ino;
+    off_t mlv_size;
+    time_t mlv_mtime;
     uint32_t chunk_count;
-    FILE** chunks;
+    int * fds;
+    uint8_t ** maps;                /* --mmap: the mapped chunk files, created on first use */
+    uint64_t * map_sizes;
+    time_t * map_mtimes;            /* the mtime of the chunk files when they were mapped */
+    int * direct_fds;               /* --direct-io: the chunk files opened again without caching, created on first use */
 };
 
-FILE** mlvfs_load_chunks(const char * path, uint32_t * chunk_count);
-void mlvfs_close_chunks(FILE **chunk_files, uint32_t chunk_count);
+struct mlv_chunks * mlvfs_open_chunks(const char * path);
+void mlvfs_retain_chunks(struct mlv_chunks * chunks);
+void mlvfs_release_chunks(struct mlv_chunks * chunks);
+size_t mlvfs_read_chunk(struct mlv_chunks * chunks, uint32_t chunk, void * buffer, size_t size, uint64_t offset);
+const uint8_t * mlvfs_map_chunk(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, size_t size);
+void mlvfs_set_max_open_files(int max_open_files);
+void mlvfs_set_mmap_chunks(int use_mmap);
 void close_all_chunks();
 
+//how the chunk files are read (--readahead, --drop-behind, --direct-io), any combination of these
+#define MLVFS_IO_WILLNEED   1       /* the kernel reads the next frames ahead while the current one is processed */
+#define MLVFS_IO_DONTNEED   2       /* frames are dropped from the page cache once they were read */
+#define MLVFS_IO_DIRECT     4       /* large reads go around the page cache */
+
+void mlvfs_set_io_policy(int policy);
+int mlvfs_get_io_policy(void);
+//passes MLVFS_IO_WILLNEED or MLVFS_IO_DONTNEED on to the kernel for a range of a file, if the policy asks for it
+void mlvfs_advise_fd(int fd, uint64_t offset, uint64_t size, int advice);
+void mlvfs_advise_chunk(struct mlv_chunks * chunks, uint32_t chunk, uint64_t offset, uint64_t size, int advice);
+
+//virtual clip directory name (relative to the mount) -> real MLV, for --resolve-naming
+struct clip_path_mapping
+{
+    struct clip_path_mapping * next;
+    uint32_t hash;
+    int name_scheme;
+    size_t length;
+    char *virtual_path;
+    char *mlv_path;
+};
+
+int mlvfs_lookup_clip_path(const char * virtual_path, size_t length, int name_scheme, char * mlv_path, size_t size);
+void mlvfs_register_clip_path(const char * virtual_path, size_t length, int name_scheme, const char * mlv_path);
+void free_all_clip_paths();
+
+//what a directory listing needs to know about a clip, without reading the MLV again
+struct clip_info
+{
+    int frame_count;
+    int has_audio;
+    int has_headers;                /* the headers of the first frame could be read, the fields below are valid */
+    int width;
+    int height;
+    int year;
+    int month;
+    int day;
+};
+
+struct clip_info_mapping
+{
+    struct clip_info_mapping * next;
+    char *path;
+    off_t mlv_size;
+    time_t mlv_mtime;
+    struct clip_info clip_info;
+};
+
+int mlvfs_get_clip_info(const char * path, struct clip_info * clip_info);
+void free_all_clip_infos();
+
+//how often (seconds) a cached frame table is checked against the chunks of its MLV
+#define FRAME_TABLE_CHECK_INTERVAL 1
+
+struct frame_table_mapping
+{
+    struct frame_table_mapping * next;
+    char *path;
+    LOCK_T mutex;
+    int refcount;
+    int stale;
+    off_t mlv_size;                     /* all chunks together */
+    time_t mlv_mtime;                   /* the latest of all chunks */
+    time_t checked;
+    struct frame_table * frame_table;
+};
+
+struct frame_table * mlvfs_get_frame_table(const char * path);
+void mlvfs_release_frame_table(struct frame_table * frame_table);
+void free_all_frame_tables();
+
+//attributes of every DNG/EXR in a clip, so getattr doesn't have to look up the frame headers
+struct stat_table_mapping
+{
+    struct stat_table_mapping * next;
+    char *path;
+    LOCK_T mutex;
+    struct frame_table * frame_table;   /* the frame table the stats were made from (referenced) */
+    uint32_t frame_count;
+    struct FUSE_STAT * frame_stats;
+    size_t exr_size;
+    size_t exr_dng_size;                /* DNG size of the frame exr_size was computed for */
+};
+
+int mlvfs_get_frame_stat(const char * path, int frame_number, int is_exr, struct FUSE_STAT * stat);
+void free_all_stat_tables();
+
+//DNG headers made without rendering the frame, for reads that only touch the header
+struct dng_header_mapping
+{
+    struct dng_header_mapping * next;       /* same hash bucket */
+    struct lru_node lru;
+    char *path;
+    uint32_t hash;
+    uint64_t settings;
+    size_t size;                            /* up to the last non-zero byte, the rest of the header is zeros */
+    uint8_t * header;
+};
+
+int mlvfs_read_dng_header(const char * path, uint64_t settings, int(*header_cbr)(const char *, uint8_t *, size_t), char * buf, off_t offset, size_t size);
+void free_all_dng_headers();
 
-struct dng_attr_mapping
+struct dual_iso_calibration
 {
-    struct dng_attr_mapping * next;
+    struct dual_iso_calibration * next;
     char *path;
-    struct stat *attr;
+    int dual_iso_mode;
+    int is_dual_iso;
 };
 
-struct FUSE_STAT * lookup_dng_attr(const char * path);
-void register_dng_attr(const char * path, struct FUSE_STAT *attr);
-void free_dng_attr_mappings();
+int mlvfs_get_dual_iso_calibration(const char * path, int dual_iso_mode);
+void mlvfs_set_dual_iso_calibration(const char * path, int dual_iso_mode, int is_dual_iso);
+void free_all_dual_iso_calibrations();
 
 #endif
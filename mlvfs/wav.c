@@ -27,6 +27,7 @@
 #include "index.h"
 #include "mlvfs.h"
 #include "wav.h"
+#include "resource_manager.h"
 
 static const char * iXML =
 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
@@ -101,73 +102,23 @@ struct wav_header {
 
 int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr)
 {
-    FILE **chunk_files = NULL;
-    uint32_t chunk_count = 0;
+    struct frame_table *frame_table = mlvfs_get_frame_table(path);
     
-    chunk_files = load_chunks(path, &chunk_count);
-    if(!chunk_files || !chunk_count)
+    if(!frame_table || !frame_table->header_count || memcmp(frame_table->wavi_hdr.blockType, "WAVI", 4))
     {
+        mlvfs_release_frame_table(frame_table);
         return 0;
     }
     
-    mlv_xref_hdr_t *block_xref = get_index(path);
-    if (!block_xref)
-    {
-        close_chunks(chunk_files, chunk_count);
-        return 0;
-    }
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-    
-    int found_file = 0;
-    int found_wavi = 0;
-    int found_rtci = 0;
-    int found_idnt = 0;
-    mlv_hdr_t mlv_hdr;
-    uint32_t hdr_size;
-    
-    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount) && !(found_file && found_wavi && found_rtci && found_idnt); block_xref_pos++)
-    {
-        /* get the file and position of the next block */
-        uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
-        int64_t position = xrefs[block_xref_pos].frameOffset;
-        
-        /* select file */
-        FILE *in_file = chunk_files[in_file_num];
-        
-        file_set_pos(in_file, position, SEEK_SET);
-        fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file);
-        file_set_pos(in_file, position, SEEK_SET);
-        if(!memcmp(mlv_hdr.blockType, "MLVI", 4))
-        {
-            hdr_size = MIN(sizeof(mlv_file_hdr_t), mlv_hdr.blockSize);
-            fread(file_hdr, hdr_size, 1, in_file);
-            found_file = 1;
-        }
-        if(!memcmp(mlv_hdr.blockType, "WAVI", 4))
-        {
-            hdr_size = MIN(sizeof(mlv_wavi_hdr_t), mlv_hdr.blockSize);
-            fread(wavi_hdr, hdr_size, 1, in_file);
-            found_wavi = 1;
-        }
-        if(!memcmp(mlv_hdr.blockType, "RTCI", 4))
-        {
-            hdr_size = MIN(sizeof(mlv_rtci_hdr_t), mlv_hdr.blockSize);
-            fread(rtci_hdr, hdr_size, 1, in_file);
-            found_rtci = 1;
-        }
-        if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
-        {
-            hdr_size = MIN(sizeof(mlv_idnt_hdr_t), mlv_hdr.blockSize);
-            fread(idnt_hdr, hdr_size, 1, in_file);
-            found_idnt = 1;
-        }
-        if(found_file && found_wavi && found_rtci && found_idnt) break;
-    }
-    
-    free(block_xref);
-    close_chunks(chunk_files, chunk_count);
+    //the metadata in effect at the first frame is what describes the clip
+    struct frame_headers *headers = &frame_table->headers[0];
+    memcpy(file_hdr, &headers->file_hdr, sizeof(mlv_file_hdr_t));
+    memcpy(wavi_hdr, &frame_table->wavi_hdr, sizeof(mlv_wavi_hdr_t));
+    memcpy(rtci_hdr, &headers->rtci_hdr, sizeof(mlv_rtci_hdr_t));
+    memcpy(idnt_hdr, &headers->idnt_hdr, sizeof(mlv_idnt_hdr_t));
+    mlvfs_release_frame_table(frame_table);
     
-    return found_wavi;
+    return 1;
 }
 
 int has_audio(const char *path)
@@ -188,85 +139,51 @@ int has_audio(const char *path)
 
 size_t wav_get_data(const char *path, uint8_t * output_buffer, off_t offset, size_t max_size)
 {
-    mlv_file_hdr_t file_hdr;
-    mlv_wavi_hdr_t wavi_hdr;
-    mlv_rtci_hdr_t rcti_hdr;
-    mlv_idnt_hdr_t idnt_hdr;
+    struct frame_table *frame_table = mlvfs_get_frame_table(path);
     size_t size = wav_get_size(path);
-    size_t read = 0;
-    if(wav_get_headers(path, &file_hdr, &wavi_hdr, &rcti_hdr, &idnt_hdr))
+    if(!size || !frame_table)
     {
-        FILE **chunk_files = NULL;
-        uint32_t chunk_count = 0;
-        
-        chunk_files = load_chunks(path, &chunk_count);
-        if(!chunk_files || !chunk_count)
-        {
-            return 0;
-        }
-        mlv_xref_hdr_t *block_xref = get_index(path);
-        if (!block_xref)
-        {
-            close_chunks(chunk_files, chunk_count);
-            return 0;
-        }
-
-        long read_offset = MAX(0, MIN(offset, size));
-        long read_size = MAX(0, MIN(max_size, size - read_offset));
-        read = wav_get_data_direct(chunk_files, block_xref, &file_hdr, &wavi_hdr, &rcti_hdr, &idnt_hdr, size, output_buffer, read_offset, read_size);
+        mlvfs_release_frame_table(frame_table);
+        return 0;
+    }
 
-        free(block_xref);
-        close_chunks(chunk_files, chunk_count);
-        
-        return read;
+    struct mlv_chunks * chunks = mlvfs_open_chunks(path);
+    if(!chunks)
+    {
+        mlvfs_release_frame_table(frame_table);
+        return 0;
     }
-    return 0;
+
+    long read_offset = MAX(0, MIN(offset, size));
+    long read_size = MAX(0, MIN(max_size, size - read_offset));
+    size_t read = wav_get_data_direct(chunks, frame_table, size, output_buffer, read_offset, read_size);
+
+    mlvfs_release_chunks(chunks);
+    mlvfs_release_frame_table(frame_table);
+    return read;
 }
 
-size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv_file_hdr_t * mlv_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr, size_t file_size, uint8_t * output_buffer, off_t offset, size_t length)
+//the last AUDF payload that starts at or before this offset in the audio stream
+static uint32_t find_audio_entry(struct frame_table * frame_table, uint64_t audio_offset)
 {
-    struct wav_header header =
+    uint32_t low = 0;
+    uint32_t high = frame_table->audio_count;
+    while(high - low > 1)
     {
-        .RIFF = "RIFF",
-        .file_size = (uint32_t)file_size,
-        .WAVE = "WAVE",
-        .bext_id = "bext",
-        .bext_size = sizeof(struct wav_bext),
-        .bext.time_reference = 0,//(uint64_t)(rtci_hdr->tm_hour * 3600 + rtci_hdr->tm_min * 60 + rtci_hdr->tm_sec) * (uint64_t)wavi_hdr->samplingRate,
-        .iXML_id = "iXML",
-        .iXML_size = 1024,
-        .fmt = "fmt\x20",
-        .subchunk1_size = 16,
-        .audio_format = 1,
-        .num_channels = wavi_hdr->channels,
-        .sample_rate = wavi_hdr->samplingRate,
-        .byte_rate = wavi_hdr->bytesPerSecond,
-        .block_align = 4,
-        .bits_per_sample = wavi_hdr->bitsPerSample,
-        .data = "data",
-        .subchunk2_size = (uint32_t)(file_size - sizeof(struct wav_header) + 8),
-    };
-    
-    char temp[33];
-    snprintf(temp, sizeof(temp), "%s", idnt_hdr->cameraName);
-    memcpy(header.bext.originator, temp, 32);
-    snprintf(temp, sizeof(temp), "JPCAN%04d%.8s%02d%02d%02d%09d", idnt_hdr->cameraModel, idnt_hdr->cameraSerial , rtci_hdr->tm_hour, rtci_hdr->tm_min, rtci_hdr->tm_sec, rand());
-    memcpy(header.bext.originator_reference, temp, 32);
-    snprintf(temp, sizeof(temp), "%04d:%02d:%02d", 1900 + rtci_hdr->tm_year, rtci_hdr->tm_mon, rtci_hdr->tm_mday);
-    memcpy(header.bext.origination_date, temp, 10);
-    snprintf(temp, sizeof(temp), "%02d:%02d:%02d", rtci_hdr->tm_hour, rtci_hdr->tm_min, rtci_hdr->tm_sec);
-    memcpy(header.bext.origination_time, temp, 8);
-    
-    char * project = "Magic Lantern";
-    char * notes = "";
-    char * keywords = "";
-    int tape = 1;
-    int scene = 1;
-    int shot = 1;
-    int take = 1;
-    int fps_denom = mlv_hdr->sourceFpsDenom;
-    int fps_nom = mlv_hdr->sourceFpsNom;
-    snprintf(header.iXML, header.iXML_size, iXML, project, notes, keywords, tape, scene, shot, take, fps_nom, fps_denom, fps_nom, fps_denom, fps_nom, fps_denom);
+        uint32_t middle = low + (high - low) / 2;
+        if(frame_table->audio[middle].audio_offset <= audio_offset) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+size_t wav_get_data_direct(struct mlv_chunks * chunks, struct frame_table * frame_table, size_t file_size, uint8_t * output_buffer, off_t offset, size_t length)
+{
+    //the metadata in effect at the first frame is what describes the clip
+    mlv_file_hdr_t * mlv_hdr = &frame_table->headers[0].file_hdr;
+    mlv_wavi_hdr_t * wavi_hdr = &frame_table->wavi_hdr;
+    mlv_rtci_hdr_t * rtci_hdr = &frame_table->headers[0].rtci_hdr;
+    mlv_idnt_hdr_t * idnt_hdr = &frame_table->headers[0].idnt_hdr;
 
     int64_t output_position = 0;
     int64_t read_offset = offset;
@@ -274,6 +191,50 @@ size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv
 
     if(read_offset < sizeof(struct wav_header))
     {
+        struct wav_header header =
+        {
+            .RIFF = "RIFF",
+            .file_size = (uint32_t)file_size,
+            .WAVE = "WAVE",
+            .bext_id = "bext",
+            .bext_size = sizeof(struct wav_bext),
+            .bext.time_reference = 0,//(uint64_t)(rtci_hdr->tm_hour * 3600 + rtci_hdr->tm_min * 60 + rtci_hdr->tm_sec) * (uint64_t)wavi_hdr->samplingRate,
+            .iXML_id = "iXML",
+            .iXML_size = 1024,
+            .fmt = "fmt\x20",
+            .subchunk1_size = 16,
+            .audio_format = 1,
+            .num_channels = wavi_hdr->channels,
+            .sample_rate = wavi_hdr->samplingRate,
+            .byte_rate = wavi_hdr->bytesPerSecond,
+            .block_align = 4,
+            .bits_per_sample = wavi_hdr->bitsPerSample,
+            .data = "data",
+            .subchunk2_size = (uint32_t)(file_size - sizeof(struct wav_header) + 8),
+        };
+
+        //the header is made again for every read that touches it, so it must come out the same every time (strncpy zero pads)
+        char temp[33];
+        snprintf(temp, sizeof(temp), "%s", idnt_hdr->cameraName);
+        strncpy(header.bext.originator, temp, 32);
+        snprintf(temp, sizeof(temp), "JPCAN%04d%.8s%02d%02d%02d%09d", idnt_hdr->cameraModel, idnt_hdr->cameraSerial , rtci_hdr->tm_hour, rtci_hdr->tm_min, rtci_hdr->tm_sec, (int)(mlv_hdr->fileGuid % 1000000000));
+        strncpy(header.bext.originator_reference, temp, 32);
+        snprintf(temp, sizeof(temp), "%04d:%02d:%02d", 1900 + rtci_hdr->tm_year, rtci_hdr->tm_mon, rtci_hdr->tm_mday);
+        strncpy(header.bext.origination_date, temp, 10);
+        snprintf(temp, sizeof(temp), "%02d:%02d:%02d", rtci_hdr->tm_hour, rtci_hdr->tm_min, rtci_hdr->tm_sec);
+        strncpy(header.bext.origination_time, temp, 8);
+
+        char * project = "Magic Lantern";
+        char * notes = "";
+        char * keywords = "";
+        int tape = 1;
+        int scene = 1;
+        int shot = 1;
+        int take = 1;
+        int fps_denom = mlv_hdr->sourceFpsDenom;
+        int fps_nom = mlv_hdr->sourceFpsNom;
+        snprintf(header.iXML, header.iXML_size, iXML, project, notes, keywords, tape, scene, shot, take, fps_nom, fps_denom, fps_nom, fps_denom, fps_nom, fps_denom);
+
         long this_size = MIN(sizeof(struct wav_header) - read_offset, remaining);
         uint8_t *data_ptr = (uint8_t *)&header;
 
@@ -294,52 +255,32 @@ size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv
     /* header part was served, offset is now in wave data */
     read_offset -= sizeof(struct wav_header);
 
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-    mlv_audf_hdr_t audf_hdr;
-    int64_t audio_position = 0;
-
-    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount); block_xref_pos++)
+    /* only the payloads the read overlaps are touched */
+    for(uint32_t i = frame_table->audio_count ? find_audio_entry(frame_table, read_offset) : 0; i < frame_table->audio_count && remaining > 0; i++)
     {
-        if(xrefs[block_xref_pos].frameType == MLV_FRAME_AUDF)
+        struct audio_table_entry * audio = &frame_table->audio[i];
+        if(read_offset >= audio->audio_offset + audio->length)
         {
-            uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
-            int64_t position = xrefs[block_xref_pos].frameOffset;
-            FILE *in_file = chunk_files[in_file_num];
-
-            file_set_pos(in_file, position, SEEK_SET);
-            fread(&audf_hdr, sizeof(mlv_audf_hdr_t), 1, in_file);
-            if(!memcmp(audf_hdr.blockType, "AUDF", 4))
-            {
-                int64_t frame_size = audf_hdr.blockSize - sizeof(mlv_audf_hdr_t) - audf_hdr.frameSpace;
-                int64_t frame_end = audio_position + frame_size;
-
-                if(frame_end >= read_offset)
-                {
-                    int64_t this_offset = MAX(0, read_offset - audio_position);
-                    int64_t this_size = MIN(frame_size - this_offset, remaining);
-
-                    file_set_pos(in_file, position + sizeof(mlv_audf_hdr_t) + audf_hdr.frameSpace + this_offset, SEEK_SET);
-
-                    fread(&output_buffer[output_position], this_size, 1, in_file);
-
-                    output_position += this_size;
-                    read_offset += this_size;
-                    remaining -= this_size;
+            continue;
+        }
 
-                    /* all data read? */
-                    if (remaining == 0)
-                    {
-                        break;
-                    }
-                }
-                audio_position += frame_size;
-            }
+        int64_t this_offset = read_offset - audio->audio_offset;
+        int64_t this_size = MIN(audio->length - this_offset, remaining);
+        size_t this_read = mlvfs_read_chunk(chunks, audio->fileNumber, &output_buffer[output_position], this_size, audio->position + this_offset);
+        if(this_read < this_size)
+        {
+            memset(&output_buffer[output_position + this_read], 0, this_size - this_read);
         }
+
+        output_position += this_size;
+        read_offset += this_size;
+        remaining -= this_size;
     }
 
-    if(output_position < remaining)
+    /* the WAV is as long as the video, pad it with silence */
+    if(remaining > 0)
     {
-        memset(&output_buffer[output_position], 0, remaining - output_position);
+        memset(&output_buffer[output_position], 0, remaining);
     }
 
     return length;
@@ -347,28 +288,16 @@ size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv
 
 size_t wav_get_size(const char *path)
 {
-    size_t result = 0;
     mlv_file_hdr_t mlv_file_hdr;
     mlv_wavi_hdr_t mlv_wavi_hdr;
     mlv_rtci_hdr_t rcti_hdr;
     mlv_idnt_hdr_t idnt_hdr;
-    FILE * mlv_file = fopen(path, "rb");
-    if(mlv_file)
+
+    //prevent divide by zero errors
+    if(!wav_get_headers(path, &mlv_file_hdr, &mlv_wavi_hdr, &rcti_hdr, &idnt_hdr) || mlv_file_hdr.sourceFpsNom == 0)
     {
-        if(fread(&mlv_file_hdr, sizeof(mlv_file_hdr_t), 1, mlv_file) && !memcmp(mlv_file_hdr.fileMagic, "MLVI", 4) && wav_get_headers(path, &mlv_file_hdr, &mlv_wavi_hdr, &rcti_hdr, &idnt_hdr))
-        {
-            //prevent divide by zero errors
-            if(mlv_file_hdr.sourceFpsNom == 0)
-            {
-                result = 0;
-            }
-            else
-            {
-                result = sizeof(struct wav_header) + (uint64_t)mlv_wavi_hdr.bytesPerSecond * (uint64_t)mlv_file_hdr.sourceFpsDenom * (uint64_t)mlv_get_frame_count(path) / (uint64_t)mlv_file_hdr.sourceFpsNom;
-            }
-        }
-        fclose(mlv_file);
+        return 0;
     }
-    
-    return result;
+
+    return sizeof(struct wav_header) + (uint64_t)mlv_wavi_hdr.bytesPerSecond * (uint64_t)mlv_file_hdr.sourceFpsDenom * (uint64_t)mlv_get_frame_count(path) / (uint64_t)mlv_file_hdr.sourceFpsNom;
 }
@@ -23,9 +23,12 @@
 
 #include <sys/types.h>
 
+struct mlv_chunks;
+struct frame_table;
+
 int has_audio(const char * path);
 size_t wav_get_data(const char * path, uint8_t * output_buffer, off_t offset, size_t max_size);
-size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv_file_hdr_t * mlv_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr, size_t file_size, uint8_t * output_buffer, off_t offset, size_t length);
+size_t wav_get_data_direct(struct mlv_chunks * chunks, struct frame_table * frame_table, size_t file_size, uint8_t * output_buffer, off_t offset, size_t length);
 size_t wav_get_size(const char * path);
 int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr);
 
@@ -34,6 +34,9 @@
 #include "index.h"
 #include "resource_manager.h"
 #include "webgui.h"
+#include "preindex.h"
+#include "bufpool.h"
+#include "lowlevel.h"
 #include "mongoose/mongoose.h"
 
 static int halt_webgui = 0;
@@ -144,10 +147,15 @@ static void webgui_generate_mlv_html(char * html, const char * path)
     char * temp = malloc(sizeof(char) * HTML_SIZE);
     sprintf(real_path, "%s%s", mlvfs_config->mlv_path, path);
     fprintf(stderr, "webgui: analyzing %s...\n", real_path);
-    int frame_count = mlv_get_frame_count(real_path);
+    struct clip_info clip_info;
+    if(!mlvfs_get_clip_info(real_path, &clip_info))
+    {
+        memset(&clip_info, 0, sizeof(struct clip_info));
+    }
+    int frame_count = clip_info.frame_count;
     snprintf(temp, HTML_SIZE, "<td>%d</td>", frame_count);
     strncat(html, temp, HTML_SIZE);
-    snprintf(temp, HTML_SIZE, "<td>%s</td>", has_audio(real_path) ? "yes" : "no");
+    snprintf(temp, HTML_SIZE, "<td>%s</td>", clip_info.has_audio ? "yes" : "no");
     strncat(html, temp, HTML_SIZE);
     struct frame_headers frame_headers;
     if(mlv_get_frame_headers(real_path, 0, &frame_headers))
@@ -280,11 +288,30 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
     {
         if (strcmp(conn->uri, "/get_value") == 0)
         {
+            int preindex_done = 0;
+            int preindex_total = 0;
+            uint64_t index_bytes = 0;
+            double index_seconds = 0;
+            uint64_t cache_bytes = 0;
+            int cache_count = 0;
+            uint64_t raw_cache_bytes = 0;
+            int raw_cache_count = 0;
+            uint64_t pool_hits = 0;
+            uint64_t pool_misses = 0;
+            uint64_t pool_idle_bytes = 0;
+            preindex_get_progress(&preindex_done, &preindex_total);
+            get_index_scan_stats(&index_bytes, &index_seconds);
+            get_image_cache_stats(&cache_bytes, &cache_count);
+            get_raw_cache_stats(&raw_cache_bytes, &raw_cache_count);
+            bufpool_get_stats(&pool_hits, &pool_misses, &pool_idle_bytes);
 			mg_send_header(conn, "Content-Type", "application/json");
             mg_printf_data(conn,
                            "{\"fps\": \"%f\", \"deflicker\": \"%d\", \"name_scheme\": %d, \"badpix\": %d, \"chroma_smooth\": %d, \"stripes\": %d,\
                             \"fix_pattern_noise\": %d, \"dual_iso\": %d, \"hdr_interpolation_method\": %d, \"hdr_no_alias_map\": %d, \"hdr_no_fullres\": %d, \"format_exr\": %d, \"white_balance\": \"%d\",\
-                            \"headroom\": %f, \"highlight\": %d, \"debayer\": %d, \"compress_dng\": %d}",
+                            \"headroom\": %f, \"highlight\": %d, \"debayer\": %d, \"compress_dng\": %d,\
+                            \"preindex_done\": %d, \"preindex_total\": %d, \"index_mbps\": %.1f,\
+                            \"cache_size\": %d, \"cache_used\": %.1f, \"cache_count\": %d, \"raw_cache_used\": %.1f, \"raw_cache_count\": %d,\
+                            \"pool_hit_rate\": %.1f, \"pool_idle\": %.1f}",
                            mlvfs_config->fps,
                            mlvfs_config->deflicker,
                            mlvfs_config->name_scheme,
@@ -301,12 +328,29 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
                            mlvfs_config->headroom,
                            mlvfs_config->highlight,
                            mlvfs_config->debayer,
-                           mlvfs_config->compress_dng);
+                           mlvfs_config->compress_dng,
+                           preindex_done,
+                           preindex_total,
+                           index_seconds > 0 ? index_bytes / 1048576.0 / index_seconds : 0,
+                           mlvfs_config->cache_size > 0 ? mlvfs_config->cache_size : DEFAULT_CACHE_SIZE,
+                           cache_bytes / 1048576.0,
+                           cache_count,
+                           raw_cache_bytes / 1048576.0,
+                           raw_cache_count,
+                           pool_hits + pool_misses > 0 ? pool_hits * 100.0 / (pool_hits + pool_misses) : 0,
+                           pool_idle_bytes / 1048576.0);
         }
         else if (strcmp(conn->uri, "/set_value") == 0)
         {
             // This Ajax endpoint sets the new value for the device variable
             char buf[100] = "";
+
+            //what the files look like before, most requests change only one value, if any
+            uint64_t dng_settings = mlvfs_dng_settings();
+            uint64_t exr_settings = mlvfs_exr_settings();
+            int name_scheme = mlvfs_config->name_scheme;
+            int format_exr = mlvfs_config->format_exr;
+
             mg_get_var(conn, "fps", buf, sizeof(buf));
             if(strlen(buf) > 0) mlvfs_config->fps = atof(buf);
             
@@ -357,6 +401,28 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
 
             mg_get_var(conn, "compress_dng", buf, sizeof(buf));
             if(strlen(buf) > 0) mlvfs_config->compress_dng = atoi(buf);
+
+            mg_get_var(conn, "cache_size", buf, sizeof(buf));
+            if(strlen(buf) > 0)
+            {
+                mlvfs_config->cache_size = atoi(buf);
+                mlvfs_set_cache_size(mlvfs_config->cache_size);
+            }
+
+            int settings_changed = dng_settings != mlvfs_dng_settings() || exr_settings != mlvfs_exr_settings();
+            if(settings_changed)
+            {
+                //frames rendered with the old settings won't be read again
+                invalidate_image_buffers(&mlvfs_image_settings);
+            }
+
+#ifndef _WIN32
+            //the kernel may still have frames rendered with the old settings, or the old file names
+            if(mlvfs_config->lowlevel && (settings_changed || name_scheme != mlvfs_config->name_scheme || format_exr != mlvfs_config->format_exr))
+            {
+                lowlevel_invalidate_cache();
+            }
+#endif
             
             mg_printf_data(conn, "%s", "{\"success\": true}");
         }
@@ -388,7 +454,7 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
         else if(string_ends_with(conn->uri, "_PREVIEW.gif"))
         {
             int was_created;
-            struct image_buffer * image_buffer = get_or_create_image_buffer(conn->uri, &create_preview, &was_created);
+            struct image_buffer * image_buffer = get_or_create_image_buffer(conn->uri, 0, &create_preview, &was_created);
             mg_send_header(conn, "Content-Type", "image/gif");
             mg_send_data(conn, image_buffer->data, (int)image_buffer->size);
             release_image_buffer(image_buffer);